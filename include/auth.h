@@ -30,6 +30,8 @@ struct u_class_block {
 	char name[MAXCLASSNAME+1];
 	int timeout;
 	int sendq;
+	int recvq; /* 0 for the link type's default */
+	int weight; /* share of input processing. see link.c */
 };
 
 struct u_auth_block {
@@ -39,6 +41,9 @@ struct u_auth_block {
 	u_cidr cidr;
 	char pass[MAXPASSWORD+1];
 	mowgli_node_t n;
+
+	uint order; /* position in the config */
+	u_auth_block *net_next; /* other blocks for the same network */
 };
 
 struct u_oper_block {
@@ -70,7 +75,13 @@ extern u_map *all_links;
 extern void oper_up(u_sourceinfo*, u_oper_block*);
 
 extern u_auth_block *u_find_auth(u_link*);
+
+/* like u_find_auth, but passwords are checked by the verify threads.
+   cb gets the block, or NULL if there isn't one, possibly before this
+   returns. it isn't called at all if the link goes away first */
+extern void u_find_auth_async(u_link*, void (*cb)(u_link*, u_auth_block*));
 extern u_oper_block *u_get_oper_by_name(char*);
+/* a NULL password leaves checking it to the caller */
 extern u_oper_block *u_find_oper(u_auth_block*, char*, char*);
 extern u_link_block *u_find_link(char *name);
 
@@ -0,0 +1,57 @@
+/* Tethys, ban.h -- compiled ban lists
+   Copyright (C) 2014 Alex Iadicicco
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+#ifndef __INC_BAN_H__
+#define __INC_BAN_H__
+
+/* A ban list is compiled from a channel's list of u_listent when it's
+   next needed after a change. Masks are sorted by kind so most of them
+   never get near match():
+
+    - masks without wildcards are looked up in a hash of whole prefixes
+    - *!*@host is looked up in a hash of hosts
+    - *!*@*host compares the end of the user's host
+    - *!*@addr/bits compares the user's IP with the network
+    - extbans are parsed ahead of time
+    - anything else is a glob, which is only matched after the literal
+      text before its first wildcard and after its last one agrees, and
+      the longest literal run in between is found somewhere
+
+   Compiled lists copy what they need, so they don't care what happens
+   to the u_listent afterwards. */
+
+typedef struct u_banlist u_banlist;
+
+struct u_chan;
+struct u_user;
+struct ban_suffix;
+struct ban_cidr;
+struct ban_ext;
+struct ban_glob;
+
+struct u_banlist {
+	ulong gen; /* whatever the caller compiled it at */
+
+	u_hash *exact;
+	u_hash *hosts;
+	struct ban_suffix *suffixes;
+	struct ban_cidr *cidrs;
+	struct ban_ext *exts;
+	struct ban_glob *globs;
+	uint nsuffixes, ncidrs, nexts, nglobs;
+
+	char *strings; /* everything above points in here */
+};
+
+extern u_banlist *u_banlist_compile(mowgli_list_t*, ulong gen);
+extern void u_banlist_free(u_banlist*);
+
+extern bool u_banlist_match(u_banlist*, struct u_chan*, struct u_user*);
+
+/* whether a match depends on more than the user's prefix and IP */
+#define U_BANLIST_HAS_EXT(BL) ((BL)->nexts > 0)
+
+#endif
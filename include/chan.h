@@ -47,25 +47,49 @@ typedef struct u_cu_pfx u_cu_pfx;
 struct u_chan {
 	u_ts_t ts;
 	char name[MAXCHANNAME+1];
+	uint namehash; /* in all_chans */
 	char topic[MAXTOPICLEN+1];
 	char topic_setter[MAXNICKLEN+1];
 	u_ts_t topic_time;
 	uint mode, flags;
 	u_cookie ck_flags;
-	u_map *members;
+	/* memberships, in no particular order. removing one moves the
+	   last into its place */
+	u_chanuser **members;
+	uint nmembers, maxmembers;
+	/* distinct links with members behind them, mapped to the number
+	   of members reached through each. used for fanout. */
+	u_map *local_links;
+	u_map *remote_links;
 	mowgli_list_t ban, quiet, banex, invex;
+	/* compiled copies of the lists above, rebuilt when they're next
+	   needed after lists_gen moves. see u_chan_lists_changed */
+	ulong lists_gen;
+	u_banlist *cban, *cquiet, *cbanex, *cinvex;
 	u_map *invites;
 	char *forward, *key;
 	int limit;
 };
 
+/* a chanuser sits in both c->members and u->channels, and knows its
+   index in each so it can be taken out of either by swapping the last
+   entry into its place. u_chan_user_find goes through a hash on the
+   user, chained through hash_next */
 struct u_chanuser {
 	uint flags;
 	u_cookie ck_flags;
 	u_chan *c;
 	u_user *u;
+	uint c_idx, u_idx;
+	u_chanuser *hash_next;
 };
 
+/* these don't allow adding or removing members while iterating */
+#define U_CHAN_EACH_MEMBER(C, I, CU) \
+	for ((I) = 0; (I) < (C)->nmembers && ((CU) = (C)->members[I]); (I)++)
+#define U_USER_EACH_CHAN(U, I, CU) \
+	for ((I) = 0; (I) < (U)->nchannels && ((CU) = (U)->channels[I]); (I)++)
+
 struct u_cu_pfx {
 	mowgli_node_t n;
 
@@ -74,7 +98,7 @@ struct u_cu_pfx {
 	char prefix;
 };
 
-extern mowgli_patricia_t *all_chans;
+extern u_hash *all_chans;
 
 extern u_mode_info cmode_infotab[128];
 extern u_mode_ctx cmodes;
@@ -113,6 +137,9 @@ extern u_chanuser *u_chan_user_add(u_chan*, u_user*);
 extern void u_chan_user_del(u_chanuser*);
 extern u_chanuser *u_chan_user_find(u_chan*, u_user*);
 
+/* call after changing c->ban, c->quiet, c->banex or c->invex */
+extern void u_chan_lists_changed(u_chan*);
+
 extern int u_entry_blocked(u_chan*, u_user*, char *key);
 extern u_chan *u_find_forward(u_chan*, u_user*, char *key);
 extern int u_is_muted(u_chanuser*);
@@ -24,7 +24,13 @@ struct u_conn_ctx {
 	void (*fatal_error)(u_conn*, const char*, int err);
 	void (*cleanup)(u_conn*);
 
+	/* drain: part of the send queue has just been written out.
+	   run: the conn's turn in the run queue. return true if there's
+	   still more to do. */
+
 	void (*data_ready)(u_conn*);
+	void (*drain)(u_conn*);
+	bool (*run)(u_conn*);
 	void (*end_of_stream)(u_conn*);
 	void (*rdns_start)(u_conn*);
 	void (*rdns_finish)(u_conn*, const char*);
@@ -52,15 +58,29 @@ enum u_conn_state {
 	U_CONN_AWAIT_CLEANUP,
 };
 
+/* conn flags */
+#define U_CONN_DIRTY            0x0001  /* on the list of conns to flush */
+#define U_CONN_RUNNABLE         0x0002  /* on the run queue, not reading */
+
 struct u_conn {
 	mowgli_node_t n;
+	mowgli_node_t dirty_n;
+	mowgli_node_t run_n;
 
 	u_conn_state state;
+	uint flags;
 
 	mowgli_eventloop_pollable_t *poll;
+	struct sockaddr_storage addr; /* the same as ip */
+	socklen_t addrlen;
 	char ip[INET6_ADDRSTRLEN];
 	char host[U_CONN_HOSTSIZE];
-	mowgli_dns_query_t *dnsq;
+	u_dns_req *dnsq;
+
+	/* what the pollable is currently selected for, so updates that
+	   don't change anything don't have to go to the eventloop */
+	mowgli_eventloop_io_cb_t *recv_cb;
+	mowgli_eventloop_io_cb_t *send_cb;
 
 	u_sendq sendq;
 
@@ -75,6 +95,9 @@ extern u_conn *u_conn_connect(mowgli_eventloop_t*, u_conn_ctx*, void*,
                               ulong flags, const struct sockaddr*, socklen_t);
 
 extern void u_conn_shut_down(u_conn*);
+/* like shut_down, but anything still in the send queue is thrown away.
+   for when the other end isn't reading anymore */
+extern void u_conn_close(u_conn*);
 
 extern ssize_t u_conn_recv(u_conn*, uchar*, size_t sz);
 extern ssize_t u_conn_send(u_conn*, const uchar*, size_t sz);
@@ -83,8 +106,15 @@ extern ssize_t u_conn_send(u_conn*, const uchar*, size_t sz);
 extern uchar *u_conn_get_send_buffer(u_conn*, size_t sz);
 extern size_t u_conn_end_send_buffer(u_conn*, size_t sz);
 
+extern size_t u_conn_put_line(u_conn*, u_sendq_line*);
+extern void u_conn_put_sendq(u_conn*, u_sendq*);
+
 extern void u_conn_sendq_clear(u_conn*);
 
+/* puts the conn on the run queue. it stops reading and gets its run
+   callback once per eventloop iteration until that returns false */
+extern void u_conn_schedule(u_conn*);
+
 extern void u_conn_run(mowgli_eventloop_t *ev);
 
 extern int init_conn(void);
@@ -21,4 +21,8 @@ struct u_crypto {
 extern void u_crypto_gen_salt(char *buf);
 extern void u_crypto_hash(char *buf, char *key, char *salt);
 
+/* whether key hashes to hash. doesn't log, so it's safe to call from
+   the verify threads */
+extern bool u_crypto_check(char *hash, char *key);
+
 #endif
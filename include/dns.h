@@ -0,0 +1,40 @@
+/* Tethys, dns.h -- cached reverse DNS
+   Copyright (C) 2014 Alex Iadicicco
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+#ifndef __INC_DNS_H__
+#define __INC_DNS_H__
+
+/* Reverse lookups for connecting clients go through a cache of recent
+   answers, good and bad, keyed by address. Lookups for an address that
+   already has one in progress wait for that one instead of sending
+   another query, so a crowd reconnecting from behind the same NAT only
+   costs one.
+
+   A name from a PTR record is only used if looking it up again gives
+   back the same address. v4-mapped v6 addresses are looked up as the
+   v4 address they are. */
+
+typedef struct u_dns_req u_dns_req;
+typedef struct u_dns_stats u_dns_stats;
+
+/* host is the confirmed name, or NULL with err saying why there isn't
+   one */
+typedef void (u_dns_cb_t)(const char *host, const char *err, void *priv);
+
+/* cached answers are given straight away, in which case this returns
+   NULL. otherwise cb is called later, unless the request is cancelled
+   first */
+extern u_dns_req *u_dns_rdns(const struct sockaddr*, u_dns_cb_t*, void*);
+extern void u_dns_cancel(u_dns_req*);
+
+struct u_dns_stats {
+	ulong hits, misses, coalesced;
+	ulong entries, pending, evicted;
+};
+
+extern void u_dns_get_stats(u_dns_stats*);
+
+#endif
@@ -0,0 +1,56 @@
+/* Tethys, hash.h -- case-folded string hash tables
+   Copyright (C) 2014 Alex Iadicicco
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+#ifndef __INC_HASH_H__
+#define __INC_HASH_H__
+
+/* An index from case-folded names to objects. The table doesn't copy
+   keys; the key pointer passed to u_hash_add must stay valid, and keep
+   the same folded value, for as long as the object is in the table.
+   Callers compute the hash with u_hash_key and keep it in the object,
+   so deleting and renaming never have to hash the old name again.
+
+   Iteration is in insertion order. Deleting during iteration is fine,
+   adding is not. */
+
+typedef struct u_hash u_hash;
+typedef struct u_hash_ent u_hash_ent; /* defined internally */
+
+struct u_hash {
+	const char *casemap;
+
+	/* groups of 16 one-byte tags, each with a matching index into
+	   ents. see hash.c */
+	uchar *tags;
+	uint *slots;
+	uint ngroups;
+	uint used; /* tags that aren't empty, including deleted ones */
+
+	u_hash_ent *ents;
+	uint nents, maxents; /* nents includes holes */
+	uint size;
+};
+
+extern u_hash *u_hash_new(const char *casemap);
+extern void u_hash_free(u_hash*);
+
+extern uint u_hash_key(u_hash*, const char *key);
+
+extern void *u_hash_get(u_hash*, const char *key);
+extern void *u_hash_get_h(u_hash*, const char *key, uint hash);
+extern void u_hash_add(u_hash*, const char *key, uint hash, void *data);
+extern void u_hash_del(u_hash*, uint hash, void *data);
+
+/* moves data, previously added with oldhash, to a new key */
+extern void u_hash_rekey(u_hash*, void *data, uint oldhash,
+                         const char *key, uint hash);
+
+extern bool u_hash_each_next(u_hash*, uint *pos, void **data);
+
+#define U_HASH_EACH(HASH, POS, DATA) \
+	for ((POS) = 0; u_hash_each_next((HASH), &(POS), (void**) (DATA)); )
+
+#endif
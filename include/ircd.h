@@ -72,10 +72,15 @@ typedef time_t u_ts_t;
 #include "autoconf.h"
 #include "conf.h"
 #include "cookie.h"
+#include "dns.h"
 #include "crypto.h"
+#include "hash.h"
+#include "istr.h"
 #include "map.h"
 #include "strop.h"
+#include "timer.h"
 #include "sendq.h"
+#include "slab.h"
 #include "upgrade.h"
 #include "version.h"
 #include "vsnf.h"
@@ -84,6 +89,7 @@ typedef time_t u_ts_t;
 #include "numeric.h"
 
 #include "auth.h"
+#include "ban.h"
 #include "chan.h"
 #include "conn.h"
 #include "hook.h"
@@ -96,6 +102,7 @@ typedef time_t u_ts_t;
 #include "server.h"
 #include "user.h"
 #include "util.h"
+#include "verify.h"
 
 extern struct timeval NOW;
 
@@ -0,0 +1,42 @@
+/* Tethys, istr.h -- interned strings
+   Copyright (C) 2014 Alex Iadicicco
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+#ifndef __INC_ISTR_H__
+#define __INC_ISTR_H__
+
+/* Interned strings are reference counted and shared by everything that
+   holds the same value, which is a lot of users for hostnames, idents,
+   gecos and services accounts. They're stored with their length in
+   front and live in size-classed slabs.
+
+   An interned string is never NULL and must never be written through.
+   The empty string is a constant, so a field can be tested with s[0]
+   and always printed. */
+
+#define U_ISTR_MAX 255
+
+extern char u_istr_empty[];
+
+/* returns a reference to the interned copy of s, cut at max bytes. max
+   can't be more than U_ISTR_MAX */
+extern char *u_istr_get(const char *s, size_t max);
+extern void u_istr_put(char *s);
+
+/* replaces *p with an interned copy of s, dropping the old reference */
+extern void u_istr_set(char **p, const char *s, size_t max);
+
+extern size_t u_istr_len(const char *s);
+
+typedef struct u_istr_stats u_istr_stats;
+
+struct u_istr_stats {
+	ulong strings, refs;
+	size_t bytes; /* string data, not counting headers */
+};
+
+extern void u_istr_get_stats(u_istr_stats*);
+
+#endif
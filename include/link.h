@@ -19,18 +19,46 @@ enum u_link_type {
 	LINK_SERVER,
 };
 
-/* of these, only RDNS is currently used */
+/* of these, only RDNS and VERIFY are currently used. flags are kept
+   across upgrades, so new ones go on the end */
 #define U_LINK_WAIT_RDNS         0x0001
 #define U_LINK_WAIT_IDENTD       0x0002
 #define U_LINK_WAIT_PING_COOKIE  0x0004
 #define U_LINK_WAIT_FLOOD        0x0008
-#define U_LINK_WAIT              0x000f
+#define U_LINK_WAIT_VERIFY       0x0100
+#define U_LINK_WAIT              0x010f
 
 #define U_LINK_SENT_QUIT         0x0010
 #define U_LINK_REGISTERED        0x0020
 #define U_LINK_SENT_PASS         0x0040
+#define U_LINK_HOLD_OUTPUT       0x0080
+#define U_LINK_SENT_PING         0x0200
 
+/* default input buffer sizes. a class can override these with its
+   recvq setting. clients get room for a few lines; servers get enough
+   that a burst can be read in large pieces */
 #define IBUFSIZE 2048
+#define IBUFSIZE_SERVER (64 << 10)
+
+#define U_LINK_NUM_IBUF_POOLS 2
+
+/* seconds a link gets to register, and seconds a link that's been sent
+   an ERROR gets to go away before it's closed on */
+#define LINK_REGISTER_TIMEOUT 60
+#define LINK_CLOSE_GRACE 10
+
+typedef struct u_link_ibuf_stats u_link_ibuf_stats;
+
+struct u_link_ibuf_stats {
+	ulong live; /* buffers held by links */
+	ulong high; /* most buffers ever held at once */
+	size_t mem; /* bytes in held buffers */
+
+	struct {
+		size_t size;
+		ulong free, hits, misses;
+	} pool[U_LINK_NUM_IBUF_POOLS];
+};
 
 struct u_link {
 	u_conn *conn;
@@ -45,9 +73,15 @@ struct u_link {
 		u_link_block *link;
 	} conf;
 	int sendq;
+	int weight; /* lines per turn, in units of DISPATCH_QUANTUM */
 
-	uchar ibuf[IBUFSIZE+1];
+	/* only present while there's unprocessed input. ibufsize+1 bytes,
+	   for the terminating NUL */
+	uchar *ibuf;
+	size_t ibufsize;
+	size_t recvq; /* ibufsize to use from the next read on */
 	size_t ibuflen;
+	size_t ibufscan; /* bytes of ibuf known to have no line endings */
 
 	/* This indicates that X bytes should be skipped in ibuf when serializing
 	 * ibuf to do an upgrade. This is necessary to prevent the UPGRADE command
@@ -55,7 +89,24 @@ struct u_link {
 	 */
 	size_t ibufskip;
 
+	/* output produced while U_LINK_HOLD_OUTPUT is set collects here
+	   instead of the conn's send queue, until it's released. used to
+	   keep regular traffic behind a server burst. */
+	u_sendq held;
+
 	u_cookie ck_sendto;
+
+	/* registration, ping and close timeouts. it isn't moved on every
+	   read; when it fires, it looks at last_recv and sets itself for
+	   however long is left */
+	u_timer timer;
+	time_t last_recv;
+
+	/* the last ID-like source seen on a server link, and what it
+	   referred to. only good while src_epoch == u_src_epoch */
+	char src_id[10];
+	void *src_ptr;
+	uint src_epoch;
 };
 
 extern u_conn_ctx u_link_conn_ctx;
@@ -67,10 +118,17 @@ extern void u_link_fatal(u_link *link, const char *msg);
 
 extern void u_link_vf(u_link *link, const char *fmt, va_list va);
 extern void u_link_f(u_link *link, const char *fmt, ...);
+extern void u_link_put_line(u_link *link, u_sendq_line *line);
+
+extern void u_link_exempt_budget(u_link *link);
+extern void u_link_hold_output(u_link *link);
+extern void u_link_release_output(u_link *link);
 
 extern void u_link_vnum(u_link *link, const char *tgt, int num, va_list va);
 extern int u_link_num(u_link *link, int num, ...);
 extern void u_link_flush_input(u_link *link);
+extern void u_link_set_recvq(u_link *link, size_t size);
+extern void u_link_get_ibuf_stats(u_link_ibuf_stats*);
 
 extern int u_link_origin_create(mowgli_eventloop_t*, ushort);
 
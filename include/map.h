@@ -7,17 +7,40 @@
 #ifndef __INC_MAP_H__
 #define __INC_MAP_H__
 
+/* Most maps hold a handful of entries, so up to U_MAP_SMALL of them are
+   kept in an array inside the map itself and found by scanning it.
+   Bigger maps move their entries to the heap and index them with an
+   open-addressing hash table.
+
+   Entries are kept in the order they were added, and deleting one only
+   leaves a hole, so iterators are just a position. They can be nested
+   and it's fine to delete anything during iteration, but adding new
+   keys is not. Keys can't be NULL. */
+
 typedef struct u_map u_map;
-typedef struct u_map_n u_map_n; /* defined internally */
+typedef struct u_map_ent u_map_ent;
 
 #define MAP_STRING_KEYS 1
 
+#define U_MAP_SMALL 8
+
+struct u_map_ent {
+	void *key, *data;
+	uint hash;
+};
+
 struct u_map {
-	int iterdepth;
 	uint flags;
-	u_map_n *root;
 	uint size;
-	mowgli_list_t pending;
+
+	u_map_ent *ents; /* points to small until the map grows */
+	uint nents, maxents; /* nents includes holes */
+
+	uint *index; /* NULL for small maps */
+	uint nindex; /* power of 2 */
+	uint used; /* index slots that aren't empty */
+
+	u_map_ent small[U_MAP_SMALL];
 };
 
 typedef void (u_map_cb_t)(u_map*, void *k, void *v, void *priv);
@@ -34,7 +57,7 @@ typedef struct u_map_each_state u_map_each_state;
 
 struct u_map_each_state {
 	u_map *map;
-	mowgli_list_t list;
+	uint pos;
 };
 
 extern void u_map_each_start(u_map_each_state*, u_map*);
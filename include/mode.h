@@ -80,6 +80,7 @@ struct u_mode_stacker {
 };
 
 #define MODE_FORCE_ALL   0x0001
+#define MODE_LIST_CHANGE 0x0002 /* set by u_mode_process, for sync */
 
 #define MODE_ERR_UNK_CHAR         0x0001
 #define MODE_ERR_NO_ACCESS        0x0002
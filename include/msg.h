@@ -94,6 +94,8 @@ struct u_sourceinfo {
 #define SRC_IS_SERVER(si) SRC_HAS_BITS(si, SRC_SERVER)
 #define SRC_IS_LOCAL_USER(si) SRC_HAS_BITS(si, SRC_LOCAL_USER)
 
+extern uint u_src_epoch;
+
 extern int u_src_num(u_sourceinfo *si, int num, ...);
 extern void u_src_f(u_sourceinfo *si, const char *fmt, ...);
 
@@ -130,6 +132,7 @@ struct u_cmd {
 	   anything */
 	u_module *owner;
 	bool loaded;
+	int id;
 	struct u_cmd *next, *prev;
 	int runs, usecs;
 };
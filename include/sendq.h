@@ -9,21 +9,70 @@
 
 typedef struct u_sendq u_sendq;
 typedef struct u_sendq_chunk u_sendq_chunk;
+typedef struct u_sendq_line u_sendq_line;
+typedef struct u_sendq_stats u_sendq_stats;
 
 struct u_sendq {
 	size_t size;
 	u_sendq_chunk *head, *tail;
+	bool exempt; /* from the global budget. kept across clears */
 };
 
+/* An immutable, reference counted line. A line is rendered once and can
+   then be linked into any number of send queues without being copied.
+   The creator holds the first reference and fills in data and len. Its
+   memory counts against the budget once, for as long as it exists. */
+struct u_sendq_line {
+	uint refs;
+	size_t len;
+	size_t size; /* bytes allocated for data */
+	uchar data[];
+};
+
+extern u_sendq_line *u_sendq_line_new(size_t sz);
+extern u_sendq_line *u_sendq_line_ref(u_sendq_line*);
+extern void u_sendq_line_unref(u_sendq_line*);
+
+/* chunk size classes, the last one being shared chunks */
+#define SENDQ_NUM_CLASSES 5
+
+struct u_sendq_stats {
+	size_t queued; /* bytes waiting in all send queues */
+	size_t mem; /* bytes held by chunks and shared lines */
+	size_t budget; /* limit on mem, or 0 for none */
+	ulong denied; /* chunk allocations refused by the budget */
+
+	struct {
+		int size;
+		ulong live, free, hits, misses;
+	} cls[SENDQ_NUM_CLASSES];
+};
+
+/* once the budget is reached, u_sendq_get_buffer returns NULL and
+   u_sendq_put_line returns 0, as for a full sendq. queues marked exempt
+   are never refused, and still count towards it */
+extern void u_sendq_set_budget(size_t);
+extern void u_sendq_get_stats(u_sendq_stats*);
+
 extern void u_sendq_init(u_sendq*);
 extern void u_sendq_clear(u_sendq*);
 
-/* TODO: extern void u_sendq_put(u_sendq*, uchar*, size_t); */
+/* copies data onto the end of the queue, spanning as many chunks as
+   needed. returns the number of bytes queued, which is short only when
+   the sendq budget runs out */
+extern size_t u_sendq_put(u_sendq*, const uchar*, size_t);
+extern size_t u_sendq_putv(u_sendq*, const struct iovec*, int iovcnt);
 
 /* to allow vsnf, sprintf, etc. directly into the send queue */
 extern uchar *u_sendq_get_buffer(u_sendq*, size_t sz);
 extern size_t u_sendq_end_buffer(u_sendq*, size_t sz);
 
+/* links the line into the queue, taking a new reference to it */
+extern size_t u_sendq_put_line(u_sendq*, u_sendq_line*);
+
+/* moves everything in the second queue onto the end of the first */
+extern void u_sendq_move(u_sendq*, u_sendq*);
+
 extern int u_sendq_write(u_sendq*, int fd);
 
 extern mowgli_json_t *u_sendq_to_json(u_sendq *sq);
@@ -40,10 +40,12 @@ extern void u_sendto_map(u_map *map, u_link*, char*, ...); /* to values */
 typedef struct u_sendto_state u_sendto_state;
 
 struct u_sendto_state {
-	u_map_each_state chans;
-	u_map_each_state members;
+	u_user *u;
+	uint ci; /* next of u->channels */
+	u_map_each_state links;
 	u_chan *c;
 	uint type;
+	uint step;
 	mowgli_patricia_iteration_state_t pstate;
 };
 
@@ -36,22 +36,66 @@
 #define SERVER_MASK_WAIT        0xff000000
 
 typedef struct u_server u_server;
+typedef struct u_server_burst u_server_burst;
 
 #include "conn.h"
 #include "link.h"
 
+/* SIDs are a digit followed by two digits or letters, which gives a
+   small enough space to index servers directly */
+#define U_SID_TABLE_SIZE (10 * 36 * 36)
+
+/* the value of a TS6 ID character, in id_next's order of A-Z then 0-9,
+   or -1 if it's not one */
+static inline int u_id_digit(char c)
+{
+	if (c >= 'A' && c <= 'Z')
+		return c - 'A';
+	if (c >= 'a' && c <= 'z')
+		return c - 'a';
+	if (c >= '0' && c <= '9')
+		return c - '0' + 26;
+	return -1;
+}
+
+/* the slot for the 3 characters at sid, or -1 if they're not a SID */
+static inline int u_sid_index(const char *sid)
+{
+	int a, b;
+
+	if (!isdigit(sid[0]))
+		return -1;
+	if ((a = u_id_digit(sid[1])) < 0 || (b = u_id_digit(sid[2])) < 0)
+		return -1;
+	return (sid[0] - '0') * 36 * 36 + a * 36 + b;
+}
+
 struct u_server {
 	u_link *link; /* only NULL for &me */
 	ulong flags;
 
 	char sid[4]; /* if empty, this server is a TS5 */
 	char name[MAXSERVNAME+1];
+	uint namelen; /* kept by u_server_set_name, for vsnf */
 	char desc[MAXSERVDESC+1];
 	uint capab;
 
 	uint hops;
 	u_server *parent;
 
+	/* users on this server, and servers linked to it */
+	mowgli_list_t users;
+	mowgli_list_t children;
+	mowgli_node_t child_n;
+
+	/* users on this server by the last 6 characters of their UID,
+	   chained through u_user.uid_next. see user.c */
+	struct u_user **uids;
+	uint uids_size, uids_n;
+
+	/* our burst to this server, if one is still in progress */
+	u_server_burst *burst;
+
 	/* statistics */
 	uint nusers;
 	uint nlinks;
@@ -70,6 +114,7 @@ extern mowgli_list_t my_admininfo;
 extern char my_net_name[MAXNETNAME+1];
 
 extern u_server *u_server_by_sid(const char *sid);
+extern u_server *u_server_by_sid_index(int);
 extern u_server *u_server_by_name(const char *name);
 extern u_server *u_server_find(char *str);
 
@@ -88,8 +133,16 @@ extern u_server *u_server_new_remote(u_server *parent, char *sid,
                                      char *name, char *desc);
 extern void u_server_destroy(u_server*);
 
+extern void u_server_set_name(u_server*, const char *name);
+
 extern void u_server_burst_1(u_link*, u_link_block*);
 extern void u_server_burst_2(u_server*, u_link_block*);
+extern void u_server_burst_continue(u_server*);
+extern void u_server_burst_finish_all(void);
+/* whether a line held for a server's link comes from a user its burst
+   hasn't sent yet. those are left out, since the burst sends users as
+   they are when it gets to them */
+extern bool u_server_burst_hides(u_server*, const uchar *line, size_t len);
 extern void u_server_eob(u_server*);
 
 extern void u_server_flush_inputs(void);
@@ -0,0 +1,53 @@
+/* Tethys, slab.h -- typed object pools
+   Copyright (C) 2014 Alex Iadicicco
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+#ifndef __INC_SLAB_H__
+#define __INC_SLAB_H__
+
+/* A slab hands out objects of one size, carved from aligned pages of
+   U_SLAB_PAGE bytes. Freed objects go back to their own page, and new
+   ones come from pages that are already in use before a spare page is
+   touched. A page that empties out is released unless there's no spare
+   yet, so memory goes back after a connection storm or netsplit.
+   Objects from u_slab_alloc are zeroed, like calloc.
+
+   Slabs are declared statically with U_SLAB_INIT and show up in
+   u_slabs once they've been used. */
+
+typedef struct u_slab u_slab;
+typedef struct u_slab_page u_slab_page; /* defined internally */
+
+#define U_SLAB_PAGE (64 << 10)
+
+struct u_slab {
+	const char *name;
+	size_t size;
+	size_t align; /* 0 for pointer alignment */
+	size_t first; /* offset of the first object in a page */
+
+	u_slab_page *partial; /* pages with free objects */
+	u_slab_page *spare; /* an empty page, kept to absorb churn */
+
+	ulong live, free, peak, pages;
+
+	bool listed;
+	u_slab *next;
+};
+
+#define U_SLAB_INIT_SIZE(NAME, SIZE) { .name = (NAME), .size = (SIZE) }
+#define U_SLAB_INIT(NAME, TYPE) U_SLAB_INIT_SIZE(NAME, sizeof(TYPE))
+
+/* for objects that should start on a cache line. ALIGN must be a power
+   of 2 */
+#define U_SLAB_INIT_ALIGNED(NAME, TYPE, ALIGN) \
+	{ .name = (NAME), .size = sizeof(TYPE), .align = (ALIGN) }
+
+extern u_slab *u_slabs;
+
+extern void *u_slab_alloc(u_slab*);
+extern void u_slab_free(u_slab*, void*);
+
+#endif
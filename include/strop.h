@@ -40,4 +40,10 @@ struct u_strop_wrap {
 extern void u_strop_wrap_start(u_strop_wrap*, size_t width);
 extern char *u_strop_wrap_word(u_strop_wrap*, char*);
 
+
+/* line scanning */
+
+/* returns the first \r or \n in the n bytes at s, or NULL */
+extern char *u_strop_eol(char *s, size_t n);
+
 #endif
@@ -0,0 +1,40 @@
+/* Tethys, timer.h -- timer wheel
+   Copyright (C) 2014 Alex Iadicicco
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+#ifndef __INC_TIMER_H__
+#define __INC_TIMER_H__
+
+/* Timers with one second resolution, kept in a hierarchical wheel so
+   that setting, resetting and deleting one is constant time, and each
+   tick only looks at the timers that are due then. Every connection
+   has one, so that matters.
+
+   Timers are embedded in whatever they're for. A timer fires once per
+   u_timer_set, from u_timer_run, and can be set again from its own
+   callback. */
+
+typedef struct u_timer u_timer;
+typedef void (u_timer_cb_t)(u_timer*);
+
+struct u_timer {
+	u_timer *next, **prev; /* prev is NULL while not set */
+	ulong expires;
+	u_timer_cb_t *cb;
+};
+
+extern void u_timer_init(u_timer*, u_timer_cb_t*);
+
+/* (re)arms the timer to fire in secs seconds, or on the next tick if
+   secs is 0 */
+extern void u_timer_set(u_timer*, uint secs);
+extern void u_timer_del(u_timer*);
+
+#define U_TIMER_IS_SET(T) ((T)->prev != NULL)
+
+/* fires everything that's come due up to NOW */
+extern void u_timer_run(void);
+
+#endif
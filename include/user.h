@@ -17,6 +17,9 @@
 
 #define MAXAWAY 256
 
+/* nick!ident@host */
+#define MAXPREFIX (MAXNICKLEN + MAXIDENT + MAXHOST + 2)
+
 #define UMODE_OPER             0x00000001
 #define UMODE_INVISIBLE        0x00000002
 #define UMODE_WALLOPS          0x00000004
@@ -31,6 +34,7 @@
 #define USER_MASK_CAP          0x0000ff00
 #define CAP_MULTI_PREFIX       0x00000100
 #define CAP_AWAY_NOTIFY        0x00000200
+#define CAP_BATCH              0x00000400
 
 /* registration postpone */
 #define USER_MASK_WAIT         0x00ff0000
@@ -43,32 +47,60 @@ typedef struct u_user u_user;
 #include "mode.h"
 #include "ratelimit.h"
 
+/* Users are allocated on cache line boundaries, and everything that's
+   looked at to route a message fits in the first line. The strings that
+   are only read for WHO, WHOIS, bursts and the like are interned (see
+   istr.h), and away messages are only allocated while set. */
 struct u_user {
+	/* hot: these should stay within 64 bytes */
 	char uid[10];
-
+	char nick[MAXNICKLEN+1];
 	uint mode, flags;
-	u_map *channels;
+	u_link *link; /* never null, except when shutting down */
+	u_server *sv; /* never null */
+	/* memberships, in no particular order, and hashed by channel.
+	   see chan.c */
+	struct u_chanuser **channels;
+
+	uint nchannels, maxchannels;
+	struct u_chanuser **chanhash;
+	uint chanhash_size;
 	u_map *invites;
 
-	char nick[MAXNICKLEN+1];
-	char acct[MAXACCOUNT+1];
+	uint nickhash; /* in users_by_nick */
 	u_ts_t nickts;
 
-	char ident[MAXIDENT+1];
+	/* interned */
+	char *acct;
+	char *ident;
+	char *ip;
+	char *realhost;
+	char *host;
+	char *gecos;
 
-	char ip[INET6_ADDRSTRLEN];
-	char realhost[MAXHOST+1];
-	char host[MAXHOST+1];
+	char *away; /* NULL unless away */
 
-	char gecos[MAXGECOS+1];
+	/* nick!ident@host, rebuilt by u_user_update_prefix whenever one of
+	   them changes */
+	char *prefix;
+	uint prefixlen;
 
-	char away[MAXAWAY+1];
+	/* the last channel this user was checked against the lists of,
+	   only compared by address. see u_entry_blocked */
+	void *ban_chan;
+	ulong ban_gen;
+	uint ban_result;
 
 	u_ratelimit_t limit;
 
-	u_link *link; /* never null, except when shutting down */
 	u_oper_block *oper; /* local opers only */
-	u_server *sv; /* never null */
+
+	/* u_user_serial when this user was introduced to the network.
+	   bursts use it to leave out users they haven't sent */
+	ulong serial;
+
+	mowgli_node_t sv_n; /* in sv->users */
+	u_user *uid_next; /* in sv->uids */
 };
 
 #define IS_LOCAL_USER(u) ((u->flags & USER_IS_LOCAL) != 0)
@@ -77,13 +109,14 @@ struct u_user {
 #define IS_SERVICE(u)    ((u) && (u)->mode & UMODE_SERVICE)
 
 #define IS_LOGGED_IN(u)  ((u) && (u)->acct[0])
-#define IS_AWAY(u)       ((u) && (u)->away[0])
+#define IS_AWAY(u)       ((u) && (u)->away)
 
 #define IS_REGISTERED(u) (!IS_LOCAL_USER(u) || \
                           ((u)->link->flags & U_LINK_REGISTERED) != 0)
 
-extern mowgli_patricia_t *users_by_nick;
+extern u_hash *users_by_nick;
 extern mowgli_patricia_t *users_by_uid;
+extern ulong u_user_serial;
 
 extern u_mode_info umode_infotab[128];
 extern u_mode_ctx umodes;
@@ -110,6 +143,8 @@ static inline u_user *u_user_by_ref(u_link *link, char *ref)
 extern char *u_user_modes(u_user*);
 
 extern void u_user_set_nick(u_user*, char*, uint);
+extern void u_user_set_away(u_user*, char*); /* NULL or "" to unset */
+extern void u_user_update_prefix(u_user*);
 
 extern bool u_user_try_override(u_user*);
 
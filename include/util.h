@@ -46,6 +46,10 @@ extern struct sockaddr* u_pton(const char*, struct sockaddr*, socklen_t*);
 
 extern char *cut(char **p, char *delim);
 
+extern char null_casemap[256]; /* identity, for exact matches */
+extern char rfc1459_casemap[256];
+extern char ascii_casemap[256];
+
 extern void null_canonize();
 extern void rfc1459_canonize();
 extern void ascii_canonize();
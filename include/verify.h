@@ -0,0 +1,46 @@
+/* Tethys, verify.h -- password and challenge checks off the event loop
+   Copyright (C) 2014 Alex Iadicicco
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+#ifndef __INC_VERIFY_H__
+#define __INC_VERIFY_H__
+
+/* Slow checks, like a password against a strong hash or a challenge
+   signature, are handed to a small pool of worker threads. The link
+   that asked is parked with U_LINK_WAIT_VERIFY until the answer comes
+   back, the same way rDNS parks a registering link, so nothing else
+   it sent gets processed in the meantime. Everyone else carries on.
+
+   A job's work function runs on a worker thread, so it can't touch
+   anything but its own data. Its result is passed to the done callback
+   on the main thread. The link passed to done is NULL if the link went
+   away or started quitting while the job ran, but done is still called
+   so it can free whatever it was given.
+
+   A link only has one job at a time. Without pthreads, jobs run as
+   soon as they're submitted. */
+
+typedef int (u_verify_fn_t)(void *priv);
+typedef void (u_verify_done_t)(u_link*, int result, void *priv);
+
+extern void u_verify_run(u_link*, u_verify_fn_t*, u_verify_done_t*,
+                         void *priv);
+
+/* checks pass against each hash in turn. the result is the index of
+   the first that matches, or -1. a NULL hash accepts anything.
+   the hashes must stay put until done is called, which config blocks
+   do, but the array itself and pass are copied */
+extern void u_verify_pass(u_link*, char **hashes, uint nhashes,
+                          const char *pass, u_verify_done_t*, void *priv);
+
+/* forgets the link's job, if any. called as links are destroyed */
+extern void u_verify_cancel(u_link*);
+
+/* waits for every outstanding job and completes it */
+extern void u_verify_finish_all(void);
+
+extern int init_verify(void);
+
+#endif
@@ -11,12 +11,12 @@ static int c_u_away(u_sourceinfo *si, u_msg *msg)
 	char *r = msg->argv[0];
 
 	if (!r || !*r) {
-		si->u->away[0] = '\0';
+		u_user_set_away(si->u, NULL);
 		if (IS_LOCAL_USER(si->u))
 			u_user_num(si->u, RPL_UNAWAY);
 		u_sendto_servers(si->source, ":%I AWAY", si);
 	} else {
-		u_strlcpy(si->u->away, r, MAXAWAY);
+		u_user_set_away(si->u, r);
 		if (IS_LOCAL_USER(si->u))
 			u_user_num(si->u, RPL_NOWAWAY);
 		u_sendto_servers(si->source, ":%I AWAY :%s", si, r);
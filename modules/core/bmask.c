@@ -81,6 +81,7 @@ static int c_s_bmask(u_sourceinfo *si, u_msg *msg)
 
 	U_STROP_SPLIT(&st, bans, " ", &ban)
 		apply_bmask(si, c, type, list, ban);
+	u_chan_lists_changed(c);
 
 	return 0;
 }
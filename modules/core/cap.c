@@ -14,6 +14,7 @@ struct cap {
 } caps[] = {
 	{ "multi-prefix",   CAP_MULTI_PREFIX },
 	{ "away-notify",    CAP_AWAY_NOTIFY },
+	{ "batch",          CAP_BATCH },
 	{ }
 };
 
@@ -23,8 +23,9 @@ static int verify_signature(const unsigned char *data, unsigned int data_len, co
 	if (data == NULL || sig == NULL) goto err;
 	if (data_len < 1 || sig_len < 1) goto err;
 
-	if (! (mdctx = malloc(sizeof(*mdctx)))) goto err;
-	EVP_MD_CTX_init(mdctx);
+	/* create and destroy rather than malloc, so nothing the check
+	   allocated is leaked, and so this builds on OpenSSL 1.1 too */
+	if (! (mdctx = EVP_MD_CTX_create())) goto err;
 
 	if (EVP_VerifyInit(mdctx, CHALLENGE_SIGNATURE_DIGEST_ALGORITHM) < 1) goto err;
 	if (EVP_VerifyUpdate(mdctx, data, data_len) < 1) goto err;
@@ -32,7 +33,7 @@ static int verify_signature(const unsigned char *data, unsigned int data_len, co
 	ret = 1;
 
 err:
-	if (mdctx) free(mdctx);
+	if (mdctx) EVP_MD_CTX_destroy(mdctx);
 	return ret;
 }
 
@@ -66,10 +67,64 @@ static int send_challenge(u_sourceinfo *si, u_oper_block *oper)
 	return u_user_num(si->u, RPL_CHALLENGE_FINISH);
 }
 
-static int c_lu_challenge(u_sourceinfo *si, u_msg *msg)
+/* the key is read and the signature checked by the verify threads,
+   with copies of everything they need. the result is the numeric to
+   send back */
+struct challenge_job {
+	u_oper_block *oper;
+	unsigned char challenge[MAXCHALLENGE];
+	char pubkey[MAXPUBKEY+1];
+	unsigned char *sig;
+	unsigned int sig_len;
+};
+
+static int check_response(void *priv)
 {
+	struct challenge_job *job = priv;
 	FILE *pubkey_file = NULL;
 	EVP_PKEY *pubkey = NULL;
+	int ret = ERR_CHALLENGE_NOPUBKEY;
+
+	if (! (pubkey_file = fopen(job->pubkey, "r")))
+		goto cleanup;
+	if (! PEM_read_PUBKEY(pubkey_file, &pubkey, NULL, NULL))
+		goto cleanup;
+
+	ret = ERR_CHALLENGE_FAILURE;
+	if (! verify_signature(job->challenge, sizeof(job->challenge), job->sig, job->sig_len, pubkey))
+		goto cleanup;
+
+	ret = RPL_CHALLENGE_SUCCESS;
+
+cleanup:
+	if (pubkey_file) fclose(pubkey_file);
+	if (pubkey) EVP_PKEY_free(pubkey);
+	return ret;
+}
+
+static void response_checked(u_link *link, int result, void *priv)
+{
+	struct challenge_job *job = priv;
+	u_sourceinfo si = { };
+
+	if (link != NULL) {
+		u_user_num(link->priv, result);
+
+		if (result == RPL_CHALLENGE_SUCCESS) {
+			si.source = si.link = si.local = link;
+			si.u = link->priv;
+			oper_up(&si, job->oper);
+		}
+	}
+
+	memset(job->challenge, 0, sizeof(job->challenge));
+	free(job->sig);
+	free(job);
+}
+
+static int c_lu_challenge(u_sourceinfo *si, u_msg *msg)
+{
+	struct challenge_job *job;
 	unsigned int raw_sig_len = 0;
 	unsigned char *raw_sig = NULL;
 
@@ -112,26 +167,25 @@ static int c_lu_challenge(u_sourceinfo *si, u_msg *msg)
 	}
 	raw_sig_len = base64_decode(msg->argv[1], strlen(msg->argv[1]), raw_sig);
 
-	if (! (pubkey_file = fopen(oper->pubkey, "r"))) {
-		u_user_num(si->u, ERR_CHALLENGE_NOPUBKEY);
-		goto cleanup;
-	}
-	if (! PEM_read_PUBKEY(pubkey_file, &pubkey, NULL, NULL)) {
-		u_user_num(si->u, ERR_CHALLENGE_NOPUBKEY);
-		goto cleanup;
-	}
-	if (! verify_signature(oper->challenge, sizeof(oper->challenge), raw_sig, raw_sig_len, pubkey)) {
+	if (! (job = calloc(1, sizeof(*job)))) {
 		u_user_num(si->u, ERR_CHALLENGE_FAILURE);
 		goto cleanup;
 	}
-
-	u_user_num(si->u, RPL_CHALLENGE_SUCCESS);
-	oper_up(si, oper);
+	job->oper = oper;
+	memcpy(job->challenge, oper->challenge, sizeof(job->challenge));
+	u_strlcpy(job->pubkey, oper->pubkey, sizeof(job->pubkey));
+	job->sig = raw_sig;
+	job->sig_len = raw_sig_len;
+	raw_sig = NULL;
+
+	/* the challenge is used up either way, so nobody else can answer
+	   it while this one is being checked */
+	cleanup_challenge(oper);
+	u_verify_run(si->source, check_response, response_checked, job);
+	return 0;
 
 cleanup:
 	if (raw_sig) free(raw_sig);
-	if (pubkey_file) fclose(pubkey_file);
-	if (pubkey) EVP_PKEY_free(pubkey);
 	cleanup_challenge(oper);
 	return 0;
 }
@@ -50,7 +50,7 @@ static int try_local_join_chan(u_sourceinfo *si, char *chan, char *key)
 	}
 
 	if (!(c->flags & CHAN_LOCAL)) {
-		if (c->members->size == 1) {
+		if (c->nmembers == 1) {
 			u_sendto_servers(NULL, ":%S SJOIN %u %C %s :%s%U",
 			           &me, c->ts, c, modes,
 			           (cu->flags & CU_PFX_OP) ? "@" : "", si->u);
@@ -12,14 +12,14 @@ static int list_entry(u_sourceinfo *si, u_chan *c)
 	    && !u_chan_user_find(c, si->u))
 		return 0;
 
-	u_src_num(si, RPL_LIST, c->name, c->members->size, c->topic);
+	u_src_num(si, RPL_LIST, c->name, c->nmembers, c->topic);
 	return 0;
 }
 
 static int c_lu_list(u_sourceinfo *si, u_msg *msg)
 {
-	mowgli_patricia_iteration_state_t state;
 	u_chan *c;
+	uint pos;
 
 	if (msg->argc > 0) {
 		if (!(c = u_chan_get(msg->argv[0])))
@@ -32,8 +32,8 @@ static int c_lu_list(u_sourceinfo *si, u_msg *msg)
 	}
 
 	u_src_num(si, RPL_LISTSTART);
-	MOWGLI_PATRICIA_FOREACH(c, &state, all_chans) {
-		if (c->members->size < 3)
+	U_HASH_EACH(all_chans, pos, &c) {
+		if (c->nmembers < 3)
 			continue;
 
 		list_entry(si, c);
@@ -6,15 +6,34 @@
 
 #include "ircd.h"
 
+static void oper_verified(u_link *link, int result, void *priv)
+{
+	u_sourceinfo si = { };
+
+	if (link == NULL)
+		return;
+
+	if (result < 0) {
+		u_user_num(link->priv, ERR_NOOPERHOST);
+		return;
+	}
+
+	si.source = si.link = si.local = link;
+	si.u = link->priv;
+	oper_up(&si, priv);
+}
+
 static int c_lu_oper(u_sourceinfo *si, u_msg *msg)
 {
 	u_oper_block *oper;
+	char *hash;
 
-	if (!(oper = u_find_oper(si->source->conf.auth,
-	                         msg->argv[0], msg->argv[1])))
+	if (!(oper = u_find_oper(si->source->conf.auth, msg->argv[0], NULL)))
 		return u_user_num(si->u, ERR_NOOPERHOST);
 
-	oper_up(si, oper);
+	hash = oper->pass;
+	u_verify_pass(si->source, &hash, 1, msg->argv[1],
+	              oper_verified, oper);
 	return 0;
 }
 
@@ -211,10 +211,9 @@ static void ts_equal(u_sourceinfo *si, u_chan *c, u_modes *m, u_msg *msg)
 /* Our TS is newer. Wipe all local modes and statuses */
 static void ts_lose(u_sourceinfo *si, u_chan *c, u_modes *m, u_msg *msg)
 {
-	u_user *u;
 	u_chanuser *cu;
-	u_map_each_state st;
 	ulong set, bit;
+	uint i;
 	char users[512];
 	int ch;
 
@@ -249,8 +248,8 @@ static void ts_lose(u_sourceinfo *si, u_chan *c, u_modes *m, u_msg *msg)
 	}
 
 	/* remove all statuses from local users */
-	U_MAP_EACH(&st, c->members, &u, &cu) {
-		if (!IS_LOCAL_USER(u))
+	U_CHAN_EACH_MEMBER(c, i, cu) {
+		if (!IS_LOCAL_USER(cu->u))
 			continue;
 
 		get_status(cu, 0, m, NULL);
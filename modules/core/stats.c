@@ -68,6 +68,84 @@ static void stats_u(u_sourceinfo *si, struct stats_info *info)
 	u_src_num(si, RPL_STATSUPTIME, days, hr, min, sec);
 }
 
+static void stats_sendq(u_sourceinfo *si, struct stats_info *info)
+{
+	u_sendq_stats st;
+	int i;
+
+	u_sendq_get_stats(&st);
+
+	notice(si, "%u bytes queued, %u bytes in chunks, %u denied",
+	       (uint) st.queued, (uint) st.mem, (uint) st.denied);
+	if (st.budget > 0)
+		notice(si, "budget: %u bytes", (uint) st.budget);
+	else
+		notice(si, "budget: none");
+
+	for (i=0; i<SENDQ_NUM_CLASSES; i++) {
+		char name[16];
+
+		if (st.cls[i].size > 0)
+			snprintf(name, 16, "%d", st.cls[i].size);
+		else
+			strcpy(name, "shared");
+
+		notice(si, "%6s: %u live, %u free, %u hits, %u misses", name,
+		       (uint) st.cls[i].live, (uint) st.cls[i].free,
+		       (uint) st.cls[i].hits, (uint) st.cls[i].misses);
+	}
+}
+
+static void stats_dns(u_sourceinfo *si, struct stats_info *info)
+{
+	u_dns_stats st;
+	ulong total;
+
+	u_dns_get_stats(&st);
+	total = st.hits + st.misses + st.coalesced;
+
+	notice(si, "%u lookups: %u hits, %u coalesced, %u misses (%u%% hits)",
+	       (uint) total, (uint) st.hits, (uint) st.coalesced,
+	       (uint) st.misses,
+	       (uint) (total ? (st.hits + st.coalesced) * 100 / total : 0));
+	notice(si, "%u answers cached, %u evicted, %u in progress",
+	       (uint) st.entries, (uint) st.evicted, (uint) st.pending);
+}
+
+static void stats_ibufs(u_sourceinfo *si, struct stats_info *info)
+{
+	u_link_ibuf_stats st;
+	int i;
+
+	u_link_get_ibuf_stats(&st);
+
+	notice(si, "%u buffers held (%u bytes), %u at most", (uint) st.live,
+	       (uint) st.mem, (uint) st.high);
+
+	for (i=0; i<U_LINK_NUM_IBUF_POOLS; i++) {
+		notice(si, "%6u: %u free, %u hits, %u misses",
+		       (uint) st.pool[i].size, (uint) st.pool[i].free,
+		       (uint) st.pool[i].hits, (uint) st.pool[i].misses);
+	}
+}
+
+static void stats_slabs(u_sourceinfo *si, struct stats_info *info)
+{
+	u_istr_stats ist;
+	u_slab *slab;
+
+	u_istr_get_stats(&ist);
+	notice(si, "%u interned strings (%u bytes), %u references",
+	       (uint) ist.strings, (uint) ist.bytes, (uint) ist.refs);
+
+	for (slab=u_slabs; slab; slab=slab->next) {
+		notice(si, "%10s: %4u bytes, %u live, %u free, %u peak, "
+		       "%u pages (%uk)", slab->name, (uint) slab->size,
+		       (uint) slab->live, (uint) slab->free, (uint) slab->peak,
+		       (uint) slab->pages, (uint) (slab->pages * U_SLAB_PAGE >> 10));
+	}
+}
+
 static void do_command(u_sourceinfo *si, u_cmd *cmd)
 {
 	char mask[15], *prop;
@@ -154,10 +232,14 @@ struct stats_info stats[] = {
 	{ "o", NEED_OPER, stats_o },
 	{ "i", NEED_OPER, stats_i },
 	{ "u", 0,         stats_u },
+	{ "z", NEED_OPER, stats_slabs },
 
 	/* extended stats */
 	{ "commands", NEED_OPER, stats_commands },
+	{ "dns",      NEED_OPER, stats_dns      },
+	{ "ibufs",    NEED_OPER, stats_ibufs    },
 	{ "modules",  NEED_OPER, stats_modules  },
+	{ "sendq",    NEED_OPER, stats_sendq    },
 
 	{ }
 };
@@ -17,7 +17,7 @@ static int c_es_su(u_sourceinfo *si, u_msg *msg)
 		return 0;
 	}
 
-	u_strlcpy(u->acct, acct, MAXACCOUNT+1);
+	u_istr_set(&u->acct, acct, MAXACCOUNT);
 
 	if (*acct) {
 		u_log(LG_VERBOSE, "%U logged in to %s", u, acct);
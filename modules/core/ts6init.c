@@ -26,7 +26,8 @@ static int c_us_capab(u_sourceinfo *si, u_msg *msg)
 	return 0;
 }
 
-static u_link_block *verify_link_block(u_server *sv)
+/* the password is checked separately */
+static u_link_block *find_link_block(u_server *sv)
 {
 	u_link *link = sv->link;
 	u_link_block *block;
@@ -34,7 +35,7 @@ static u_link_block *verify_link_block(u_server *sv)
 	if (!(block = u_find_link(sv->name)))
 		return NULL;
 
-	if (!link->pass || !streq(link->pass, block->recvpass))
+	if (!link->pass)
 		return NULL;
 
 	if (!streq(block->host, link->conn->ip))
@@ -43,13 +44,44 @@ static u_link_block *verify_link_block(u_server *sv)
 	return block;
 }
 
+static void link_verified(u_link *link, int result, void *priv)
+{
+	u_link_block *block = priv;
+	u_server *sv;
+
+	if (link == NULL)
+		return;
+
+	if (result < 0) {
+		u_link_fatal(link, "No link{} blocks for your host");
+		return;
+	}
+
+	sv = link->priv;
+
+	link->flags |= U_LINK_REGISTERED;
+	link->conf.link = block;
+	u_link_set_recvq(link, block->cls->recvq);
+	link->weight = block->cls->weight;
+
+	u_sendto_servers(link, ":%S SID %s %d %s :%s", &me,
+	                 sv->name, sv->hops, sv->sid, sv->desc);
+
+	u_log(LG_VERBOSE, "ts6init: burst to %s (link=%s, class=%s)",
+	      sv->name, block->name, block->cls->name);
+
+	u_server_burst_1(link, block);
+	u_server_burst_2(sv, block);
+}
+
 static int c_us_server(u_sourceinfo *si, u_msg *msg)
 {
-	u_strlcpy(si->s->name, msg->argv[0], MAXSERVNAME+1);
+	u_server_set_name(si->s, msg->argv[0]);
 	u_strlcpy(si->s->desc, msg->argv[2], MAXSERVDESC+1);
 
 	/* attempt server registration */
 	u_link_block *block;
+	char *hash;
 	uint capab_need = CAPAB_QS | CAPAB_EX | CAPAB_IE
 	                | CAPAB_EUID | CAPAB_ENCAP;
 
@@ -58,21 +90,16 @@ static int c_us_server(u_sourceinfo *si, u_msg *msg)
 		return 0;
 	}
 
-	if (!(block = verify_link_block(si->s))) {
+	if (!(block = find_link_block(si->s))) {
 		u_link_fatal(si->source, "No link{} blocks for your host");
 		return 0;
 	}
 
-	si->source->flags |= U_LINK_REGISTERED;
-
-	u_sendto_servers(si->source, ":%S SID %s %d %s :%s", &me,
-	                 si->s->name, si->s->hops, si->s->sid, si->s->desc);
-
-	u_log(LG_VERBOSE, "ts6init: burst to %s (link=%s, class=%s)",
-	      si->s->name, block->name, block->cls->name);
-
-	u_server_burst_1(si->source, block);
-	u_server_burst_2(si->s, block);
+	/* registration finishes in link_verified. recvpass can be a hash
+	   now too, and a plain one still works as it always has */
+	hash = block->recvpass;
+	u_verify_pass(si->source, &hash, 1, si->source->pass,
+	              link_verified, block);
 
 	return 0;
 }
@@ -15,8 +15,9 @@ static int c_uu_user(u_sourceinfo *si, u_msg *msg)
 	if (!is_valid_ident(buf))
 		return u_link_num(si->source, ERR_GENERIC, "Invalid username");
 
-	u_strlcpy(si->u->ident, buf, MAXIDENT+1);
-	u_strlcpy(si->u->gecos, msg->argv[3], MAXGECOS+1);
+	u_istr_set(&si->u->ident, buf, MAXIDENT);
+	u_istr_set(&si->u->gecos, msg->argv[3], MAXGECOS);
+	u_user_update_prefix(si->u);
 
 	u_user_try_register(si->u);
 
@@ -14,9 +14,8 @@ static void who_reply(u_sourceinfo *si, u_user *u, u_chan *c, u_chanuser *cu)
 
 	if (c == NULL) {
 		/* oh god this is so bad */
-		u_map_each_state state;
-		U_MAP_EACH(&state, u->channels, &c, NULL)
-			break;
+		if (u->nchannels > 0)
+			c = u->channels[0]->c;
 		cu = NULL;
 	}
 
@@ -49,8 +48,8 @@ static int c_lu_who(u_sourceinfo *si, u_msg *msg)
 	char *name = msg->argv[0];
 
 	if (strchr(CHANTYPES, *name)) {
-		u_map_each_state state;
 		bool visible_only = false;
+		uint i;
 
 		if ((c = u_chan_get(name)) == NULL)
 			goto end;
@@ -61,7 +60,8 @@ static int c_lu_who(u_sourceinfo *si, u_msg *msg)
 			visible_only = true;
 		}
 
-		U_MAP_EACH(&state, c->members, &u, &cu) {
+		U_CHAN_EACH_MEMBER(c, i, cu) {
+			u = cu->u;
 			if (visible_only && (u->mode & UMODE_INVISIBLE))
 				continue;
 			who_reply(si, u, c, cu);
@@ -8,8 +8,8 @@
 
 static void whois_channels(u_sourceinfo *si, u_user *tu)
 {
-	u_map_each_state state;
 	u_chan *c; u_chanuser *cu;
+	uint i;
 	u_strop_wrap wrap;
 	mowgli_node_t *n;
 	char *s;
@@ -17,10 +17,11 @@ static void whois_channels(u_sourceinfo *si, u_user *tu)
 	u_strop_wrap_start(&wrap,
 	    510 - MAXSERVNAME - MAXNICKLEN - MAXNICKLEN - 9);
 
-	U_MAP_EACH(&state, tu->channels, &c, &cu) {
+	U_USER_EACH_CHAN(tu, i, cu) {
 		char *p, cbuf[MAXCHANNAME+3];
 		int retrying = 0;
 
+		c = cu->c;
 		if (c->mode & (CMODE_PRIVATE | CMODE_SECRET)
 		    && !u_chan_user_find(c, si->u))
 			continue;
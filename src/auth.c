@@ -13,10 +13,12 @@ static char *msg_classmissing = "%s block %s missing class! Using default class"
 static char *msg_authnotfound = "Oper block %s asks for auth %s, but no such auth exists! Ignoring auth setting";
 static char *msg_timeouttooshort = "Timeout of %d seconds for class %s too short. Setting to %d seconds";
 static char *msg_sendqtoosmall = "SendQ size of %d bytes for class %s too small. Setting to %d bytes";
+static char *msg_recvqtoosmall = "RecvQ size of %d bytes for class %s too small. Setting to %d bytes";
+static char *msg_weightinvalid = "Weight of %d for class %s invalid. Setting to %d";
 static char *msg_portinvalid = "Port %d for link %s invalid. Using %d";
 
 static u_class_block class_default =
-	{ "<default>", 300, 32<<10 };
+	{ "<default>", 300, 32<<10, 0, 1 };
 static u_auth_block auth_default =
 	{ "<default>", "default", NULL, { { 0 }, 0 }, "" };
 
@@ -44,45 +46,266 @@ void oper_up(u_sourceinfo *si, u_oper_block *oper)
 		si->u, u_user_modes(si->u));
 }
 
-u_auth_block *u_find_auth(u_link *link)
+/* auth blocks by network */
+/* ---------------------- */
+
+/* A bit trie per address family, walked from the top bit down. Each
+   block sits on the node for its exact prefix, chained with any others
+   for the same prefix in config order. Every node on an address's path
+   is a network it's in, so the candidates for a connection are the
+   chains along its path, and blocks without a network. Those are tried
+   in config order, like a list would be, but a password is only ever
+   checked for blocks the address already qualifies for. */
+
+struct auth_node {
+	struct auth_node *child[2];
+	u_auth_block *auths, *last;
+};
+
+#define AUTH_V4 0
+#define AUTH_V6 1
+
+static struct auth_node auth_trees[2];
+static struct auth_node auth_any; /* blocks for every address */
+static uint auth_count = 0;
+
+static const uchar v4_mapped[12] =
+	{ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+
+/* returns the number of bits in the address, or 0 if it's not one we
+   know about. v4-mapped v6 addresses are treated as v4 */
+static uint addr_bits(const struct sockaddr *sa, const uchar **bytes,
+                      int *tree)
 {
-	mowgli_node_t *n;
-	u_auth_block *auth;
+	const uchar *b;
+
+	switch (sa->sa_family) {
+	case AF_INET:
+		*bytes = (uchar*) &((struct sockaddr_in*) sa)->sin_addr;
+		*tree = AUTH_V4;
+		return 32;
+
+	case AF_INET6:
+		b = (uchar*) &((struct sockaddr_in6*) sa)->sin6_addr;
+		if (!memcmp(b, v4_mapped, sizeof(v4_mapped))) {
+			*bytes = b + sizeof(v4_mapped);
+			*tree = AUTH_V4;
+			return 32;
+		}
+		*bytes = b;
+		*tree = AUTH_V6;
+		return 128;
+	}
 
-	if (mowgli_list_size(&auth_list) == 0) {
-		u_log(LG_WARN, msg_noauthblocks);
-		return &auth_default;
+	return 0;
+}
+
+#define BIT(B, I) (((B)[(I) / 8] >> (7 - (I) % 8)) & 1)
+
+static void auth_chain(struct auth_node *node, u_auth_block *auth)
+{
+	auth->net_next = NULL;
+	if (node->last)
+		node->last->net_next = auth;
+	else
+		node->auths = auth;
+	node->last = auth;
+}
+
+static void auth_insert(u_auth_block *auth)
+{
+	struct auth_node *node, **next;
+	const uchar *bytes;
+	uint i, bits, netsize = auth->cidr.netsize;
+	int tree;
+
+	auth->order = auth_count++;
+
+	/* same as u_cidr_match: no netmask matches anything, and a network
+	   that didn't parse matches nothing */
+	if (netsize == 0) {
+		auth_chain(&auth_any, auth);
+		return;
 	}
 
-	MOWGLI_LIST_FOREACH(n, auth_list.head) {
-		auth = n->data;
-		if (!u_cidr_match(&auth->cidr, link->conn->ip))
-			continue;
-		if (auth->pass[0]) {
-			if (!link->pass || !matchhash(auth->pass, link->pass))
-				continue;
+	bits = addr_bits((struct sockaddr*) &auth->cidr.addr, &bytes, &tree);
+	if (bits == 0)
+		return;
+
+	if (bits == 32 && auth->cidr.addr.ss_family == AF_INET6) {
+		/* a v4-mapped network. anything wider would take in v6
+		   addresses too, which isn't worth the trouble */
+		if (netsize < 96) {
+			u_log(LG_WARN, "Auth block %s: ignoring cidr wider "
+			      "than ::ffff:0:0/96", auth->name);
+			return;
 		}
+		netsize -= 96;
+	}
 
+	node = auth_trees + tree;
+	for (i=0; i<netsize; i++) {
+		next = &node->child[BIT(bytes, i)];
+		if (*next == NULL)
+			*next = calloc(1, sizeof(**next));
+		node = *next;
+	}
+
+	auth_chain(node, auth);
+}
+
+/* the blocks an address qualifies for, one at a time in config order.
+   cur holds the head of each chain along the address's path that's
+   still got blocks left in it */
+struct auth_iter {
+	u_auth_block *cur[130];
+	uint ncur;
+};
+
+static void auth_iter_start(struct auth_iter *it, u_link *link)
+{
+	struct auth_node *node;
+	const uchar *bytes;
+	uint i, bits;
+	int tree;
+
+	it->ncur = 0;
+
+	if (auth_any.auths)
+		it->cur[it->ncur++] = auth_any.auths;
+
+	bits = addr_bits((struct sockaddr*) &link->conn->addr, &bytes, &tree);
+	node = bits ? auth_trees + tree : NULL;
+	for (i=0; node != NULL; i++) {
+		if (node->auths)
+			it->cur[it->ncur++] = node->auths;
+		node = i < bits ? node->child[BIT(bytes, i)] : NULL;
+	}
+}
+
+static u_auth_block *auth_iter_next(struct auth_iter *it)
+{
+	u_auth_block *auth = NULL;
+	uint i, best = 0;
+
+	for (i=0; i<it->ncur; i++) {
+		if (it->cur[i] && (!auth || it->cur[i]->order < auth->order)) {
+			auth = it->cur[i];
+			best = i;
+		}
+	}
+
+	if (auth != NULL)
+		it->cur[best] = auth->net_next;
+
+	return auth;
+}
+
+static u_auth_block *auth_class(u_auth_block *auth)
+{
+	if (auth->cls == NULL) {
+		auth->cls = u_map_get(all_classes, auth->classname);
 		if (auth->cls == NULL) {
-			auth->cls = u_map_get(all_classes, auth->classname);
-			if (auth->cls == NULL) {
-				if (!auth->classname[0]) {
-					u_log(LG_WARN, msg_classmissing,
-					      "Auth", auth->name);
-				} else {
-					u_log(LG_WARN, msg_classnotfound,
-					      "Auth", auth->name, auth->classname);
-				}
-				auth->cls = &class_default;
+			if (!auth->classname[0]) {
+				u_log(LG_WARN, msg_classmissing,
+				      "Auth", auth->name);
+			} else {
+				u_log(LG_WARN, msg_classnotfound,
+				      "Auth", auth->name, auth->classname);
 			}
+			auth->cls = &class_default;
 		}
+	}
 
-		return auth;
+	return auth;
+}
+
+static bool auth_pass_ok(u_auth_block *auth, u_link *link)
+{
+	if (!auth->pass[0])
+		return true;
+
+	return link->pass && matchhash(auth->pass, link->pass);
+}
+
+u_auth_block *u_find_auth(u_link *link)
+{
+	struct auth_iter it;
+	u_auth_block *auth;
+
+	if (auth_count == 0) {
+		u_log(LG_WARN, msg_noauthblocks);
+		return &auth_default;
+	}
+
+	auth_iter_start(&it, link);
+	while ((auth = auth_iter_next(&it)) != NULL) {
+		if (auth_pass_ok(auth, link))
+			return auth_class(auth);
 	}
 
 	return NULL;
 }
 
+struct auth_wait {
+	void (*cb)(u_link*, u_auth_block*);
+	u_auth_block *auths[];
+};
+
+static void auth_verified(u_link *link, int result, void *priv)
+{
+	struct auth_wait *aw = priv;
+
+	if (link != NULL)
+		aw->cb(link, result < 0 ? NULL : auth_class(aw->auths[result]));
+
+	free(aw);
+}
+
+void u_find_auth_async(u_link *link, void (*cb)(u_link*, u_auth_block*))
+{
+	struct auth_wait *aw;
+	struct auth_iter it;
+	u_auth_block *auth;
+	char **hashes;
+	uint i, n = 0;
+
+	if (auth_count == 0) {
+		u_log(LG_WARN, msg_noauthblocks);
+		cb(link, &auth_default);
+		return;
+	}
+
+	/* the candidates up to and including the first block without a
+	   password, which would take anyone that got that far */
+	aw = malloc(sizeof(*aw) + auth_count * sizeof(*aw->auths));
+	aw->cb = cb;
+
+	auth_iter_start(&it, link);
+	while ((auth = auth_iter_next(&it)) != NULL) {
+		if (auth->pass[0] && link->pass == NULL)
+			continue;
+		aw->auths[n++] = auth;
+		if (!auth->pass[0])
+			break;
+	}
+
+	/* nothing to check a password against */
+	if (n == 0 || !aw->auths[0]->pass[0]) {
+		auth = n == 0 ? NULL : auth_class(aw->auths[0]);
+		free(aw);
+		cb(link, auth);
+		return;
+	}
+
+	hashes = malloc(n * sizeof(*hashes));
+	for (i=0; i<n; i++)
+		hashes[i] = aw->auths[i]->pass[0] ? aw->auths[i]->pass : NULL;
+
+	u_verify_pass(link, hashes, n, link->pass, auth_verified, aw);
+	free(hashes);
+}
+
 u_oper_block *u_get_oper_by_name(char *name)
 {
 	return u_map_get(all_opers, name);
@@ -107,7 +330,7 @@ u_oper_block *u_find_oper(u_auth_block *auth, char *name, char *pass)
 	if (oper->auth != NULL && oper->auth != auth)
 		return NULL;
 
-	if (!matchhash(oper->pass, pass))
+	if (pass != NULL && !matchhash(oper->pass, pass))
 		return NULL;
 
 	return oper;
@@ -178,6 +401,26 @@ void conf_class_sendq(mowgli_config_file_t *cf, mowgli_config_file_entry_t *ce)
 	}
 }
 
+void conf_class_recvq(mowgli_config_file_t *cf, mowgli_config_file_entry_t *ce)
+{
+	cur_class->recvq = parse_size(ce->vardata);
+	if (cur_class->recvq < 1024) {
+		u_log(LG_WARN, msg_recvqtoosmall, cur_class->recvq,
+		      cur_class->name, 1024);
+		cur_class->recvq = 1024;
+	}
+}
+
+void conf_class_weight(mowgli_config_file_t *cf, mowgli_config_file_entry_t *ce)
+{
+	cur_class->weight = atoi(ce->vardata);
+	if (cur_class->weight < 1 || cur_class->weight > 1024) {
+		u_log(LG_WARN, msg_weightinvalid, cur_class->weight,
+		      cur_class->name, 1);
+		cur_class->weight = 1;
+	}
+}
+
 static u_auth_block *cur_auth = NULL;
 
 void conf_auth(mowgli_config_file_t *cf, mowgli_config_file_entry_t *ce)
@@ -192,6 +435,8 @@ void conf_auth(mowgli_config_file_t *cf, mowgli_config_file_entry_t *ce)
 	mowgli_node_add(cur_auth, &cur_auth->n, &auth_list);
 
 	u_conf_traverse(cf, ce->entries, u_conf_auth_handlers);
+
+	auth_insert(cur_auth);
 }
 
 void conf_auth_class(mowgli_config_file_t *cf, mowgli_config_file_entry_t *ce)
@@ -299,6 +544,8 @@ int init_auth(void)
 	u_conf_add_handler("class", conf_class, NULL);
 	u_conf_add_handler("timeout", conf_class_timeout, u_conf_class_handlers);
 	u_conf_add_handler("sendq", conf_class_sendq, u_conf_class_handlers);
+	u_conf_add_handler("recvq", conf_class_recvq, u_conf_class_handlers);
+	u_conf_add_handler("weight", conf_class_weight, u_conf_class_handlers);
 
 	u_conf_auth_handlers = mowgli_patricia_create(ascii_canonize);
 
@@ -0,0 +1,398 @@
+/* Tethys, ban.c -- compiled ban lists
+   Copyright (C) 2014 Alex Iadicicco
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+#include "ircd.h"
+
+/* extbans */
+/* ------- */
+
+typedef struct extban extb_t;
+
+struct extban {
+	char ch;
+	int (*cb)(struct extban*, u_chan*, u_user*, char *data);
+	void *priv;
+};
+
+static int ex_oper(extb_t *ex, u_chan *c, u_user *u, char *data)
+{
+	return IS_OPER(u);
+}
+
+static int ex_account(extb_t *ex, u_chan *c, u_user *u, char *data)
+{
+	if (!IS_LOGGED_IN(u))
+		return 0;
+	if (data == NULL)
+		return 1;
+	return streq(u->acct, data);
+}
+
+static int ex_channel(extb_t *ex, u_chan *c, u_user *u, char *data)
+{
+	u_chan *tc;
+	if (data == NULL)
+		return 0;
+	tc = u_chan_get(data);
+	if (tc == NULL || u_chan_user_find(tc, u) == NULL)
+		return 0;
+	return 1;
+}
+
+static int ex_gecos(extb_t *ex, u_chan *c, u_user *u, char *data)
+{
+	if (data == NULL)
+		return 0;
+	return match(data, u->gecos);
+}
+
+static extb_t extbans[] = {
+	{ 'o', ex_oper, NULL },
+	{ 'a', ex_account, NULL },
+	{ 'c', ex_channel, NULL },
+	{ 'r', ex_gecos, NULL },
+	{ 0 }
+};
+
+/* compiling */
+/* --------- */
+
+struct ban_suffix {
+	char *s;
+	size_t len;
+};
+
+struct ban_cidr {
+	int af;
+	uchar addr[16];
+	uint bits;
+};
+
+struct ban_ext {
+	extb_t *extb;
+	bool invert;
+	char *data;
+};
+
+struct ban_glob {
+	char *mask;
+	size_t len;
+	size_t pre, suf; /* lengths of the literal ends */
+	char *mid; /* the longest literal run between them, or NULL */
+};
+
+#define HOST_MASK "*!*@"
+
+static bool is_wild(char c)
+{
+	return c == '*' || c == '?';
+}
+
+static bool has_wild(char *s)
+{
+	return strpbrk(s, "*?") != NULL;
+}
+
+/* anything past the '@' that could make the host buckets disagree with
+   what match() would have said */
+static bool plain_host(char *s)
+{
+	return *s && !has_wild(s) && !strpbrk(s, "!@");
+}
+
+static bool parse_cidr(char *s, struct ban_cidr *cidr)
+{
+	char buf[INET6_ADDRSTRLEN];
+	char *slash, *end;
+	ulong bits;
+	uint max;
+
+	if ((slash = strchr(s, '/')) == NULL || slash - s >= sizeof(buf))
+		return false;
+
+	memcpy(buf, s, slash - s);
+	buf[slash - s] = '\0';
+
+	cidr->af = strchr(buf, ':') ? AF_INET6 : AF_INET;
+	max = cidr->af == AF_INET6 ? 128 : 32;
+
+	if (inet_pton(cidr->af, buf, cidr->addr) != 1)
+		return false;
+
+	bits = strtoul(slash + 1, &end, 10);
+	if (end == slash + 1 || *end || bits > max)
+		return false;
+
+	cidr->bits = bits;
+	return true;
+}
+
+static char *copy(char **arena, char *s)
+{
+	char *p = *arena;
+	size_t len = strlen(s) + 1;
+
+	memcpy(p, s, len);
+	*arena += len;
+
+	return p;
+}
+
+static void add_hash(u_hash **hash, char *key)
+{
+	uint h;
+
+	if (*hash == NULL)
+		*hash = u_hash_new(null_casemap);
+
+	h = u_hash_key(*hash, key);
+	if (u_hash_get_h(*hash, key, h) == NULL)
+		u_hash_add(*hash, key, h, key);
+}
+
+static void add_ext(u_banlist *bl, char *arena)
+{
+	struct ban_ext *ext = bl->exts + bl->nexts;
+	char *mask = arena + 1, *data;
+
+	if ((data = strchr(mask, ':')) != NULL)
+		*data++ = '\0';
+
+	ext->invert = (*mask == '~');
+	if (ext->invert)
+		mask++;
+
+	for (ext->extb = extbans; ext->extb->ch; ext->extb++) {
+		if (ext->extb->ch == *mask)
+			break;
+	}
+
+	/* unknown extbans never match, so there's no point keeping them */
+	if (!ext->extb->ch)
+		return;
+
+	ext->data = data;
+	bl->nexts++;
+}
+
+static void add_glob(u_banlist *bl, char **arena, char *mask)
+{
+	struct ban_glob *glob = bl->globs + bl->nglobs++;
+	size_t len = strlen(mask), run, best = 0;
+	char *p, *start = NULL;
+
+	glob->mask = mask;
+	glob->len = len;
+	for (glob->pre = 0; !is_wild(mask[glob->pre]); glob->pre++);
+	for (glob->suf = 0; !is_wild(mask[len - glob->suf - 1]); glob->suf++);
+
+	for (p = mask + glob->pre; p < mask + len - glob->suf; p += run + 1) {
+		for (run = 0; !is_wild(p[run]); run++);
+		if (run > best) {
+			best = run;
+			start = p;
+		}
+	}
+
+	glob->mid = NULL;
+	if (best > 0) {
+		glob->mid = *arena;
+		memcpy(glob->mid, start, best);
+		glob->mid[best] = '\0';
+		*arena += best + 1;
+	}
+}
+
+static void add_mask(u_banlist *bl, char **arena, char *s)
+{
+	char *mask = copy(arena, s);
+	char *host = mask + strlen(HOST_MASK);
+	struct ban_suffix *suffix;
+
+	if (mask[0] == '$') {
+		add_ext(bl, mask);
+		return;
+	}
+
+	if (!has_wild(mask)) {
+		add_hash(&bl->exact, mask);
+		return;
+	}
+
+	if (strncmp(mask, HOST_MASK, strlen(HOST_MASK)) != 0) {
+		add_glob(bl, arena, mask);
+		return;
+	}
+
+	if (plain_host(host)) {
+		if (strchr(host, '/')
+		    && parse_cidr(host, bl->cidrs + bl->ncidrs)) {
+			bl->ncidrs++;
+			return;
+		}
+
+		add_hash(&bl->hosts, host);
+		return;
+	}
+
+	if (host[0] == '*' && plain_host(host + 1)) {
+		suffix = bl->suffixes + bl->nsuffixes++;
+		suffix->s = host + 1;
+		suffix->len = strlen(suffix->s);
+		return;
+	}
+
+	add_glob(bl, arena, mask);
+}
+
+u_banlist *u_banlist_compile(mowgli_list_t *list, ulong gen)
+{
+	u_banlist *bl = calloc(1, sizeof(*bl));
+	mowgli_node_t *n;
+	u_listent *ban;
+	size_t size = 0;
+	uint count = 0;
+	char *arena;
+
+	MOWGLI_LIST_FOREACH(n, list->head) {
+		ban = n->data;
+		size += strlen(ban->mask) + 1;
+		count++;
+	}
+
+	bl->gen = gen;
+
+	if (count == 0)
+		return bl;
+
+	/* every bucket is sized for the whole list, which is at most a
+	   few hundred masks. globs can put a piece of themselves in the
+	   arena as well, so there's room for each mask twice */
+	bl->strings = arena = malloc(2 * size);
+	bl->suffixes = malloc(count * sizeof(*bl->suffixes));
+	bl->cidrs = malloc(count * sizeof(*bl->cidrs));
+	bl->exts = malloc(count * sizeof(*bl->exts));
+	bl->globs = malloc(count * sizeof(*bl->globs));
+
+	MOWGLI_LIST_FOREACH(n, list->head) {
+		ban = n->data;
+		add_mask(bl, &arena, ban->mask);
+	}
+
+	return bl;
+}
+
+void u_banlist_free(u_banlist *bl)
+{
+	if (bl == NULL)
+		return;
+
+	if (bl->exact)
+		u_hash_free(bl->exact);
+	if (bl->hosts)
+		u_hash_free(bl->hosts);
+	free(bl->suffixes);
+	free(bl->cidrs);
+	free(bl->exts);
+	free(bl->globs);
+	free(bl->strings);
+	free(bl);
+}
+
+/* matching */
+/* -------- */
+
+static bool match_cidr(struct ban_cidr *cidr, int af, uchar *addr)
+{
+	uint octs = cidr->bits / 8;
+	uint bits = cidr->bits % 8;
+	uchar mask;
+
+	if (cidr->af != af || memcmp(cidr->addr, addr, octs) != 0)
+		return false;
+
+	if (bits == 0)
+		return true;
+
+	mask = 0xff << (8 - bits);
+	return (cidr->addr[octs] & mask) == (addr[octs] & mask);
+}
+
+static bool match_cidrs(u_banlist *bl, u_user *u)
+{
+	uchar addr[16];
+	int af;
+	uint i;
+
+	af = strchr(u->ip, ':') ? AF_INET6 : AF_INET;
+	if (inet_pton(af, u->ip, addr) != 1)
+		return false;
+
+	for (i=0; i<bl->ncidrs; i++) {
+		if (match_cidr(bl->cidrs + i, af, addr))
+			return true;
+	}
+
+	return false;
+}
+
+static bool match_glob(struct ban_glob *glob, u_user *u)
+{
+	if (glob->pre + glob->suf > u->prefixlen)
+		return false;
+	if (memcmp(glob->mask, u->prefix, glob->pre) != 0)
+		return false;
+	if (memcmp(glob->mask + glob->len - glob->suf,
+	           u->prefix + u->prefixlen - glob->suf, glob->suf) != 0)
+		return false;
+	if (glob->mid && !strstr(u->prefix + glob->pre, glob->mid))
+		return false;
+
+	return match(glob->mask, u->prefix);
+}
+
+static bool match_ext(struct ban_ext *ext, u_chan *c, u_user *u)
+{
+	bool banned = ext->extb->cb(ext->extb, c, u, ext->data);
+	return ext->invert ? !banned : banned;
+}
+
+bool u_banlist_match(u_banlist *bl, u_chan *c, u_user *u)
+{
+	size_t hostlen;
+	uint i;
+
+	if (bl->exact && u_hash_get(bl->exact, u->prefix))
+		return true;
+
+	if (bl->hosts && u_hash_get(bl->hosts, u->host))
+		return true;
+
+	hostlen = u_istr_len(u->host);
+	for (i=0; i<bl->nsuffixes; i++) {
+		struct ban_suffix *suffix = bl->suffixes + i;
+		if (suffix->len <= hostlen && !memcmp(suffix->s,
+		    u->host + hostlen - suffix->len, suffix->len))
+			return true;
+	}
+
+	if (bl->ncidrs && match_cidrs(bl, u))
+		return true;
+
+	for (i=0; i<bl->nglobs; i++) {
+		if (match_glob(bl->globs + i, u))
+			return true;
+	}
+
+	for (i=0; i<bl->nexts; i++) {
+		if (match_ext(bl->exts + i, c, u))
+			return true;
+	}
+
+	return false;
+}
+
+/* vim: set noet: */
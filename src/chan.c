@@ -6,7 +6,7 @@
 
 #include "ircd.h"
 
-mowgli_patricia_t *all_chans;
+u_hash *all_chans;
 
 static ulong cmode_get_flag_bits(u_modes *m)
 {
@@ -73,7 +73,10 @@ static mowgli_list_t *cmode_get_list(u_modes *m, u_mode_info *info)
 static void cmode_sync(u_modes *m)
 {
 	u_chan *c = m->target;
-	u_cookie_inc(&c->ck_flags);
+	if (m->flags & MODE_LIST_CHANGE)
+		u_chan_lists_changed(c);
+	else
+		u_cookie_inc(&c->ck_flags);
 }
 
 static int cb_fwd(u_modes*, int, char*);
@@ -233,6 +236,9 @@ static int cb_join(u_modes *m, int on, char *arg)
 	return on;
 }
 
+static u_slab chan_slab = U_SLAB_INIT("channels", u_chan);
+static u_slab chanuser_slab = U_SLAB_INIT("chanusers", u_chanuser);
+
 static u_chan *chan_create_real(const char *name)
 {
 	u_chan *chan;
@@ -240,7 +246,7 @@ static u_chan *chan_create_real(const char *name)
 	if (!strchr(CHANTYPES, name[0]))
 		return NULL;
 
-	chan = malloc(sizeof(*chan));
+	chan = u_slab_alloc(&chan_slab);
 	u_strlcpy(chan->name, name, MAXCHANNAME+1);
 	chan->ts = NOW.tv_sec;
 	chan->topic[0] = '\0';
@@ -249,11 +255,16 @@ static u_chan *chan_create_real(const char *name)
 	chan->mode = cmode_default;
 	chan->flags = 0;
 	u_cookie_reset(&chan->ck_flags);
-	chan->members = u_map_new(0);
+	chan->members = NULL;
+	chan->nmembers = chan->maxmembers = 0;
+	chan->local_links = u_map_new(0);
+	chan->remote_links = u_map_new(0);
 	mowgli_list_init(&chan->ban);
 	mowgli_list_init(&chan->quiet);
 	mowgli_list_init(&chan->banex);
 	mowgli_list_init(&chan->invex);
+	chan->cban = chan->cquiet = chan->cbanex = chan->cinvex = NULL;
+	u_chan_lists_changed(chan);
 	chan->invites = u_map_new(0);
 	chan->forward = NULL;
 	chan->key = NULL;
@@ -262,14 +273,15 @@ static u_chan *chan_create_real(const char *name)
 	if (name[0] == '&')
 		chan->flags |= CHAN_LOCAL;
 
-	mowgli_patricia_add(all_chans, chan->name, chan);
+	chan->namehash = u_hash_key(all_chans, chan->name);
+	u_hash_add(all_chans, chan->name, chan->namehash, chan);
 
 	return chan;
 }
 
 u_chan *u_chan_get(char *name)
 {
-	return mowgli_patricia_retrieve(all_chans, name);
+	return u_hash_get(all_chans, name);
 }
 
 u_chan *u_chan_create(char *name)
@@ -319,17 +331,23 @@ void u_chan_drop(u_chan *chan)
 {
 	/* TODO: u_map_free callback! */
 	/* TODO: send PART to all users in this channel! */
-	u_map_free(chan->members);
+	free(chan->members);
+	u_map_free(chan->local_links);
+	u_map_free(chan->remote_links);
 	drop_list(&chan->ban);
 	drop_list(&chan->quiet);
 	drop_list(&chan->banex);
 	drop_list(&chan->invex);
+	u_banlist_free(chan->cban);
+	u_banlist_free(chan->cquiet);
+	u_banlist_free(chan->cbanex);
+	u_banlist_free(chan->cinvex);
 	u_clr_invites_chan(chan);
 	drop_param(&chan->forward);
 	drop_param(&chan->key);
 
-	mowgli_patricia_delete(all_chans, chan->name);
-	free(chan);
+	u_hash_del(all_chans, chan->namehash, chan);
+	u_slab_free(&chan_slab, chan);
 }
 
 char *u_chan_modes(u_chan *c, int on_chan)
@@ -457,13 +475,13 @@ int u_chan_send_topic(u_chan *c, u_user *u)
    *       *****    ***     **  = 11 */
 int u_chan_send_names(u_chan *c, u_user *u)
 {
-	u_map_each_state st;
 	u_strop_wrap wrap;
 	u_user *tu;
 	u_chanuser *cu;
 	mowgli_node_t *n;
 	char *s, pfx;
 	int sz;
+	uint i;
 
 	pfx = c->mode & CMODE_PRIVATE ? '*'
 	    : c->mode & CMODE_SECRET ? '@'
@@ -471,9 +489,10 @@ int u_chan_send_names(u_chan *c, u_user *u)
 
 	sz = strlen(me.name) + strlen(u->nick) + strlen(c->name) + 11;
 	u_strop_wrap_start(&wrap, 510 - sz);
-	U_MAP_EACH(&st, c->members, &tu, &cu) {
+	U_CHAN_EACH_MEMBER(c, i, cu) {
 		char *p, nbuf[MAXNICKLEN+3];
 
+		tu = cu->u;
 		p = nbuf;
 		MOWGLI_LIST_FOREACH(n, cu_pfx_list.head) {
 			u_cu_pfx *cs = n->data;
@@ -572,19 +591,103 @@ void u_clr_invites_user(u_user *u)
 	u_map_each(u->invites, (u_map_cb_t*)inv_user_cb, u);
 }
 
+/* the per-link member counts behind c->local_links and c->remote_links.
+   a user's link never changes while they are in channels. */
+static u_map *chan_links(u_chan *c, u_user *u)
+{
+	return IS_LOCAL_USER(u) ? c->local_links : c->remote_links;
+}
+
+static void chan_link_inc(u_chan *c, u_user *u)
+{
+	u_map *map = chan_links(c, u);
+	ulong n;
+
+	if (u->link == NULL)
+		return;
+
+	n = (ulong) u_map_get(map, u->link);
+	u_map_set(map, u->link, (void*) (n + 1));
+}
+
+static void chan_link_dec(u_chan *c, u_user *u)
+{
+	u_map *map = chan_links(c, u);
+	ulong n;
+
+	if (u->link == NULL)
+		return;
+
+	n = (ulong) u_map_get(map, u->link);
+	if (n > 1)
+		u_map_set(map, u->link, (void*) (n - 1));
+	else
+		u_map_del(map, u->link);
+}
+
+/* memberships */
+/* ----------- */
+
+static void cu_array_add(u_chanuser ***arr, uint *n, uint *max,
+                         u_chanuser *cu, uint *idx)
+{
+	if (*n == *max) {
+		*max = *max ? *max * 2 : 4;
+		*arr = realloc(*arr, *max * sizeof(**arr));
+	}
+
+	*idx = *n;
+	(*arr)[(*n)++] = cu;
+}
+
+static u_chanuser **chanhash_slot(u_user *u, u_chan *c)
+{
+	ulong h = (ulong) c;
+
+	h = (h >> 4) * 0x9e3779b1u;
+	return &u->chanhash[(h >> 8) & (u->chanhash_size - 1)];
+}
+
+static void chanhash_insert(u_user *u, u_chanuser *cu)
+{
+	u_chanuser **slot = chanhash_slot(u, cu->c);
+
+	cu->hash_next = *slot;
+	*slot = cu;
+}
+
+/* keeps the table at least as big as the number of channels */
+static void chanhash_grow(u_user *u)
+{
+	uint i;
+
+	if (u->nchannels < u->chanhash_size)
+		return;
+
+	free(u->chanhash);
+	u->chanhash_size = u->chanhash_size ? u->chanhash_size * 2 : 8;
+	u->chanhash = calloc(u->chanhash_size, sizeof(*u->chanhash));
+
+	for (i=0; i<u->nchannels; i++)
+		chanhash_insert(u, u->channels[i]);
+}
+
 /* XXX: assumes the chanuser doesn't already exist */
 u_chanuser *u_chan_user_add(u_chan *c, u_user *u)
 {
 	u_chanuser *cu;
 
-	cu = malloc(sizeof(*cu));
+	cu = u_slab_alloc(&chanuser_slab);
 	cu->flags = 0;
 	u_cookie_reset(&cu->ck_flags);
 	cu->c = c;
 	cu->u = u;
 
-	u_map_set(c->members, u, cu);
-	u_map_set(u->channels, c, cu);
+	cu_array_add(&c->members, &c->nmembers, &c->maxmembers, cu, &cu->c_idx);
+	chanhash_grow(u);
+	cu_array_add(&u->channels, &u->nchannels, &u->maxchannels, cu, &cu->u_idx);
+	chanhash_insert(u, cu);
+	chan_link_inc(c, u);
 
 	return cu;
 }
@@ -593,13 +696,22 @@ void u_chan_user_del(u_chanuser *cu)
 {
 	u_chan *c = cu->c;
 	u_user *u = cu->u;
+	u_chanuser **p;
+
+	c->members[cu->c_idx] = c->members[--c->nmembers];
+	c->members[cu->c_idx]->c_idx = cu->c_idx;
+
+	u->channels[cu->u_idx] = u->channels[--u->nchannels];
+	u->channels[cu->u_idx]->u_idx = cu->u_idx;
 
-	u_map_del(c->members, u);
-	u_map_del(u->channels, c);
+	for (p = chanhash_slot(u, c); *p != cu; p = &(*p)->hash_next);
+	*p = cu->hash_next;
 
-	free(cu);
+	chan_link_dec(c, u);
 
-	if (c->members->size == 0) {
+	u_slab_free(&chanuser_slab, cu);
+
+	if (c->nmembers == 0) {
 		u_log(LG_DEBUG, "u_chan_user_del: %C empty, dropping...", c);
 		u_chan_drop(c);
 	}
@@ -607,115 +719,84 @@ void u_chan_user_del(u_chanuser *cu)
 
 u_chanuser *u_chan_user_find(u_chan *c, u_user *u)
 {
-	return u_map_get(c->members, u);
-}
+	u_chanuser *cu;
 
-typedef struct extban extb_t;
+	if (u->chanhash_size == 0)
+		return NULL;
 
-struct extban {
-	char ch;
-	int (*cb)(struct extban*, u_chan*, u_user*, char *data);
-	void *priv;
-};
+	for (cu = *chanhash_slot(u, c); cu; cu = cu->hash_next) {
+		if (cu->c == c)
+			return cu;
+	}
 
-static int ex_oper(extb_t *ex, u_chan *c, u_user *u, char *data)
-{
-	return IS_OPER(u);
+	return NULL;
 }
 
-static int ex_account(extb_t *ex, u_chan *c, u_user *u, char *data)
-{
-	if (!IS_LOGGED_IN(u))
-		return 0;
-	if (data == NULL)
-		return 1;
-	return streq(u->acct, data);
-}
+static ulong lists_gen_next = 0;
 
-static int ex_channel(extb_t *ex, u_chan *c, u_user *u, char *data)
+void u_chan_lists_changed(u_chan *c)
 {
-	u_chan *tc;
-	if (data == NULL)
-		return 0;
-	tc = u_chan_get(data);
-	if (tc == NULL || u_chan_user_find(tc, u) == NULL)
-		return 0;
-	return 1;
+	/* a global counter rather than a cookie, so a generation is never
+	   seen twice, even on a different channel at the same address */
+	c->lists_gen = ++lists_gen_next;
+	u_cookie_inc(&c->ck_flags);
 }
 
-static int ex_gecos(extb_t *ex, u_chan *c, u_user *u, char *data)
+static u_banlist *get_banlist(u_chan *c, mowgli_list_t *list,
+                              u_banlist **bl)
 {
-	if (data == NULL)
-		return 0;
-	return match(data, u->gecos);
-}
+	if (*bl == NULL || (*bl)->gen != c->lists_gen) {
+		u_banlist_free(*bl);
+		*bl = u_banlist_compile(list, c->lists_gen);
+	}
 
-static extb_t extbans[] = {
-	{ 'o', ex_oper, NULL },
-	{ 'a', ex_account, NULL },
-	{ 'c', ex_channel, NULL },
-	{ 'r', ex_gecos, NULL },
-	{ 0 }
-};
+	return *bl;
+}
 
-static int matches_ban(u_chan *c, u_user *u, char *mask, char *host)
-{
-	char *data;
-	extb_t *extb = extbans;
-	int invert, banned;
-
-	if (*mask == '$') {
-		data = strchr(mask, ':');
-		if (data != NULL)
-			data++;
-		mask++;
-
-		invert = 0;
-		if (*mask == '~') {
-			invert = 1;
-			mask++;	
-		}
+#define BANLIST(C, L) get_banlist((C), &(C)->L, &(C)->c##L)
 
-		for (; extb->ch; extb++) {
-			if (extb->ch == *mask)
-				break;
-		}
+#define BAN_BANNED   0x1
+#define BAN_INVEXED  0x2
 
-		if (!extb->ch)
-			return 0;
+/* the part of u_entry_blocked that looks at the lists. the result is
+   kept on the user until the lists or their prefix change, unless
+   extbans were involved, since those look at everything else too */
+static uint check_lists(u_chan *c, u_user *u)
+{
+	u_banlist *ban, *banex, *invex;
+	uint res = 0;
 
-		banned = extb->cb(extb, c, u, data);
-		if (invert)
-			banned = !banned;
-		return banned;
-	}
+	if (u->ban_chan == c && u->ban_gen == c->lists_gen)
+		return u->ban_result;
 
-	return match(mask, host);
-}
+	ban = BANLIST(c, ban);
+	banex = BANLIST(c, banex);
+	invex = BANLIST(c, invex);
 
-static int is_in_list(u_chan *c, u_user *u, char *host, mowgli_list_t *list)
-{
-	mowgli_node_t *n;
-	u_listent *ban;
+	if (u_banlist_match(ban, c, u) && !u_banlist_match(banex, c, u))
+		res |= BAN_BANNED;
+	if (u_banlist_match(invex, c, u))
+		res |= BAN_INVEXED;
 
-	MOWGLI_LIST_FOREACH(n, list->head) {
-		ban = n->data;
-		if (matches_ban(c, u, ban->mask, host))
-			return 1;
+	if (U_BANLIST_HAS_EXT(ban) || U_BANLIST_HAS_EXT(banex)
+	    || U_BANLIST_HAS_EXT(invex)) {
+		u->ban_chan = NULL;
+	} else {
+		u->ban_chan = c;
+		u->ban_gen = c->lists_gen;
+		u->ban_result = res;
 	}
 
-	return 0;
+	return res;
 }
 
 int u_entry_blocked(u_chan *c, u_user *u, char *key)
 {
-	char host[BUFSIZE];
 	int invited = u_has_invite(c, u);
-
-	snf(FMT_USER, host, BUFSIZE, "%H", u);
+	uint lists = check_lists(c, u);
 
 	if ((c->mode & CMODE_INVITEONLY)) {
-		if (!is_in_list(c, u, host, &c->invex) && !invited)
+		if (!(lists & BAN_INVEXED) && !invited)
 			return ERR_INVITEONLYCHAN;
 	}
 
@@ -724,12 +805,10 @@ int u_entry_blocked(u_chan *c, u_user *u, char *key)
 			return ERR_BADCHANNELKEY;
 	}
 
-	if (is_in_list(c, u, host, &c->ban)) {
-		if (!is_in_list(c, u, host, &c->banex))
-			return ERR_BANNEDFROMCHAN;
-	}
+	if (lists & BAN_BANNED)
+		return ERR_BANNEDFROMCHAN;
 
-	if (c->limit > 0 && c->members->size >= c->limit && !invited)
+	if (c->limit > 0 && c->nmembers >= c->limit && !invited)
 		return ERR_CHANNELISFULL;
 
 	/* TODO: an invite also allows +j and +r to be bypassed */
@@ -758,10 +837,6 @@ u_chan *u_find_forward(u_chan *c, u_user *u, char *key)
 
 int u_is_muted(u_chanuser *cu)
 {
-	char buf[512];
-
-	snf(FMT_USER, buf, 512, "%H", cu->u);
-
 	if (u_cookie_cmp(&cu->ck_flags, &cu->c->ck_flags) >= 0)
 		return cu->flags & CU_MUTED;
 
@@ -771,7 +846,7 @@ int u_is_muted(u_chanuser *cu)
 	if (cu->flags & (CU_PFX_OP | CU_PFX_VOICE))
 		return 0;
 
-	if (!is_in_list(cu->c, cu->u, buf, &cu->c->quiet)
+	if (!u_banlist_match(BANLIST(cu->c, quiet), cu->c, cu->u)
 	    && !(cu->c->mode & CMODE_MODERATED))
 		return 0;
 
@@ -976,6 +1051,7 @@ static int dump_specific_chan(u_chan *ch, mowgli_json_t *j_chans)
 	u_map_each_state st;
 	u_user *u;
 	u_chanuser *cu;
+	uint mi;
 	mowgli_json_t *jch, *jmask, *jmasks, *jmasktype,
 	              *jinvites, *jinvite,
 	              *jmems, *jmem;
@@ -1037,7 +1113,8 @@ static int dump_specific_chan(u_chan *ch, mowgli_json_t *j_chans)
 	jmems = mowgli_json_create_object();
 	json_oseto  (jch, "members",       jmems);
 
-	U_MAP_EACH(&st, ch->members, &u, &cu) {
+	U_CHAN_EACH_MEMBER(ch, mi, cu) {
+		u = cu->u;
 		jmem = mowgli_json_create_object();
 		json_oseto(jmems, u->uid, jmem);
 		json_oseti(jmem,  "flags", cu->flags);
@@ -1051,12 +1128,12 @@ int dump_chan(void)
 {
 	int err;
 	u_chan *ch;
-	mowgli_patricia_iteration_state_t state;
+	uint pos;
 
 	mowgli_json_t *j_chans = mowgli_json_create_object();
 	json_oseto(upgrade_json, "channels", j_chans);
 
-	MOWGLI_PATRICIA_FOREACH(ch, &state, all_chans) {
+	U_HASH_EACH(all_chans, pos, &ch) {
 		if ((err = dump_specific_chan(ch, j_chans)) < 0)
 			return err;
 	}
@@ -1071,7 +1148,7 @@ int init_chan(void)
 {
 	int i;
 
-	if (!(all_chans = mowgli_patricia_create(ascii_canonize)))
+	if (!(all_chans = u_hash_new(ascii_casemap)))
 		return -1;
 
 	u_bitmask_reset(&cmode_flags);
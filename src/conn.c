@@ -10,6 +10,17 @@
 
 static mowgli_list_t awaiting_cleanup;
 
+/* connections with new data in their send queue. these are flushed
+   once per eventloop iteration, so a flood of lines to the same
+   connection turns into a single write rather than a write (and
+   epoll_ctl) per line */
+static mowgli_list_t dirty;
+
+/* connections with input they've read but not finished processing.
+   each one gets a turn per eventloop iteration, in order, and doesn't
+   read anything new until it's caught up. see run_queue */
+static mowgli_list_t runq;
+
 /* forward declarations */
 
 static void rdns_start(u_conn*, const struct sockaddr*, socklen_t);
@@ -25,18 +36,26 @@ static void set_recv(u_conn *conn, mowgli_eventloop_io_cb_t *cb);
 static void set_send(u_conn *conn, mowgli_eventloop_io_cb_t *cb);
 
 static void sync_on_update(u_conn *conn);
+static void mark_dirty(u_conn *conn);
 
 /* connection creation and shutdown */
 /* -------------------------------- */
 
+static u_slab conn_slab = U_SLAB_INIT("conns", u_conn);
+
 static u_conn *conn_create(mowgli_eventloop_t *ev, u_conn_ctx *ctx,
                            void *priv, int fd,
                            const struct sockaddr *sa, socklen_t salen)
 {
-	u_conn *conn = calloc(1, sizeof(u_conn));
+	u_conn *conn = u_slab_alloc(&conn_slab);
 	conn->state = U_CONN_INVALID;
 	conn->poll = mowgli_pollable_create(ev, fd, conn);
 
+	if (salen > sizeof(conn->addr))
+		salen = sizeof(conn->addr);
+	memcpy(&conn->addr, sa, salen);
+	conn->addrlen = salen;
+
 	if (! u_ntop((struct sockaddr*) sa, conn->ip)) {
 		/* this is not the best thing to do, but whatever */
 		u_strlcpy(conn->ip, "127.0.0.1", sizeof(conn->ip));
@@ -62,16 +81,21 @@ static void final_cleanup(u_conn *conn)
 		conn->ctx->cleanup(conn);
 
 	if (conn->dnsq)
-		mowgli_dns_delete_query(base_dns, conn->dnsq);
+		u_dns_cancel(conn->dnsq);
 
 	u_sendq_clear(&conn->sendq);
 
+	if (conn->flags & U_CONN_DIRTY)
+		mowgli_node_delete(&conn->dirty_n, &dirty);
+	if (conn->flags & U_CONN_RUNNABLE)
+		mowgli_node_delete(&conn->run_n, &runq);
+
 	mowgli_pollable_destroy(ev, conn->poll);
 	close(fd);
 
 	mowgli_node_delete(&conn->n, &awaiting_cleanup);
 
-	free(conn);
+	u_slab_free(&conn_slab, conn);
 }
 
 static int make_nonblocking(int fd)
@@ -139,21 +163,7 @@ u_conn *u_conn_accept(mowgli_eventloop_t *ev, u_conn_ctx *ctx, void *priv,
 
 	set_recv(conn, recv_ready);
 
-	if (addrlen == sizeof(struct sockaddr_in6)) {
-
-		u_strlcpy(conn->host, conn->ip, U_CONN_HOSTSIZE);
-
-		/*
-		 * We're going to skip DNS resolution of IPv6 hosts for now,
-		 * as it doesn't seem to "work". Therefore, make sure the RDNS
-		 * wait flag is cleared, otherwise the client cannot register.
-		 */
-		u_link* link = conn->priv;
-		link->flags &= ~U_LINK_WAIT_RDNS;
-
-	} else {
-		rdns_start(conn, (struct sockaddr*) &addr, addrlen);
-	}
+	rdns_start(conn, (struct sockaddr*) &addr, addrlen);
 
 	return conn;
 }
@@ -214,73 +224,38 @@ static void fatal_error(u_conn *conn, const char *msg, int err)
 	mark_for_cleanup(conn);
 }
 
+void u_conn_close(u_conn *conn)
+{
+	u_sendq_clear(&conn->sendq);
+	mark_for_cleanup(conn);
+}
+
 /* RDNS */
 /* ---- */
 
-struct rdns_query {
-	u_conn *conn;
-	mowgli_dns_query_t q;
-};
+/* lookups go through the cache in dns.c, which also checks the name
+   forwards. the conn's host stays as its IP unless that works out */
 
-static void rdns_callback(mowgli_dns_reply_t *reply, int reason, void *vptr)
+static void rdns_done(const char *host, const char *err, void *priv)
 {
-	struct rdns_query *q = vptr;
-	u_conn *conn = q->conn;
-	const char *rstr = "Unknown error";
-
-	sync_time();
-
-	if (reply && reply->addr.addr.ss_family != AF_INET) {
-		/* XXX: but why? */
-		reply = NULL;
-		rstr = "IPv4 RDNS only";
-		reason = 0;
-	}
-
-	if (reply == NULL) {
-		u_strlcpy(conn->host, conn->ip, U_CONN_HOSTSIZE);
-
-		switch (reason) {
-		case MOWGLI_DNS_RES_NXDOMAIN:
-			rstr = "No such domain";
-			break;
-		case MOWGLI_DNS_RES_INVALID:
-			rstr = "Invalid domain";
-			break;
-		case MOWGLI_DNS_RES_TIMEOUT:
-			rstr = "Request timeout";
-			break;
-		}
-	} else {
-		/* TODO: initiate forward DNS check here */
-
-		u_strlcpy(conn->host, reply->h_name, U_CONN_HOSTSIZE);
-		rstr = NULL;
-	}
+	u_conn *conn = priv;
 
 	conn->dnsq = NULL;
-	free(q);
+
+	u_strlcpy(conn->host, host ? host : conn->ip, U_CONN_HOSTSIZE);
 
 	if (conn->ctx->rdns_finish != NULL)
-		conn->ctx->rdns_finish(conn, rstr);
+		conn->ctx->rdns_finish(conn, err);
 }
 
 static void rdns_start(u_conn *conn, const struct sockaddr *sa, socklen_t alen)
 {
-	struct rdns_query *q;
-
-	q = calloc(1, sizeof(*q));
-	q->conn = conn;
-	q->q.ptr = q;
-	q->q.callback = rdns_callback;
-
-	conn->dnsq = &q->q;
-
-	mowgli_dns_gethost_byaddr(base_dns, (struct sockaddr_storage*)sa,
-	                          conn->dnsq);
-
+	/* a cached answer comes back before u_dns_rdns returns, so the
+	   context has to hear about the start first */
 	if (conn->ctx->rdns_start != NULL)
 		conn->ctx->rdns_start(conn);
+
+	conn->dnsq = u_dns_rdns(sa, rdns_done, conn);
 }
 
 /* User data transfer API */
@@ -316,6 +291,11 @@ ssize_t u_conn_recv(u_conn *conn, uchar *data, size_t sz)
 	if (rsz < 0) {
 		int e = errno;
 
+		/* callers that read until the socket is drained will see
+		   this. it's not an error */
+		if (e == EAGAIN || e == EWOULDBLOCK)
+			return -1;
+
 		/* TODO: determine if error is recoverable */
 		u_perror("read");
 
@@ -336,11 +316,9 @@ ssize_t u_conn_send(u_conn *conn, const uchar *data, size_t sz)
 	if (!send_permitted(conn))
 		return 0;
 
-	/* TODO */
+	sz = u_sendq_put(&conn->sendq, data, sz);
 
-	return 0;
-
-	sync_on_update(conn);
+	mark_dirty(conn);
 
 	return sz;
 }
@@ -354,11 +332,27 @@ size_t u_conn_end_send_buffer(u_conn *conn, size_t sz)
 {
 	sz = u_sendq_end_buffer(&conn->sendq, sz);
 
-	sync_on_update(conn);
+	mark_dirty(conn);
+
+	return sz;
+}
+
+size_t u_conn_put_line(u_conn *conn, u_sendq_line *line)
+{
+	size_t sz = u_sendq_put_line(&conn->sendq, line);
+
+	mark_dirty(conn);
 
 	return sz;
 }
 
+void u_conn_put_sendq(u_conn *conn, u_sendq *q)
+{
+	u_sendq_move(&conn->sendq, q);
+
+	mark_dirty(conn);
+}
+
 void u_conn_sendq_clear(u_conn *conn)
 {
 	u_sendq_clear(&conn->sendq);
@@ -429,7 +423,7 @@ static void send_ready(mowgli_eventloop_t *ev, mowgli_eventloop_io_t *io,
 
 	sz = u_sendq_write(&conn->sendq, conn->poll->fd);
 
-	if (sz < 0) {
+	if (sz < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
 		int e = errno;
 
 		/* TODO: determine if error is recoverable */
@@ -439,17 +433,26 @@ static void send_ready(mowgli_eventloop_t *ev, mowgli_eventloop_io_t *io,
 		return;
 	}
 
+	if (sz == 0 && conn->ctx->drain)
+		conn->ctx->drain(conn);
+
 	sync_on_update(conn);
 }
 
 static void set_recv(u_conn *conn, mowgli_eventloop_io_cb_t *cb)
 {
+	if (conn->recv_cb == cb)
+		return;
+	conn->recv_cb = cb;
 	mowgli_pollable_setselect(conn->poll->eventloop, conn->poll,
 	                          MOWGLI_EVENTLOOP_IO_READ, cb);
 }
 
 static void set_send(u_conn *conn, mowgli_eventloop_io_cb_t *cb)
 {
+	if (conn->send_cb == cb)
+		return;
+	conn->send_cb = cb;
 	mowgli_pollable_setselect(conn->poll->eventloop, conn->poll,
 	                          MOWGLI_EVENTLOOP_IO_WRITE, cb);
 }
@@ -460,7 +463,7 @@ static void sync_on_update(u_conn *conn)
 
 	switch (conn->state) {
 	case U_CONN_ACTIVE:
-		use_recv = true;
+		use_recv = !(conn->flags & U_CONN_RUNNABLE);
 		set_send(conn, conn->sendq.size > 0 ? send_ready : NULL);
 		break;
 
@@ -481,26 +484,150 @@ static void sync_on_update(u_conn *conn)
 	set_recv(conn, use_recv ? recv_ready : NULL);
 }
 
+/* deferred flushing */
+/* ----------------- */
+
+static void mark_dirty(u_conn *conn)
+{
+	if (conn->flags & U_CONN_DIRTY)
+		return;
+
+	conn->flags |= U_CONN_DIRTY;
+	mowgli_node_add(conn, &conn->dirty_n, &dirty);
+}
+
+static void flush_one(u_conn *conn)
+{
+	size_t size = conn->sendq.size;
+	int e;
+
+	/* shutting down connections are already waiting on send_ready,
+	   and nothing else is allowed to write */
+	if (conn->state != U_CONN_ACTIVE)
+		return;
+
+	/* if we're already waiting for the socket to become writable,
+	   there's no point trying now. send_ready will get to it */
+	if (conn->send_cb == NULL) {
+		while (conn->sendq.size > 0) {
+			if (u_sendq_write(&conn->sendq, conn->poll->fd) == 0)
+				continue;
+
+			e = errno;
+			if (e == EAGAIN || e == EWOULDBLOCK)
+				break;
+
+			/* TODO: determine if error is recoverable */
+			u_perror("send");
+
+			fatal_error(conn, "Write error", e);
+			return;
+		}
+	}
+
+	if (conn->sendq.size < size && conn->ctx->drain)
+		conn->ctx->drain(conn);
+
+	sync_on_update(conn);
+}
+
+static void flush_dirty(void)
+{
+	u_conn *conn;
+
+	/* flushing can cause errors, which can queue more data on other
+	   connections. those get added to the tail and flushed here too */
+	while (dirty.head != NULL) {
+		conn = dirty.head->data;
+		mowgli_node_delete(&conn->dirty_n, &dirty);
+		conn->flags &= ~U_CONN_DIRTY;
+
+		flush_one(conn);
+	}
+}
+
+/* input scheduling */
+/* ---------------- */
+
+void u_conn_schedule(u_conn *conn)
+{
+	if (conn->flags & U_CONN_RUNNABLE)
+		return;
+
+	conn->flags |= U_CONN_RUNNABLE;
+	mowgli_node_add(conn, &conn->run_n, &runq);
+
+	sync_on_update(conn);
+}
+
+/* gives every conn that was waiting at the start one turn. a conn
+   that still has work afterwards goes to the back of the queue, and
+   one that's done goes back to reading from its socket */
+static void run_queue(void)
+{
+	u_conn *conn;
+	size_t n;
+	bool more;
+
+	for (n = runq.count; n > 0 && runq.head != NULL; n--) {
+		conn = runq.head->data;
+		mowgli_node_delete(&conn->run_n, &runq);
+
+		more = false;
+		if (conn->state == U_CONN_ACTIVE && conn->ctx->run)
+			more = conn->ctx->run(conn);
+
+		if (more) {
+			mowgli_node_add(conn, &conn->run_n, &runq);
+			continue;
+		}
+
+		conn->flags &= ~U_CONN_RUNNABLE;
+		sync_on_update(conn);
+	}
+}
+
 /* main() API */
 /* ---------- */
 
+/* nothing needs doing here. it's only so the loop wakes up at least
+   once a second to run timers while everything is quiet */
+static void heartbeat(void *unused)
+{
+	sync_time();
+}
+
 void u_conn_run(mowgli_eventloop_t *ev)
 {
 	mowgli_node_t *n, *tn;
 
+	mowgli_timer_add(ev, "heartbeat", heartbeat, NULL, 1);
+
 	while (!ev->death_requested) {
-		mowgli_eventloop_run_once(ev);
+		sync_time();
+		u_timer_run();
+
+		run_queue();
+		flush_dirty();
 
 		MOWGLI_LIST_FOREACH_SAFE(n, tn, awaiting_cleanup.head) {
 			u_conn *conn = n->data;
 			final_cleanup(conn);
 		}
+
+		/* don't sleep while there's input waiting to be processed */
+		if (runq.count > 0)
+			mowgli_eventloop_timeout_once(ev, 0);
+		else
+			mowgli_eventloop_run_once(ev);
 	}
 }
 
 int init_conn(void)
 {
 	mowgli_list_init(&awaiting_cleanup);
+	mowgli_list_init(&dirty);
+	mowgli_list_init(&runq);
 
 	return 0;
 }
@@ -564,7 +691,7 @@ u_conn *u_conn_from_json(
 	mowgli_json_t *jpoll, *jsq;
 	mowgli_string_t *jsip, *jshost;
 
-	conn = calloc(1, sizeof(*conn));
+	conn = u_slab_alloc(&conn_slab);
 	u_sendq_init(&conn->sendq);
 
 	if (json_ogetu(jc, "state", &conn->state) < 0)
@@ -583,6 +710,10 @@ u_conn *u_conn_from_json(
 	memcpy(conn->ip, jsip->str, jsip->pos);
 	conn->ip[jsip->pos] = '\0';
 
+	conn->addrlen = sizeof(conn->addr);
+	if (!u_pton(conn->ip, (struct sockaddr*) &conn->addr, &conn->addrlen))
+		conn->addrlen = 0;
+
 	jshost = json_ogets(jc, "host");
 	if (!jshost || jshost->pos > U_CONN_HOSTSIZE)
 		goto error;
@@ -603,11 +734,10 @@ u_conn *u_conn_from_json(
 		conn->ctx->attach(conn);
 
 	/* If RDNS was pending, reissue the query. */
-	struct sockaddr_storage addr;
-	socklen_t addrlen = sizeof(addr);
 	if (json_ogetb(jc, "rdns_pending")) {
-		if (u_pton(conn->ip, (struct sockaddr*) &addr, &addrlen)) {
-			rdns_start(conn, (struct sockaddr*) &addr, addrlen);
+		if (conn->addrlen > 0) {
+			rdns_start(conn, (struct sockaddr*) &conn->addr,
+			           conn->addrlen);
 		} else {
 			u_log(LG_WARN, "restoring client IP [%s] failed", conn->ip);
 		}
@@ -625,7 +755,7 @@ error:
 		close(fd);
 		/* Closing fds means this function fails non-idempotently. */
 	}
-	free(conn);
+	u_slab_free(&conn_slab, conn);
 	return NULL;
 }
 
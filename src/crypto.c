@@ -6,6 +6,25 @@
 
 #include "ircd.h"
 
+#ifdef HAVE_CRYPT_R
+#include <crypt.h>
+#endif
+
+/* passwords are checked from the verify threads as well as the event
+   loop. crypt_r keeps its state where it's told to, so checks can run
+   side by side. plain crypt() keeps it in a static buffer, and has to
+   be taken one at a time */
+#if defined(HAVE_PTHREAD) && !defined(HAVE_CRYPT_R)
+#include <pthread.h>
+
+static pthread_mutex_t crypt_lock = PTHREAD_MUTEX_INITIALIZER;
+#define CRYPT_LOCK() pthread_mutex_lock(&crypt_lock)
+#define CRYPT_UNLOCK() pthread_mutex_unlock(&crypt_lock)
+#else
+#define CRYPT_LOCK()
+#define CRYPT_UNLOCK()
+#endif
+
 static char *crypt_alpha =
   "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789./";
 static size_t crypt_alpha_len = 64;
@@ -32,15 +51,26 @@ static int gen_salt_posix(char *buf)
 
 static int hash_posix(char *buf, char *key, char *salt)
 {
+#ifdef HAVE_CRYPT_R
+	/* this is a big structure, but the threads have plenty of stack */
+	struct crypt_data data;
+#endif
 	char *h;
 
 	u_strlcpy(buf, salt, 4);
 	if (strlen(salt) < 5 || !streq(buf, "$p$"))
 		return -1;
 
-	h = (char*)crypt(key, salt + 3);
 	strcpy(buf, "$p$");
-	u_strlcpy(buf + 3, h, CRYPTLEN - 3);
+	CRYPT_LOCK();
+#ifdef HAVE_CRYPT_R
+	memset(&data, 0, sizeof(data));
+	h = crypt_r(key, salt + 3, &data);
+#else
+	h = (char*)crypt(key, salt + 3);
+#endif
+	u_strlcpy(buf + 3, h ? h : "", CRYPTLEN - 3);
+	CRYPT_UNLOCK();
 	return 0;
 }
 #endif /* ifdef HAVE_CRYPT */
@@ -85,7 +115,7 @@ void u_crypto_gen_salt(char *buf)
 	return;
 }
 
-void u_crypto_hash(char *buf, char *key, char *salt)
+static u_crypto *do_hash(char *buf, char *key, char *salt)
 {
 	u_crypto *cur;
 
@@ -94,12 +124,28 @@ void u_crypto_hash(char *buf, char *key, char *salt)
 			continue;
 		if (cur->hash(buf, key, salt) < 0)
 			continue;
-		u_log(LG_DEBUG, "%s hash (salt %s) %s", cur->name, salt, buf);
-		return;
+		return cur;
 	}
 
-	u_log(LG_WARN, "Could not hash! (salt %s)", salt);
 	buf[0] = 0;
+	return NULL;
+}
 
-	return;
+void u_crypto_hash(char *buf, char *key, char *salt)
+{
+	u_crypto *cur;
+
+	if ((cur = do_hash(buf, key, salt)) == NULL) {
+		u_log(LG_WARN, "Could not hash! (salt %s)", salt);
+		return;
+	}
+
+	u_log(LG_DEBUG, "%s hash (salt %s) %s", cur->name, salt, buf);
+}
+
+bool u_crypto_check(char *hash, char *key)
+{
+	char buf[CRYPTLEN];
+
+	return do_hash(buf, key, hash) != NULL && streq(buf, hash);
 }
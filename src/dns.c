@@ -0,0 +1,359 @@
+/* Tethys, dns.c -- cached reverse DNS
+   Copyright (C) 2014 Alex Iadicicco
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+#include "ircd.h"
+
+/* mowgli doesn't pass on the TTLs in the answers it gets, so these are
+   ours. failures are kept for less time than names, and timeouts less
+   than anything, since those are likelier to be our own problem */
+#define DNS_TTL_FOUND    3600
+#define DNS_TTL_FAILED    300
+#define DNS_TTL_MISMATCH   60
+#define DNS_TTL_TIMEOUT    30
+
+/* forward lookups tried before giving up on a mismatch. see
+   fwd_callback */
+#define DNS_FWD_TRIES       3
+
+/* answers kept, not counting lookups in progress. about 4MB worth */
+#define DNS_CACHE_MAX   16384
+
+enum dns_state {
+	DNS_PTR,
+	DNS_FORWARD,
+	DNS_DONE,
+};
+
+struct dns_entry {
+	char key[INET6_ADDRSTRLEN];
+	uint hash;
+
+	struct sockaddr_storage addr;
+	enum dns_state state;
+
+	char host[MAXHOST+1]; /* empty if there isn't one */
+	const char *err;
+	time_t expires;
+	int fwd_tries;
+
+	mowgli_dns_query_t q_ptr, q_fwd;
+	mowgli_list_t waiters; /* while in progress */
+	mowgli_node_t n; /* in lru while done */
+};
+
+struct u_dns_req {
+	struct dns_entry *e;
+	u_dns_cb_t *cb;
+	void *priv;
+	mowgli_node_t n;
+};
+
+static u_slab entry_slab = U_SLAB_INIT("dns", struct dns_entry);
+static u_slab req_slab = U_SLAB_INIT("dnsreq", u_dns_req);
+
+static u_hash *entries = NULL;
+static mowgli_list_t lru; /* most recently used first */
+
+static ulong dns_hits = 0;
+static ulong dns_misses = 0;
+static ulong dns_coalesced = 0;
+static ulong dns_pending = 0;
+static ulong dns_evicted = 0;
+
+static const uchar v4_mapped[12] =
+	{ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+
+/* v4-mapped addresses become v4 ones, since that's what the PTR record
+   will be under */
+static bool normalize(const struct sockaddr *sa, struct sockaddr_storage *ss)
+{
+	const struct sockaddr_in6 *sin6 = (const void*) sa;
+	struct sockaddr_in *sin = (void*) ss;
+
+	memset(ss, 0, sizeof(*ss));
+
+	switch (sa->sa_family) {
+	case AF_INET:
+		memcpy(ss, sa, sizeof(struct sockaddr_in));
+		return true;
+
+	case AF_INET6:
+		if (!memcmp(&sin6->sin6_addr, v4_mapped, sizeof(v4_mapped))) {
+			sin->sin_family = AF_INET;
+			memcpy(&sin->sin_addr, (uchar*) &sin6->sin6_addr
+			       + sizeof(v4_mapped), 4);
+			return true;
+		}
+		memcpy(ss, sa, sizeof(struct sockaddr_in6));
+		return true;
+	}
+
+	return false;
+}
+
+static bool same_addr(struct sockaddr_storage *a, struct sockaddr_storage *b)
+{
+	if (a->ss_family != b->ss_family)
+		return false;
+
+	switch (a->ss_family) {
+	case AF_INET:
+		return !memcmp(&((struct sockaddr_in*) a)->sin_addr,
+		               &((struct sockaddr_in*) b)->sin_addr, 4);
+	case AF_INET6:
+		return !memcmp(&((struct sockaddr_in6*) a)->sin6_addr,
+		               &((struct sockaddr_in6*) b)->sin6_addr, 16);
+	}
+
+	return false;
+}
+
+/* anything else would end up in prefixes and on the wire */
+static bool valid_host(const char *s)
+{
+	const char *p;
+
+	if (*s == '\0' || *s == '.' || *s == '-')
+		return false;
+
+	for (p=s; *p; p++) {
+		if (!isalnum((uchar) *p) && *p != '.' && *p != '-')
+			return false;
+	}
+
+	return true;
+}
+
+/* the cache */
+/* --------- */
+
+static void entry_drop(struct dns_entry *e)
+{
+	u_hash_del(entries, e->hash, e);
+	mowgli_node_delete(&e->n, &lru);
+	u_slab_free(&entry_slab, e);
+}
+
+static struct dns_entry *entry_new(const char *key, uint hash)
+{
+	struct dns_entry *e;
+
+	/* only answers can be thrown out, so lookups in progress can go
+	   past the limit. there's at most one per connection */
+	while (lru.count >= DNS_CACHE_MAX) {
+		entry_drop(lru.tail->data);
+		dns_evicted++;
+	}
+
+	e = u_slab_alloc(&entry_slab);
+	u_strlcpy(e->key, key, sizeof(e->key));
+	e->hash = hash;
+	u_hash_add(entries, e->key, e->hash, e);
+
+	return e;
+}
+
+static void finish(struct dns_entry *e, const char *err, int ttl)
+{
+	u_dns_req *req;
+	const char *host;
+
+	if (err != NULL)
+		e->host[0] = '\0';
+	e->err = err;
+	e->expires = NOW.tv_sec + ttl;
+	e->state = DNS_DONE;
+
+	mowgli_node_add_head(e, &e->n, &lru);
+	dns_pending--;
+
+	host = e->host[0] ? e->host : NULL;
+
+	while (e->waiters.head != NULL) {
+		req = e->waiters.head->data;
+		mowgli_node_delete(&req->n, &e->waiters);
+		req->cb(host, err, req->priv);
+		u_slab_free(&req_slab, req);
+	}
+}
+
+static void failed(struct dns_entry *e, int reason)
+{
+	switch (reason) {
+	case MOWGLI_DNS_RES_NXDOMAIN:
+		finish(e, "No such domain", DNS_TTL_FAILED);
+		break;
+	case MOWGLI_DNS_RES_INVALID:
+		finish(e, "Invalid domain", DNS_TTL_FAILED);
+		break;
+	case MOWGLI_DNS_RES_TIMEOUT:
+		finish(e, "Request timeout", DNS_TTL_TIMEOUT);
+		break;
+	default:
+		finish(e, "Unknown error", DNS_TTL_TIMEOUT);
+		break;
+	}
+}
+
+static void fwd_start(struct dns_entry *e)
+{
+	mowgli_dns_gethost_byname(base_dns, e->host, &e->q_fwd,
+	                          e->addr.ss_family == AF_INET6 ?
+	                          MOWGLI_DNS_T_AAAA : MOWGLI_DNS_T_A);
+}
+
+static void fwd_callback(mowgli_dns_reply_t *reply, int reason, void *vptr)
+{
+	struct dns_entry *e = vptr;
+
+	sync_time();
+
+	if (reply == NULL) {
+		failed(e, reason);
+		return;
+	}
+
+	/* mowgli only gives back the first address in the answer, so a
+	   name with several A or AAAA records can look like a mismatch
+	   when it isn't. resolvers usually rotate the records, so ask a
+	   few times before deciding, and don't hold a mismatch for long */
+	if (!same_addr(&reply->addr.addr, &e->addr)) {
+		if (++e->fwd_tries < DNS_FWD_TRIES) {
+			fwd_start(e);
+			return;
+		}
+		finish(e, "Forward lookup didn't match", DNS_TTL_MISMATCH);
+		return;
+	}
+
+	finish(e, NULL, DNS_TTL_FOUND);
+}
+
+static void ptr_callback(mowgli_dns_reply_t *reply, int reason, void *vptr)
+{
+	struct dns_entry *e = vptr;
+
+	sync_time();
+
+	if (reply == NULL) {
+		failed(e, reason);
+		return;
+	}
+
+	if (strlen(reply->h_name) > MAXHOST) {
+		finish(e, "Hostname too long", DNS_TTL_FAILED);
+		return;
+	}
+
+	if (!valid_host(reply->h_name)) {
+		finish(e, "Invalid hostname", DNS_TTL_FAILED);
+		return;
+	}
+
+	u_strlcpy(e->host, reply->h_name, sizeof(e->host));
+	e->state = DNS_FORWARD;
+	e->fwd_tries = 0;
+
+	fwd_start(e);
+}
+
+static void start(struct dns_entry *e)
+{
+	e->state = DNS_PTR;
+	e->host[0] = '\0';
+	e->err = NULL;
+	dns_pending++;
+
+	e->q_ptr.ptr = e->q_fwd.ptr = e;
+	e->q_ptr.callback = ptr_callback;
+	e->q_fwd.callback = fwd_callback;
+
+	mowgli_dns_gethost_byaddr(base_dns, &e->addr, &e->q_ptr);
+}
+
+/* API */
+/* --- */
+
+static void dns_init(void)
+{
+	entries = u_hash_new(null_casemap);
+}
+
+u_dns_req *u_dns_rdns(const struct sockaddr *sa, u_dns_cb_t *cb, void *priv)
+{
+	struct sockaddr_storage ss;
+	struct dns_entry *e;
+	char key[INET6_ADDRSTRLEN+1];
+	u_dns_req *req;
+	uint hash;
+
+	if (entries == NULL)
+		dns_init();
+
+	if (!normalize(sa, &ss) || !u_ntop((struct sockaddr*) &ss, key)) {
+		cb(NULL, "Unknown address family", priv);
+		return NULL;
+	}
+
+	hash = u_hash_key(entries, key);
+	e = u_hash_get_h(entries, key, hash);
+
+	if (e != NULL && e->state == DNS_DONE) {
+		if (e->expires > NOW.tv_sec) {
+			dns_hits++;
+			mowgli_node_delete(&e->n, &lru);
+			mowgli_node_add_head(e, &e->n, &lru);
+			cb(e->host[0] ? e->host : NULL, e->err, priv);
+			return NULL;
+		}
+
+		/* stale. look it up again in the same entry */
+		mowgli_node_delete(&e->n, &lru);
+		dns_misses++;
+		start(e);
+	} else if (e != NULL) {
+		dns_coalesced++;
+	} else {
+		dns_misses++;
+		e = entry_new(key, hash);
+		memcpy(&e->addr, &ss, sizeof(ss));
+		start(e);
+	}
+
+	/* the query could in theory have failed already */
+	if (e->state == DNS_DONE) {
+		cb(e->host[0] ? e->host : NULL, e->err, priv);
+		return NULL;
+	}
+
+	req = u_slab_alloc(&req_slab);
+	req->e = e;
+	req->cb = cb;
+	req->priv = priv;
+	mowgli_node_add(req, &req->n, &e->waiters);
+
+	return req;
+}
+
+void u_dns_cancel(u_dns_req *req)
+{
+	/* the lookup carries on, since somebody else is likely to want
+	   the answer soon */
+	mowgli_node_delete(&req->n, &req->e->waiters);
+	u_slab_free(&req_slab, req);
+}
+
+void u_dns_get_stats(u_dns_stats *st)
+{
+	st->hits = dns_hits;
+	st->misses = dns_misses;
+	st->coalesced = dns_coalesced;
+	st->entries = lru.count;
+	st->pending = dns_pending;
+	st->evicted = dns_evicted;
+}
+
+/* vim: set noet: */
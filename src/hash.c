@@ -0,0 +1,266 @@
+/* Tethys, hash.c -- case-folded string hash tables
+   Copyright (C) 2014 Alex Iadicicco
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+#include "ircd.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Objects live in ents, in the order they were added, so iteration
+   doesn't depend on the hashes. Deleting an object leaves a hole, which
+   is squeezed out the next time the tag table is rebuilt. Adding
+   rebuilds it early once there are more holes than objects, so churn
+   doesn't grow ents forever.
+
+   The tag table is split into groups of 16 bytes. A tag is either
+   empty, deleted, or the top 7 bits of a hash with the high bit set,
+   and slots holds the ents index for each tag. A lookup starts at the
+   group picked by the low bits of the hash and compares all 16 tags at
+   once, only looking at the entries whose tags match. It stops at the
+   first group with an empty tag. */
+
+struct u_hash_ent {
+	const char *key;
+	uint hash;
+	void *data;
+};
+
+#define GROUP 16
+
+#define TAG_EMPTY   0x00
+#define TAG_DELETED 0x01
+#define TAG(h)      (0x80 | ((h) >> 25))
+
+/* the tag table is rebuilt when it's 7/8 full */
+#define MAX_USED(ngroups) ((ngroups) * GROUP / 8 * 7)
+
+/* and ents is squeezed when there are more holes than objects. the
+   slack keeps small tables from being rebuilt on every add */
+#define TOO_HOLEY(h) ((h)->nents - (h)->size > (h)->size + 16)
+
+static uint group_match(const uchar *t, uchar tag)
+{
+#ifdef __SSE2__
+	__m128i v = _mm_loadu_si128((__m128i*) t);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(tag)));
+#else
+	uint i, mask = 0;
+
+	for (i=0; i<GROUP; i++) {
+		if (t[i] == tag)
+			mask |= 1 << i;
+	}
+
+	return mask;
+#endif
+}
+
+static bool fold_eq(const char *casemap, const char *a, const char *b)
+{
+	for (; *a; a++, b++) {
+		if (casemap[(uchar)*a] != casemap[(uchar)*b])
+			return false;
+	}
+
+	return *b == '\0';
+}
+
+u_hash *u_hash_new(const char *casemap)
+{
+	u_hash *h = calloc(1, sizeof(*h));
+
+	h->casemap = casemap;
+
+	h->ngroups = 16;
+	h->tags = calloc(h->ngroups, GROUP);
+	h->slots = malloc(h->ngroups * GROUP * sizeof(*h->slots));
+
+	return h;
+}
+
+void u_hash_free(u_hash *h)
+{
+	free(h->tags);
+	free(h->slots);
+	free(h->ents);
+	free(h);
+}
+
+uint u_hash_key(u_hash *h, const char *key)
+{
+	uint hash = 2166136261u;
+
+	for (; *key; key++)
+		hash = (hash ^ (uchar)h->casemap[(uchar)*key]) * 16777619u;
+
+	/* FNV's low bits are weak for short keys, and those pick the
+	   group. mix the high bits down */
+	hash ^= hash >> 15;
+	hash *= 0x2c1b3c6d;
+	hash ^= hash >> 12;
+
+	return hash;
+}
+
+/* puts a tag for ents[idx] in the first free spot of its probe chain */
+static void place(u_hash *h, uint hash, uint idx)
+{
+	uint g, mask = h->ngroups - 1;
+	uint m, i;
+
+	for (g = hash & mask; ; g = (g + 1) & mask) {
+		uchar *t = h->tags + g * GROUP;
+
+		m = group_match(t, TAG_EMPTY) | group_match(t, TAG_DELETED);
+		if (m == 0)
+			continue;
+
+		i = g * GROUP + __builtin_ctz(m);
+		if (h->tags[i] == TAG_EMPTY)
+			h->used++;
+		h->tags[i] = TAG(hash);
+		h->slots[i] = idx;
+		return;
+	}
+}
+
+/* squeezes the holes out of ents and rebuilds the tag table, growing
+   it if the live entries alone would fill more than half of it */
+static void rebuild(u_hash *h)
+{
+	uint i, n;
+
+	for (i=0, n=0; i<h->nents; i++) {
+		if (h->ents[i].data != NULL)
+			h->ents[n++] = h->ents[i];
+	}
+	h->nents = n;
+
+	while (h->size * 2 > h->ngroups * GROUP)
+		h->ngroups *= 2;
+
+	free(h->tags);
+	free(h->slots);
+	h->tags = calloc(h->ngroups, GROUP);
+	h->slots = malloc(h->ngroups * GROUP * sizeof(*h->slots));
+	h->used = 0;
+
+	for (i=0; i<h->nents; i++)
+		place(h, h->ents[i].hash, i);
+}
+
+/* finds the tag for a key, or for a particular object if data isn't
+   NULL. returns its index, or -1 */
+static int find(u_hash *h, const char *key, uint hash, void *data)
+{
+	uint g, n, mask = h->ngroups - 1;
+	uint m, i;
+	u_hash_ent *e;
+
+	for (g = hash & mask, n = 0; n < h->ngroups; g = (g + 1) & mask, n++) {
+		uchar *t = h->tags + g * GROUP;
+
+		for (m = group_match(t, TAG(hash)); m; m &= m - 1) {
+			i = g * GROUP + __builtin_ctz(m);
+			e = &h->ents[h->slots[i]];
+
+			if (e->hash != hash)
+				continue;
+			if (data ? e->data == data : fold_eq(h->casemap, e->key, key))
+				return i;
+		}
+
+		if (group_match(t, TAG_EMPTY))
+			break;
+	}
+
+	return -1;
+}
+
+void *u_hash_get_h(u_hash *h, const char *key, uint hash)
+{
+	int i = find(h, key, hash, NULL);
+
+	return i < 0 ? NULL : h->ents[h->slots[i]].data;
+}
+
+void *u_hash_get(u_hash *h, const char *key)
+{
+	return u_hash_get_h(h, key, u_hash_key(h, key));
+}
+
+void u_hash_add(u_hash *h, const char *key, uint hash, void *data)
+{
+	u_hash_ent *e;
+
+	/* not from u_hash_del, since deleting during iteration has to
+	   leave everything where it is */
+	if (h->used + 1 > MAX_USED(h->ngroups) || TOO_HOLEY(h))
+		rebuild(h);
+
+	if (h->nents == h->maxents) {
+		h->maxents = h->maxents ? h->maxents * 2 : 64;
+		h->ents = realloc(h->ents, h->maxents * sizeof(*h->ents));
+	}
+
+	e = &h->ents[h->nents];
+	e->key = key;
+	e->hash = hash;
+	e->data = data;
+
+	place(h, hash, h->nents++);
+	h->size++;
+}
+
+void u_hash_del(u_hash *h, uint hash, void *data)
+{
+	int i = find(h, NULL, hash, data);
+
+	if (i < 0)
+		return;
+
+	h->ents[h->slots[i]].data = NULL;
+	h->tags[i] = TAG_DELETED;
+	h->size--;
+}
+
+void u_hash_rekey(u_hash *h, void *data, uint oldhash,
+                  const char *key, uint hash)
+{
+	int i = find(h, NULL, oldhash, data);
+	uint idx;
+
+	if (i < 0) {
+		u_hash_add(h, key, hash, data);
+		return;
+	}
+
+	idx = h->slots[i];
+	h->tags[i] = TAG_DELETED;
+	h->ents[idx].key = key;
+	h->ents[idx].hash = hash;
+
+	/* either way, the object keeps its place in iteration order */
+	if (h->used + 1 > MAX_USED(h->ngroups))
+		rebuild(h);
+	else
+		place(h, hash, idx);
+}
+
+bool u_hash_each_next(u_hash *h, uint *pos, void **data)
+{
+	for (; *pos < h->nents; (*pos)++) {
+		if (h->ents[*pos].data != NULL) {
+			*data = h->ents[(*pos)++].data;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* vim: set noet: */
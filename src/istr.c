@@ -0,0 +1,132 @@
+/* Tethys, istr.c -- interned strings
+   Copyright (C) 2014 Alex Iadicicco
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+#include "ircd.h"
+
+struct istr {
+	uint refs;
+	uint hash; /* in istrs */
+	ushort len;
+	char s[];
+};
+
+#define ISTR_HDR offsetof(struct istr, s)
+
+/* sized so the longest host, gecos, ident and account strings each fit
+   a class with little room to spare */
+static u_slab istr_slabs[] = {
+	U_SLAB_INIT_SIZE("istr32",   32),
+	U_SLAB_INIT_SIZE("istr48",   48),
+	U_SLAB_INIT_SIZE("istr64",   64),
+	U_SLAB_INIT_SIZE("istr96",   96),
+	U_SLAB_INIT_SIZE("istr144", 144),
+	U_SLAB_INIT_SIZE("istr272", 272),
+};
+
+char u_istr_empty[] = "";
+
+static u_hash *istrs = NULL;
+
+static ulong istr_refs = 0;
+static size_t istr_bytes = 0;
+
+static u_slab *slab_for(size_t len)
+{
+	int i;
+
+	for (i=0; ISTR_HDR + len + 1 > istr_slabs[i].size; i++)
+		continue;
+
+	return istr_slabs + i;
+}
+
+static void istr_init(void)
+{
+	istrs = u_hash_new(null_casemap);
+}
+
+char *u_istr_get(const char *s, size_t max)
+{
+	char buf[U_ISTR_MAX+1];
+	struct istr *is;
+	size_t len;
+	uint hash;
+
+	len = strnlen(s, max);
+	if (len == 0)
+		return u_istr_empty;
+
+	if (s[len] != '\0') {
+		memcpy(buf, s, len);
+		buf[len] = '\0';
+		s = buf;
+	}
+
+	if (istrs == NULL)
+		istr_init();
+
+	istr_refs++;
+
+	hash = u_hash_key(istrs, s);
+	if ((is = u_hash_get_h(istrs, s, hash)) != NULL) {
+		is->refs++;
+		return is->s;
+	}
+
+	is = u_slab_alloc(slab_for(len));
+	is->refs = 1;
+	is->hash = hash;
+	is->len = len;
+	memcpy(is->s, s, len + 1);
+
+	u_hash_add(istrs, is->s, hash, is);
+	istr_bytes += len;
+
+	return is->s;
+}
+
+void u_istr_put(char *s)
+{
+	struct istr *is;
+
+	if (s == NULL || s == u_istr_empty)
+		return;
+
+	is = containerof(s, struct istr, s);
+	istr_refs--;
+
+	if (--is->refs > 0)
+		return;
+
+	u_hash_del(istrs, is->hash, is);
+	istr_bytes -= is->len;
+	u_slab_free(slab_for(is->len), is);
+}
+
+void u_istr_set(char **p, const char *s, size_t max)
+{
+	char *old = *p;
+
+	*p = u_istr_get(s, max);
+	u_istr_put(old);
+}
+
+size_t u_istr_len(const char *s)
+{
+	if (s == u_istr_empty)
+		return 0;
+
+	return ((struct istr*) containerof(s, struct istr, s))->len;
+}
+
+void u_istr_get_stats(u_istr_stats *st)
+{
+	st->strings = istrs ? istrs->size : 0;
+	st->refs = istr_refs;
+	st->bytes = istr_bytes;
+}
+
+/* vim: set noet: */
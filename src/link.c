@@ -6,28 +6,190 @@
 
 #include "ircd.h"
 
+/* the most a server link will read in one go before letting the event
+   loop service other connections */
+#define SERVER_READ_BUDGET (1 << 20)
+
+/* how many lines a link with weight 1 gets to dispatch per turn */
+#define DISPATCH_QUANTUM 8
+
+/* input buffers */
+/* ------------- */
+
+/* A link only holds an input buffer while it has a partial line
+   waiting, and gives it back as soon as dispatch_lines has used up
+   everything it read. Buffers of the default sizes are kept on free
+   lists, threaded through the buffers themselves, so a busy client
+   isn't going through malloc on every read and an idle one costs
+   nothing. Other sizes come straight from malloc. */
+struct ibuf_pool {
+	size_t size;
+	int backlog_max;
+
+	void *free;
+	int nfree;
+
+	ulong hits, misses;
+};
+
+static struct ibuf_pool ibuf_pools[U_LINK_NUM_IBUF_POOLS] = {
+	{ IBUFSIZE,        1024 },
+	{ IBUFSIZE_SERVER,    8 },
+};
+
+static ulong ibufs_live = 0;
+static ulong ibufs_high = 0;
+static size_t ibufs_mem = 0;
+
+static struct ibuf_pool *find_pool(size_t size)
+{
+	int i;
+
+	for (i=0; i<U_LINK_NUM_IBUF_POOLS; i++) {
+		if (ibuf_pools[i].size == size)
+			return &ibuf_pools[i];
+	}
+
+	return NULL;
+}
+
+static uchar *ibuf_get(size_t size)
+{
+	struct ibuf_pool *pool = find_pool(size);
+	uchar *buf;
+
+	if (pool && pool->free) {
+		buf = pool->free;
+		pool->free = *(void**)buf;
+		pool->nfree--;
+		pool->hits++;
+	} else {
+		if (pool)
+			pool->misses++;
+		buf = malloc(size + 1);
+	}
+
+	ibufs_mem += size;
+	if (++ibufs_live > ibufs_high)
+		ibufs_high = ibufs_live;
+
+	return buf;
+}
+
+static void ibuf_put(uchar *buf, size_t size)
+{
+	struct ibuf_pool *pool = find_pool(size);
+
+	ibufs_mem -= size;
+	ibufs_live--;
+
+	if (!pool || pool->nfree >= pool->backlog_max) {
+		free(buf);
+		return;
+	}
+
+	*(void**)buf = pool->free;
+	pool->free = buf;
+	pool->nfree++;
+}
+
+static void link_ibuf_take(u_link *link)
+{
+	if (link->ibuf != NULL)
+		return;
+
+	link->ibufsize = link->recvq;
+	link->ibuf = ibuf_get(link->ibufsize);
+	link->ibuflen = link->ibufscan = 0;
+}
+
+static void link_ibuf_drop(u_link *link)
+{
+	if (link->ibuf == NULL || link->ibuflen > 0)
+		return;
+
+	ibuf_put(link->ibuf, link->ibufsize);
+	link->ibuf = NULL;
+	link->ibufscan = 0;
+}
+
+/* only ever called with a partial line pending, otherwise the buffer
+   would have been dropped and taken again at the new size */
+static void resize_ibuf(u_link *link)
+{
+	size_t size = link->recvq;
+
+	if (size < link->ibuflen)
+		size = link->ibuflen;
+	if (size == link->ibufsize)
+		return;
+
+	/* the old buffer might have come from a pool. it doesn't matter,
+	   since the pools don't keep track of what they've handed out */
+	ibufs_mem = ibufs_mem - link->ibufsize + size;
+	link->ibuf = realloc(link->ibuf, size + 1);
+	link->ibufsize = size;
+}
+
+void u_link_get_ibuf_stats(u_link_ibuf_stats *st)
+{
+	int i;
+
+	st->live = ibufs_live;
+	st->high = ibufs_high;
+	st->mem = ibufs_mem;
+
+	for (i=0; i<U_LINK_NUM_IBUF_POOLS; i++) {
+		st->pool[i].size = ibuf_pools[i].size;
+		st->pool[i].free = ibuf_pools[i].nfree;
+		st->pool[i].hits = ibuf_pools[i].hits;
+		st->pool[i].misses = ibuf_pools[i].misses;
+	}
+}
+
+/* links */
+/* ----- */
+
+static u_slab link_slab = U_SLAB_INIT("links", u_link);
+
+static void on_timer(u_timer*);
+
 static u_link *link_create(void)
 {
 	u_link *link;
 
-	link = calloc(1, sizeof(*link));
+	link = u_slab_alloc(&link_slab);
+	u_sendq_init(&link->held);
+
+	link->recvq = IBUFSIZE;
+
+	u_timer_init(&link->timer, on_timer);
+	link->last_recv = NOW.tv_sec;
+	u_timer_set(&link->timer, LINK_REGISTER_TIMEOUT);
 
 	return link;
 }
 
 static void link_destroy(u_link *link)
 {
+	u_timer_del(&link->timer);
+	u_verify_cancel(link);
+
 	if (link->pass != NULL)
 		free(link->pass);
 
-	free(link);
+	u_sendq_clear(&link->held);
+
+	if (link->ibuf != NULL)
+		ibuf_put(link->ibuf, link->ibufsize);
+	u_slab_free(&link_slab, link);
 }
 
 /* conn interaction */
 /* ---------------- */
 
 static void exceptional_quit(u_link *link, char *msg, ...);
-static void dispatch_lines(u_link*);
+static bool dispatch_lines(u_link*);
 
 static void on_attach(u_conn *conn)
 {
@@ -71,8 +233,11 @@ static void on_excess_flood(u_conn *conn)
 
 static void on_sendq_full(u_conn *conn)
 {
-	exceptional_quit(conn->priv, "SendQ full");
+	u_link *link = conn->priv;
+
+	exceptional_quit(link, "SendQ full");
 
+	u_sendq_clear(&link->held);
 	u_conn_sendq_clear(conn);
 	u_conn_shut_down(conn);
 }
@@ -80,22 +245,64 @@ static void on_sendq_full(u_conn *conn)
 static void on_data_ready(u_conn *conn)
 {
 	u_link *link = conn->priv;
+	size_t budget, want;
 	ssize_t sz;
 
-	if (link->ibuflen == IBUFSIZE) {
-		on_excess_flood(conn);
-		return;
-	}
+	/* clients get one read per wakeup, so a busy client can't starve
+	   the others. servers keep reading until the socket is drained or
+	   they've used up their budget. a short read means the kernel had
+	   nothing more for us, so don't bother with another read just to
+	   see EAGAIN */
+	budget = link->type == LINK_SERVER ? SERVER_READ_BUDGET : 0;
+
+	for (;;) {
+		if (link->ibuf == NULL)
+			link_ibuf_take(link);
+		else if (link->recvq != link->ibufsize)
+			resize_ibuf(link);
+
+		if (link->ibuflen == link->ibufsize) {
+			on_excess_flood(conn);
+			return;
+		}
 
-	sz = u_conn_recv(conn, link->ibuf + link->ibuflen,
-	                 IBUFSIZE - link->ibuflen);
+		want = link->ibufsize - link->ibuflen;
+		sz = u_conn_recv(conn, link->ibuf + link->ibuflen, want);
 
-	if (sz <= 0)
-		return;
+		if (sz <= 0) {
+			link_ibuf_drop(link);
+			return;
+		}
+
+		link->ibuflen += sz;
+		link->last_recv = NOW.tv_sec;
+
+		/* if there are lines left after this link's turn, stop
+		   reading and let the run queue hand out the rest */
+		if (dispatch_lines(link)) {
+			u_conn_schedule(conn);
+			break;
+		}
+
+		if ((size_t)sz < want || (size_t)sz >= budget)
+			break;
+		if (link->flags & (U_LINK_WAIT | U_LINK_SENT_QUIT))
+			break;
+		budget -= sz;
+	}
+}
+
+static void on_drain(u_conn *conn)
+{
+	u_link *link = conn->priv;
 
-	link->ibuflen += sz;
+	if (link->type == LINK_SERVER && !(link->flags & U_LINK_SENT_QUIT))
+		u_server_burst_continue(link->priv);
+}
 
-	dispatch_lines(link);
+static bool on_run(u_conn *conn)
+{
+	return dispatch_lines(conn->priv);
 }
 
 static void on_end_of_stream(u_conn *conn)
@@ -125,7 +332,74 @@ static void on_rdns_finish(u_conn *conn, const char *msg)
 
 	link->flags &= ~U_LINK_WAIT_RDNS;
 
-	dispatch_lines(link);
+	/* cached answers come back while the link is still being set up,
+	   so leave any waiting lines to the run queue */
+	if (link->ibuf != NULL)
+		u_conn_schedule(conn);
+}
+
+/* timeouts */
+/* -------- */
+
+static int link_timeout(u_link *link)
+{
+	u_class_block *cls = NULL;
+
+	switch (link->type) {
+	case LINK_USER:
+		if (link->conf.auth)
+			cls = link->conf.auth->cls;
+		break;
+	case LINK_SERVER:
+		if (link->conf.link)
+			cls = link->conf.link->cls;
+		break;
+	default:
+		break;
+	}
+
+	/* registered links always have a block, but just in case, this
+	   is the default class's */
+	return cls ? cls->timeout : 300;
+}
+
+static void on_timer(u_timer *t)
+{
+	u_link *link = containerof((uchar*) t, u_link, timer);
+	int timeout, idle;
+
+	/* it was told to go away and hasn't. stop waiting on it */
+	if (link->flags & U_LINK_SENT_QUIT) {
+		u_conn_close(link->conn);
+		return;
+	}
+
+	if (!(link->flags & U_LINK_REGISTERED)) {
+		exceptional_quit(link, "Registration timed out");
+		u_link_f(link, "ERROR :Registration timed out");
+		u_conn_shut_down(link->conn);
+		return;
+	}
+
+	timeout = link_timeout(link);
+	idle = NOW.tv_sec - link->last_recv;
+
+	if (idle < timeout) {
+		link->flags &= ~U_LINK_SENT_PING;
+		u_timer_set(t, timeout - idle);
+		return;
+	}
+
+	if (!(link->flags & U_LINK_SENT_PING)) {
+		u_link_f(link, "PING :%s", me.name);
+		link->flags |= U_LINK_SENT_PING;
+		u_timer_set(t, timeout);
+		return;
+	}
+
+	exceptional_quit(link, "Ping timeout: %d seconds", idle);
+	u_link_f(link, "ERROR :Ping timeout");
+	u_conn_shut_down(link->conn);
 }
 
 u_conn_ctx u_link_conn_ctx = {
@@ -136,6 +410,8 @@ u_conn_ctx u_link_conn_ctx = {
 	.cleanup          = on_cleanup,
 
 	.data_ready       = on_data_ready,
+	.drain            = on_drain,
+	.run              = on_run,
 	.end_of_stream    = on_end_of_stream,
 	.rdns_start       = on_rdns_start,
 	.rdns_finish      = on_rdns_finish,
@@ -155,11 +431,17 @@ static void exceptional_quit(u_link *link, char *msg, ...)
 
 	link->flags |= U_LINK_SENT_QUIT;
 
+	/* whatever it was, the link should be gone soon. if the other end
+	   won't take what's left in its send queue, the timer closes it */
+	u_timer_set(&link->timer, LINK_CLOSE_GRACE);
+
 	switch (link->type) {
 	case LINK_USER:
 		u_sendto_visible(link->priv, ST_USERS, ":%H QUIT :%s",
 		                 link->priv, buf);
-		u_sendto_servers(NULL, ":%H QUIT :%s", link->priv, buf);
+		/* servers only hear about users once they've registered */
+		if (link->flags & U_LINK_REGISTERED)
+			u_sendto_servers(NULL, ":%H QUIT :%s", link->priv, buf);
 		u_user_destroy(link->priv);
 		break;
 
@@ -173,15 +455,25 @@ static void exceptional_quit(u_link *link, char *msg, ...)
 	}
 }
 
-static void dispatch_lines(u_link *link)
+/* dispatches up to the link's quota of lines. returns true if it
+   stopped because of the quota, i.e. there may be more to do */
+static bool dispatch_lines(u_link *link)
 {
 	uchar *buf;
-	size_t buflen;
+	size_t buflen, scan;
 	uchar *s, *p;
 	u_msg msg;
+	int quota;
+	bool more = false;
+
+	if (link->ibuf == NULL)
+		return false;
+
+	quota = DISPATCH_QUANTUM * (link->weight > 0 ? link->weight : 1);
 
 	buf = link->ibuf;
 	buflen = link->ibuflen;
+	scan = link->ibufscan;
 
 	/* i don't really ever comment my code, as it's mostly very straight
 	   forward and relatively self-documenting. but C string processing
@@ -196,18 +488,22 @@ static void dispatch_lines(u_link *link)
 		if (link->flags & U_LINK_WAIT)
 			break;
 
-		/* find the next \r and \n */
-		s = memchr(buf, '\r', buflen);
-		p = memchr(buf, '\n', buflen);
-
-		/* if no line endings in buffer, we're done */
-		if (!s && !p)
+		if (quota-- == 0) {
+			more = true;
 			break;
+		}
+
+		/* find the closest line ending, skipping over anything
+		   we've already looked at on a previous read */
+		s = (uchar*)u_strop_eol((char*)buf + scan, buflen - scan);
 
-		/* if p is closer than s, then put p in s */
-		if (!s || (p && p < s))
-			s = p;
-		/* s now contains the closest line ending */
+		/* if no line endings in buffer, we're done. remember
+		   that, so the next read only has to scan the new data */
+		if (!s) {
+			scan = buflen;
+			break;
+		}
+		scan = 0;
 
 		/* delete all contiguous line endings at s */
 		for (p = s; *p == '\r' || *p == '\n'; p++)
@@ -236,11 +532,27 @@ static void dispatch_lines(u_link *link)
 	/* move remaining buffer contents to the start of the in buffer */
 	memmove(link->ibuf, link->ibuf + link->ibuflen - buflen, buflen);
 	link->ibuflen = buflen;
+	link->ibufscan = scan;
 	link->ibufskip = 0;
+
+	link_ibuf_drop(link);
+
+	return more;
 }
 
 void u_link_flush_input(u_link *link) {
-	dispatch_lines(link);
+	if (dispatch_lines(link))
+		u_conn_schedule(link->conn);
+}
+
+/* sets the size of the link's input buffer. 0 picks the default for the
+   link type. this is usually called while a line from the link is being
+   dispatched, so it only takes effect on the next read */
+void u_link_set_recvq(u_link *link, size_t size)
+{
+	if (size == 0)
+		size = link->type == LINK_SERVER ? IBUFSIZE_SERVER : IBUFSIZE;
+	link->recvq = size;
 }
 
 /* user API */
@@ -278,6 +590,24 @@ void u_link_fatal(u_link *link, const char *msg)
 	u_conn_shut_down(link->conn);
 }
 
+static bool sendq_full(u_link *link, size_t sz)
+{
+	if (link->sendq <= 0)
+		return false;
+
+	sz += link->conn->sendq.size + link->held.size;
+	return sz > link->sendq;
+}
+
+/* see u_server_burst_hides */
+static bool held_hidden(u_link *link, const uchar *line, size_t len)
+{
+	if (link->type != LINK_SERVER || link->priv == NULL)
+		return false;
+
+	return u_server_burst_hides(link->priv, line, len);
+}
+
 void u_link_vf(u_link *link, const char *fmt, va_list va)
 {
 	uchar *buf;
@@ -287,12 +617,15 @@ void u_link_vf(u_link *link, const char *fmt, va_list va)
 	if (!link)
 		return;
 
-	if (link->sendq > 0 && link->conn->sendq.size + 512 > link->sendq) {
+	if (sendq_full(link, 512)) {
 		on_sendq_full(link->conn);
 		return;
 	}
 
-	buf = u_conn_get_send_buffer(link->conn, 512);
+	if (link->flags & U_LINK_HOLD_OUTPUT)
+		buf = u_sendq_get_buffer(&link->held, 512);
+	else
+		buf = u_conn_get_send_buffer(link->conn, 512);
 
 	if (buf == NULL) {
 		on_sendq_full(link->conn);
@@ -312,7 +645,14 @@ void u_link_vf(u_link *link, const char *fmt, va_list va)
 	buf[sz++] = '\r';
 	buf[sz++] = '\n';
 
-	u_conn_end_send_buffer(link->conn, sz);
+	if (link->flags & U_LINK_HOLD_OUTPUT) {
+		/* not ended, so the space is used again by the next line */
+		if (held_hidden(link, buf, sz))
+			return;
+		u_sendq_end_buffer(&link->held, sz);
+	} else {
+		u_conn_end_send_buffer(link->conn, sz);
+	}
 }
 
 void u_link_f(u_link *link, const char *fmt, ...)
@@ -324,6 +664,51 @@ void u_link_f(u_link *link, const char *fmt, ...)
 	va_end(va);
 }
 
+void u_link_put_line(u_link *link, u_sendq_line *line)
+{
+	size_t sz;
+
+	if (!link)
+		return;
+
+	if (sendq_full(link, line->len)) {
+		on_sendq_full(link->conn);
+		return;
+	}
+
+	if (link->flags & U_LINK_HOLD_OUTPUT) {
+		if (held_hidden(link, line->data, line->len))
+			return;
+		sz = u_sendq_put_line(&link->held, line);
+	} else {
+		sz = u_conn_put_line(link->conn, line);
+	}
+
+	/* out of sendq memory */
+	if (sz == 0 && line->len > 0)
+		on_sendq_full(link->conn);
+}
+
+/* server links carry everything behind them, so dropping one for the
+   sake of the global budget would do more harm than it saves. their
+   class sendq still applies */
+void u_link_exempt_budget(u_link *link)
+{
+	link->held.exempt = true;
+	link->conn->sendq.exempt = true;
+}
+
+void u_link_hold_output(u_link *link)
+{
+	link->flags |= U_LINK_HOLD_OUTPUT;
+}
+
+void u_link_release_output(u_link *link)
+{
+	link->flags &= ~U_LINK_HOLD_OUTPUT;
+	u_conn_put_sendq(link->conn, &link->held);
+}
+
 void u_link_vnum(u_link *link, const char *tgt, int num, va_list va)
 {
 	char buf[4096];
@@ -581,9 +966,13 @@ mowgli_json_t *u_link_to_json(u_link *link)
 	json_oseti  (jl, "type",  link->type);
 	json_osets  (jl, "pass",  link->pass);
 	json_oseti  (jl, "sendq", link->sendq);
+	json_oseti  (jl, "recvq", link->recvq);
 	json_oseto  (jl, "ck_sendto", u_cookie_to_json(&link->ck_sendto));
 	json_oseto  (jl, "conn",  u_conn_to_json(link->conn));
-	json_osetb64(jl, "ibuf",  link->ibuf + link->ibufskip, link->ibuflen - link->ibufskip);
+	if (link->ibuf != NULL)
+		json_osetb64(jl, "ibuf", link->ibuf + link->ibufskip, link->ibuflen - link->ibufskip);
+	else
+		json_osetb64(jl, "ibuf", "", 0);
 
 	switch (link->type) {
 		case LINK_USER:
@@ -608,6 +997,7 @@ u_link *u_link_from_json(mowgli_json_t *jl)
 	mowgli_json_t *jcookie, *jconn;
 	mowgli_string_t *jpass, *jslinkname;
 	ssize_t sz;
+	int recvq;
 
 	link = link_create();
 
@@ -618,11 +1008,18 @@ u_link *u_link_from_json(mowgli_json_t *jl)
 	if (json_ogeti(jl, "sendq", &link->sendq) < 0)
 		goto error;
 
-	if ((sz = json_ogetb64(jl, "ibuf", link->ibuf, IBUFSIZE)) < 0)
+	/* older dumps won't have this, and use the default */
+	if (!json_ogeti(jl, "recvq", &recvq))
+		recvq = 0;
+	u_link_set_recvq(link, recvq);
+	link_ibuf_take(link);
+
+	if ((sz = json_ogetb64(jl, "ibuf", link->ibuf, link->ibufsize)) < 0)
 		goto error;
 
 	link->ibuflen = sz;
 	link->ibuf[link->ibuflen] = '\0';
+	link_ibuf_drop(link);
 
 	jpass = json_ogets(jl, "pass");
 	if (jpass) {
@@ -657,6 +1054,7 @@ u_link *u_link_from_json(mowgli_json_t *jl)
 				link->conf.auth = u_find_auth(link);
 				if (!link->conf.auth)
 					goto error;
+				link->weight = link->conf.auth->cls->weight;
 			}
 
 			break;
@@ -670,6 +1068,8 @@ u_link *u_link_from_json(mowgli_json_t *jl)
 			link->conf.link = u_find_link(jslinkname->str);
 			if (!link->conf.link)
 				goto error;
+			link->weight = link->conf.link->cls->weight;
+			u_link_exempt_budget(link);
 
 			break;
 
@@ -678,12 +1078,23 @@ u_link *u_link_from_json(mowgli_json_t *jl)
 			abort();
 	}
 
+	/* the timer was set from scratch in link_create, so the next
+	   ping goes out a full timeout from now */
+	link->flags &= ~U_LINK_SENT_PING;
+
+	/* pick up any complete lines that were waiting at upgrade */
+	if (link->ibuf != NULL)
+		u_conn_schedule(link->conn);
+
 	return link;
 
 error:
 	if (link) {
+		u_timer_del(&link->timer);
+		if (link->ibuf != NULL)
+			ibuf_put(link->ibuf, link->ibufsize);
 		free(link->pass);
-		free(link);
+		u_slab_free(&link_slab, link);
 	}
 	return NULL;
 }
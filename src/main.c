@@ -59,11 +59,10 @@ int init(void)
 	INIT(init_chan);
 	INIT(init_sendto);
 	INIT(init_link);
+	INIT(init_verify);
 
 	u_module_load_directory("modules/core");
 
-	/* LINK TODO: add ping timer */
-
 	if (opt_port != 0 && u_link_origin_create(base_ev, opt_port) < 0)
 		return -1;
 
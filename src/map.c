@@ -1,451 +1,343 @@
-/* Tethys, map.c -- AA tree
+/* Tethys, map.c -- small arrays and hash tables
    Copyright (C) 2013 Alex Iadicicco
 
    This file is protected under the terms contained
    in the COPYING file in the project root */
 
-/* Most of this implementation was taken from Wikipedia's page on AA trees */
-
 #include "ircd.h"
 
-#define LEFT 0
-#define RIGHT 1
+/* The index only exists for big maps. Each slot is empty, deleted, or
+   an ents index plus one, and lookups probe linearly from the slot picked
+   by the hash. nindex is always twice maxents, and each deletion leaves
+   a hole in ents as well as a deleted slot, so the index can never be
+   more than half full. Holes are only squeezed out when an insertion
+   finds ents full, which is what makes deleting during iteration safe. */
 
-struct u_map_n {
-	void *key, *data;
-	int level;
-	u_map_n *child[2];
-	/* .n is used by some iterators for keeping nodes in things like
-	   stacks or queues. it is for this reason that map iterations cannot
-	   be nested */
-	mowgli_node_t n;
-};
+#define SLOT_EMPTY   0
+#define SLOT_DELETED ((uint) -1)
 
-static void n_key(u_map *map, u_map_n *n, void *k)
+static uint key_hash(u_map *map, void *k)
 {
-	if (map->flags & MAP_STRING_KEYS) {
-		if (n->key != NULL)
-			free(n->key);
-
-		if (k != NULL) {
-			n->key = strdup(k); /* ;_; */
-			return;
-		}
-	}
+	uint hash;
+	uchar *s;
 
-	n->key = k;
-}
+	if (!(map->flags & MAP_STRING_KEYS))
+		return ((uintptr_t) k >> 4) * 0x9e3779b97f4a7c15ull >> 32;
 
-static int n_cmp(u_map *map, void *k1, void *k2)
-{
-	if (map->flags & MAP_STRING_KEYS)
-		return strcmp((char*)k1, (char*)k2);
+	hash = 2166136261u;
+	for (s = k; *s; s++)
+		hash = (hash ^ *s) * 16777619u;
+	hash ^= hash >> 15;
+	hash *= 0x2c1b3c6d;
+	hash ^= hash >> 12;
 
-	return (long)k1 - (long)k2;
+	return hash;
 }
 
-static void *n_clone(u_map *map, void *k)
+/* small maps with pointer keys are just scanned, and don't need the
+   hash until they grow */
+static uint find_hash(u_map *map, void *k)
 {
-	if (map->flags & MAP_STRING_KEYS)
-		return strdup(k);
-
-	return k;
+	if (map->index == NULL && !(map->flags & MAP_STRING_KEYS))
+		return 0;
+	return key_hash(map, k);
 }
 
-static void n_free(u_map *map, void *k)
+static bool key_eq(u_map *map, u_map_ent *e, void *k, uint hash)
 {
-	if (map->flags & MAP_STRING_KEYS)
-		free(k);
-}
-
-static u_map_n *u_map_n_new(u_map *map, void *key, void *data, int level)
-{
-	u_map_n *n;
-
-	n = malloc(sizeof(*n));
-	n->key = NULL;
-	n_key(map, n, key);
-	n->data = data;
-	n->level = level;
+	if (!(map->flags & MAP_STRING_KEYS))
+		return e->key == k;
 
-	n->child[0] = n->child[1] = NULL;
-
-	return n;
+	return e->hash == hash && e->key != NULL && !strcmp(e->key, k);
 }
 
-static void u_map_n_del(u_map *map, u_map_n *n)
-{
-	if ((map->flags & MAP_STRING_KEYS) && n->key)
-		free(n->key);
-	free(n);
-}
+static u_slab map_slab = U_SLAB_INIT("maps", u_map);
 
 u_map *u_map_new(int string_keys)
 {
 	u_map *map;
 
-	map = malloc(sizeof(*map));
-	if (map == NULL)
-		return NULL;
+	map = u_slab_alloc(&map_slab);
 
-	map->iterdepth = 0;
 	map->flags = string_keys ? MAP_STRING_KEYS : 0;
-	map->root = NULL;
 	map->size = 0;
 
-	return map;
-}
-
-void u_map_free_n(u_map *map, u_map_n *n)
-{
-	if (!n)
-		return;
-
-	u_map_free_n(map, n->child[LEFT]);
-	u_map_free_n(map, n->child[RIGHT]);
+	map->ents = map->small;
+	map->nents = 0;
+	map->maxents = U_MAP_SMALL;
 
-	u_map_n_del(map, n);
-}
-
-void u_map_free(u_map *map)
-{
-	u_map_free_n(map, map->root);
+	map->index = NULL;
+	map->nindex = 0;
+	map->used = 0;
 
-	free(map);
+	return map;
 }
 
-static u_map_n *dumb_fetch(u_map *map, void *key);
-static u_map_n *aa_delete(u_map *map, u_map_n *tree, void *key);
-
-static void clear_pending(u_map *map)
+static void free_keys(u_map *map)
 {
-	mowgli_list_init(&map->pending);
-}
+	uint i;
 
-static void delete_pending(u_map *map)
-{
-	mowgli_node_t *cur, *tn;
+	if (!(map->flags & MAP_STRING_KEYS))
+		return;
 
-	MOWGLI_LIST_FOREACH_SAFE(cur, tn, map->pending.head) {
-		u_log(LG_FINE, "DEL PENDING %p", cur->data);
-		map->root = aa_delete(map, map->root, cur->data);
-		n_free(map, cur->data);
-		mowgli_list_delete(cur, &map->pending);
-	}
+	for (i=0; i<map->nents; i++)
+		free(map->ents[i].key);
 }
 
-static void add_pending(u_map *map, void *key)
+void u_map_free(u_map *map)
 {
-	u_log(LG_FINE, "ADD PENDING %p", key);
-	mowgli_list_add(&map->pending, n_clone(map, key));
-}
+	free_keys(map);
 
-static void u_map_each_n(u_map *map, u_map_n *n, u_map_cb_t *cb, void *priv)
-{
-	if (!n) return;
+	if (map->ents != map->small)
+		free(map->ents);
+	free(map->index);
 
-	u_map_each_n(map, n->child[LEFT], cb, priv);
-	cb(map, n->key, n->data, priv);
-	u_map_each_n(map, n->child[RIGHT], cb, priv);
+	u_slab_free(&map_slab, map);
 }
 
-void u_map_each(u_map *map, u_map_cb_t *cb, void *priv)
+/* returns the index slot holding ents[idx] */
+static uint index_slot(u_map *map, uint hash, uint idx)
 {
-	if (!map->iterdepth)
-		clear_pending(map);
-	map->iterdepth++;
+	uint i, mask = map->nindex - 1;
 
-	u_map_each_n(map, map->root, cb, priv);
+	for (i = hash & mask; map->index[i] != idx + 1; i = (i + 1) & mask)
+		continue;
 
-	map->iterdepth--;
-	if (!map->iterdepth)
-		delete_pending(map);
+	return i;
 }
 
-/* dumb functions are just standard binary search tree operations that
-   don't pay attention to the colors of the nodes */
-
-static u_map_n *dumb_fetch(u_map *map, void *key)
+static int find(u_map *map, void *k, uint hash)
 {
-	u_map_n *n = map->root;
+	uint i, mask;
+	u_map_ent *e;
 
-	while (n != NULL) {
-		if (!n_cmp(map, n->key, key))
-			break;
-		n = n->child[n_cmp(map, n->key, key) < 0];
+	if (map->index == NULL) {
+		for (i=0; i<map->nents; i++) {
+			if (key_eq(map, map->ents + i, k, hash))
+				return i;
+		}
+		return -1;
 	}
 
-	return n;
-}
-
-static u_map_n *skew(u_map_n *n)
-{
-	if (n == NULL)
-		return NULL;
-
-	if (n->child[LEFT] == NULL)
-		return n;
-
-	if (n->child[LEFT]->level == n->level) {
-		u_map_n *m = n->child[LEFT];
-		n->child[LEFT] = m->child[RIGHT];
-		m->child[RIGHT] = n;
-		return m;
+	mask = map->nindex - 1;
+	for (i = hash & mask; map->index[i] != SLOT_EMPTY; i = (i + 1) & mask) {
+		if (map->index[i] == SLOT_DELETED)
+			continue;
+		e = map->ents + map->index[i] - 1;
+		if (key_eq(map, e, k, hash))
+			return map->index[i] - 1;
 	}
 
-	return n;
+	return -1;
 }
 
-static u_map_n *split(u_map_n *n)
+static void reindex(u_map *map)
 {
-	if (n == NULL)
-		return NULL;
+	uint i, j, mask;
 
-	if (n->child[RIGHT] == NULL || n->child[RIGHT]->child[RIGHT] == NULL)
-		return n;
+	free(map->index);
 
-	if (n->level == n->child[RIGHT]->child[RIGHT]->level) {
-		u_map_n *m = n->child[RIGHT];
-		n->child[RIGHT] = m->child[LEFT];
-		m->child[LEFT] = n;
-		m->level++;
-		return m;
+	if (map->ents == map->small) {
+		map->index = NULL;
+		map->nindex = 0;
+		map->used = 0;
+		return;
 	}
 
-	return n;
-}
-
-static u_map_n *next(u_map_n *n, int dir)
-{
-	n = n->child[dir];
-	while (n && n->child[!dir])
-		n = n->child[!dir];
-	return n;
+	map->nindex = map->maxents * 2;
+	map->index = calloc(map->nindex, sizeof(*map->index));
+	map->used = map->nents;
+
+	mask = map->nindex - 1;
+	for (i=0; i<map->nents; i++) {
+		if (!(map->flags & MAP_STRING_KEYS))
+			map->ents[i].hash = key_hash(map, map->ents[i].key);
+		for (j = map->ents[i].hash & mask; map->index[j]; j = (j + 1) & mask)
+			continue;
+		map->index[j] = i + 1;
+	}
 }
 
-static void decrease_level(u_map_n *tree)
+/* called when an insertion finds ents full. squeezes out the holes and
+   picks a size for what's left, moving between the inline array and
+   the heap as needed */
+static void make_room(u_map *map)
 {
-	int should_be;
-	u_map_n *L, *R;
-
-	L = tree->child[LEFT];
-	R = tree->child[RIGHT];
+	u_map_ent *ents;
+	uint i, n, max;
 
-	if (L == NULL) {
-		should_be = R ? R->level : 0;
-	} else if (R == NULL) {
-		should_be = L->level;
-	} else {
-		should_be = L->level < R->level ? L->level : R->level;
+	for (i=0, n=0; i<map->nents; i++) {
+		if (map->ents[i].key != NULL)
+			map->ents[n++] = map->ents[i];
 	}
-	should_be++;
+	map->nents = n;
+
+	if (n < U_MAP_SMALL) {
+		if (map->ents != map->small) {
+			memcpy(map->small, map->ents, n * sizeof(*map->ents));
+			free(map->ents);
+			map->ents = map->small;
+			map->maxents = U_MAP_SMALL;
+		}
+	} else {
+		for (max = 2 * U_MAP_SMALL; max < n * 2; max *= 2)
+			continue;
+
+		if (map->ents == map->small) {
+			ents = malloc(max * sizeof(*ents));
+			memcpy(ents, map->small, n * sizeof(*ents));
+		} else {
+			ents = realloc(map->ents, max * sizeof(*ents));
+		}
 
-	if (should_be < tree->level) {
-		tree->level = should_be;
-		if (R && should_be < R->level)
-			R->level = should_be;
+		map->ents = ents;
+		map->maxents = max;
 	}
-}
 
-static u_map_n *aa_insert(u_map *map, u_map_n *tree, u_map_n *n)
-{
-	int c;
-
-	if (tree == NULL)
-		return n;
-
-	c = n_cmp(map, tree->key, n->key) < 0 ? RIGHT : LEFT;
-	tree->child[c] = aa_insert(map, tree->child[c], n);
-
-	tree = skew(tree);
-	tree = split(tree);
-
-	return tree;
+	reindex(map);
 }
 
-static u_map_n *aa_delete(u_map *map, u_map_n *tree, void *k)
+static void add(u_map *map, void *k, uint hash, void *data)
 {
-	u_map_n *n;
-	int c;
+	uint i, mask;
+	u_map_ent *e;
 
-	if (tree == NULL)
-		return NULL;
+	e = map->ents + map->nents;
+	e->key = (map->flags & MAP_STRING_KEYS) ? strdup(k) : k;
+	e->data = data;
+	e->hash = hash;
 
-	c = n_cmp(map, tree->key, k);
+	map->nents++;
+	map->size++;
 
-	if (c != 0) {
-		c = c < 0 ? RIGHT : LEFT;
-		tree->child[c] = aa_delete(map, tree->child[c], k);
-	} else {
-		if (!tree->child[LEFT] && !tree->child[RIGHT]) {
-			u_map_n_del(map, tree);
-			return NULL;
-		}
+	if (map->index == NULL)
+		return;
 
-		c = !tree->child[LEFT] ? RIGHT : LEFT;
-		n = next(tree, c);
-		n_key(map, tree, n->key);
-		n_key(map, n, k); /* HEHEHE! */
-		tree->data = n->data;
-		tree->child[c] = aa_delete(map, tree->child[c], k);
+	mask = map->nindex - 1;
+	for (i = hash & mask; map->index[i] != SLOT_EMPTY; i = (i + 1) & mask) {
+		if (map->index[i] == SLOT_DELETED)
+			break;
 	}
+	if (map->index[i] == SLOT_EMPTY)
+		map->used++;
+	map->index[i] = map->nents;
+}
 
-	decrease_level(tree);
-
-	tree = skew(tree);
-	tree->child[RIGHT] = skew(tree->child[RIGHT]);
-	if (tree->child[RIGHT] != NULL) {
-		tree->child[RIGHT]->child[RIGHT] =
-		    skew(tree->child[RIGHT]->child[RIGHT]);
-	}
-	tree = split(tree);
-	tree->child[RIGHT] = split(tree->child[RIGHT]);
+void u_map_each(u_map *map, u_map_cb_t *cb, void *priv)
+{
+	u_map_each_state state;
+	void *k, *v;
 
-	return tree;
+	U_MAP_EACH(&state, map, &k, &v)
+		cb(map, k, v, priv);
 }
 
 void *u_map_get(u_map *map, void *key)
 {
-	u_map_n *n = dumb_fetch(map, key);
-	return n == NULL ? NULL : n->data;
+	int i = find(map, key, find_hash(map, key));
+	return i < 0 ? NULL : map->ents[i].data;
 }
 
 void u_map_set(u_map *map, void *key, void *data)
 {
-	u_map_n *n = dumb_fetch(map, key);
-
-	if (map->iterdepth)
-		abort();
+	uint hash = find_hash(map, key);
+	int i = find(map, key, hash);
 
-	if (n != NULL) {
-		n->data = data;
+	if (i >= 0) {
+		map->ents[i].data = data;
 		return;
 	}
 
-	map->size++;
-
-	n = u_map_n_new(map, key, data, 1);
-	map->root = aa_insert(map, map->root, n);
+	/* make_room may build the index, so the hash is looked at again */
+	if (map->nents == map->maxents)
+		make_room(map);
+	add(map, key, find_hash(map, key), data);
 }
 
 void *u_map_del(u_map *map, void *key)
 {
-	u_map_n *n = dumb_fetch(map, key);
+	uint hash = find_hash(map, key);
+	int i = find(map, key, hash);
+	u_map_ent *e;
 	void *data;
 
-	if (n == NULL)
+	if (i < 0)
 		return NULL;
 
-	if (map->flags & MAP_STRING_KEYS)
-		u_log(LG_FINE, "MAP: %p DEL %s", map, n->key);
-	else
-		u_log(LG_FINE, "MAP: %p DEL %p", map, n->key);
-
-	/* we decrement size here, even if the deletion doesn't actually
-	   happen, since we consider the node to have been deleted when
-	   u_map_del is called. */
-	map->size--;
-
-	data = n->data;
-	n->data = NULL;
+	e = map->ents + i;
 
-	if (map->iterdepth) {
-		add_pending(map, key);
+	if (map->flags & MAP_STRING_KEYS) {
+		u_log(LG_FINE, "MAP: %p DEL %s", map, e->key);
+		free(e->key);
 	} else {
-		map->root = aa_delete(map, map->root, key);
+		u_log(LG_FINE, "MAP: %p DEL %p", map, e->key);
 	}
 
-	return data;
-}
+	if (map->index != NULL)
+		map->index[index_slot(map, hash, i)] = SLOT_DELETED;
 
-static void indent(int depth)
-{
-	while (depth-->0)
-		fprintf(stderr, "  ");
-}
-
-static void map_dump_real(u_map *map, u_map_n *n, int depth)
-{
-	if (n == NULL) {
-		fprintf(stderr, "*");
-		return;
-	}
+	data = e->data;
+	e->key = NULL;
+	e->data = NULL;
+	map->size--;
 
-	if (map->flags & MAP_STRING_KEYS) {
-		fprintf(stderr, "%s=%p (%d)\e[0m[", (char*)n->key,
-		        n->data, n->level);
-	} else {
-		fprintf(stderr, "%p=%p (%d)\e[0m[", n->key, n->data, n->level);
+	/* an empty map can start over. any running iterators are already
+	   past the end */
+	if (map->size == 0) {
+		map->nents = 0;
+		if (map->index != NULL) {
+			memset(map->index, 0, map->nindex * sizeof(*map->index));
+			map->used = 0;
+		}
 	}
 
-	if (n->child[LEFT] == NULL && n->child[RIGHT] == NULL) {
-		fprintf(stderr, "]");
-		return;
-	}
-	fprintf(stderr, "\n");
-	indent(depth);
-	map_dump_real(map, n->child[LEFT], depth + 1);
-	fprintf(stderr, ",\n");
-	indent(depth);
-	map_dump_real(map, n->child[RIGHT], depth + 1);
-	fprintf(stderr, "]");
+	return data;
 }
 
 void u_map_dump(u_map *map)
 {
-	map_dump_real(map, map->root, 1);
-	fprintf(stderr, "\n");
-}
-
-static void try_queue(u_map_each_state *state, u_map_n *n)
-{
-	if (n == NULL)
-		return;
-
-	mowgli_node_add(n, &n->n, &state->list);
-}
-
-static u_map_n *try_dequeue(u_map_each_state *state)
-{
-	u_map_n *n;
-
-	if (state->list.head == NULL)
-		return NULL;
-
-	n = state->list.head->data;
-	mowgli_node_delete(&n->n, &state->list);
-
-	return n;
+	u_map_ent *e;
+	uint i;
+
+	fprintf(stderr, "%s map, %u/%u entries, %u/%u index slots\n",
+	        map->index ? "big" : "small", map->size, map->nents,
+	        map->used, map->nindex);
+
+	for (i=0; i<map->nents; i++) {
+		e = map->ents + i;
+
+		if (e->key == NULL)
+			fprintf(stderr, "  %u: *\n", i);
+		else if (map->flags & MAP_STRING_KEYS)
+			fprintf(stderr, "  %u: %s=%p\n", i, (char*)e->key, e->data);
+		else
+			fprintf(stderr, "  %u: %p=%p\n", i, e->key, e->data);
+	}
 }
 
 void u_map_each_start(u_map_each_state *state, u_map *map)
 {
 	state->map = map;
-	mowgli_list_init(&state->list);
-
-	if (!map->iterdepth)
-		clear_pending(map);
-	map->iterdepth++;
-
-	try_queue(state, map->root);
+	state->pos = 0;
 }
 
 bool u_map_each_next(u_map_each_state *state, void **k, void **v)
 {
-	u_map_n *n;
-
-	if ((n = try_dequeue(state)) == NULL) {
-		state->map->iterdepth--;
-		if (!state->map->iterdepth)
-			delete_pending(state->map);
-		return false;
+	u_map *map = state->map;
+	u_map_ent *e;
+
+	for (; state->pos < map->nents; state->pos++) {
+		e = map->ents + state->pos;
+		if (e->key == NULL)
+			continue;
+
+		state->pos++;
+		if (k) *k = e->key;
+		if (v) *v = e->data;
+		return true;
 	}
 
-	if (k) *k = n->key;
-	if (v) *v = n->data;
-
-	try_queue(state, n->child[0]);
-	try_queue(state, n->child[1]);
-
-	return true;
+	return false;
 }
+
+/* vim: set noet: */
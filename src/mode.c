@@ -155,6 +155,7 @@ static int do_mode_list(u_modes *m, int on, char *param)
 					m->stacker->put_listent(m, 0, ban);
 				mowgli_node_delete(&ban->n, list);
 				free(ban);
+				m->flags |= MODE_LIST_CHANGE;
 			}
 			return 1;
 		}
@@ -178,6 +179,7 @@ static int do_mode_list(u_modes *m, int on, char *param)
 		if (m->stacker && m->stacker->put_listent)
 			m->stacker->put_listent(m, 1, ban);
 		mowgli_node_add(ban, &ban->n, list);
+		m->flags |= MODE_LIST_CHANGE;
 	}
 
 	return 1;
@@ -97,6 +97,149 @@ void u_src_f(u_sourceinfo *si, const char *fmt, ...)
 
 mowgli_patricia_t *all_commands;
 
+/* command ids */
+/* ----------- */
+
+/* Every command name that has ever been registered gets a small integer
+   id, which it keeps even if all of its handlers go away. Names are
+   found through an open addressing hash table, and the handlers for
+   each id are laid out in a flat table with one slot per source type,
+   so finding the handler for a line is a hash probe and an index. The
+   table is rebuilt from all_commands the first time it's needed after
+   anything is registered or unregistered. */
+
+#define CMD_ID_NONE -1
+
+/* one per bit from SRC_LOCAL_OPER to SRC_FIRST */
+#define SRC_NUM_CLASSES 11
+
+struct cmd_id {
+	char name[MAXCOMMANDLEN+1];
+	ulong mask; /* all of the source bits with a handler */
+};
+
+static struct cmd_id *cmd_ids = NULL;
+static int cmd_ids_n = 0, cmd_ids_max = 0;
+
+static int *cmd_hash = NULL; /* ids, or CMD_ID_NONE */
+static uint cmd_hash_size = 0;
+
+static u_cmd **dispatch = NULL; /* [id * SRC_NUM_CLASSES + class] */
+static bool dispatch_stale = true;
+
+static int id_numeric;
+static int id_encap;
+
+static uint hash_name(const char *s)
+{
+	uint h = 2166136261u;
+
+	while (*s)
+		h = (h ^ (uchar)*s++) * 16777619u;
+
+	return h;
+}
+
+static int cmd_id_find(const char *name)
+{
+	uint i, mask = cmd_hash_size - 1;
+	int id;
+
+	if (cmd_hash_size == 0)
+		return CMD_ID_NONE;
+
+	for (i = hash_name(name) & mask; ; i = (i + 1) & mask) {
+		id = cmd_hash[i];
+		if (id == CMD_ID_NONE || streq(cmd_ids[id].name, name))
+			return id;
+	}
+}
+
+static void cmd_hash_insert(int id)
+{
+	uint i, mask = cmd_hash_size - 1;
+
+	i = hash_name(cmd_ids[id].name) & mask;
+	while (cmd_hash[i] != CMD_ID_NONE)
+		i = (i + 1) & mask;
+	cmd_hash[i] = id;
+}
+
+static int cmd_id_intern(const char *name)
+{
+	uint i;
+	int id;
+
+	if ((id = cmd_id_find(name)) != CMD_ID_NONE)
+		return id;
+
+	if (cmd_ids_n == cmd_ids_max) {
+		cmd_ids_max = cmd_ids_max ? cmd_ids_max * 2 : 128;
+		cmd_ids = realloc(cmd_ids, cmd_ids_max * sizeof(*cmd_ids));
+	}
+
+	id = cmd_ids_n++;
+	u_strlcpy(cmd_ids[id].name, name, MAXCOMMANDLEN+1);
+	cmd_ids[id].mask = 0;
+
+	/* keep the table at most half full */
+	if (cmd_ids_n * 2 > cmd_hash_size) {
+		cmd_hash_size = cmd_hash_size ? cmd_hash_size * 2 : 256;
+		cmd_hash = realloc(cmd_hash, cmd_hash_size * sizeof(*cmd_hash));
+		for (i=0; i<cmd_hash_size; i++)
+			cmd_hash[i] = CMD_ID_NONE;
+		for (i=0; i<cmd_ids_n; i++)
+			cmd_hash_insert(i);
+	} else {
+		cmd_hash_insert(id);
+	}
+
+	dispatch_stale = true;
+
+	return id;
+}
+
+static void build_dispatch(void)
+{
+	mowgli_patricia_iteration_state_t state;
+	u_cmd *cmd;
+	int i;
+
+	dispatch = realloc(dispatch, cmd_ids_n * SRC_NUM_CLASSES
+	                             * sizeof(*dispatch));
+	memset(dispatch, 0, cmd_ids_n * SRC_NUM_CLASSES * sizeof(*dispatch));
+	for (i=0; i<cmd_ids_n; i++)
+		cmd_ids[i].mask = 0;
+
+	MOWGLI_PATRICIA_FOREACH(cmd, &state, all_commands) {
+		for (; cmd; cmd = cmd->next) {
+			cmd_ids[cmd->id].mask |= cmd->mask;
+			for (i=0; i<SRC_NUM_CLASSES; i++) {
+				if (cmd->mask & (1ul << i))
+					dispatch[cmd->id * SRC_NUM_CLASSES + i] = cmd;
+			}
+		}
+	}
+
+	dispatch_stale = false;
+}
+
+/* numerics all map to ###, so "###" itself isn't allowed in */
+static int command_id(const char *command)
+{
+	if (isdigit(command[0]) && isdigit(command[1])
+	    && isdigit(command[2]) && !command[3])
+		return id_numeric;
+
+	if (streq(command, "###"))
+		return CMD_ID_NONE;
+
+	return cmd_id_find(command);
+}
+
+/* command registration */
+/* -------------------- */
+
 static int reg_one(u_cmd *cmd)
 {
 	u_cmd *at, *cur;
@@ -120,6 +263,7 @@ static int reg_one(u_cmd *cmd)
 	cmd->loaded = true;
 
 	cmd->owner = u_module_loading();
+	cmd->id = cmd_id_intern(cmd->name);
 
 	cmd->runs = 0;
 	cmd->usecs = 0;
@@ -132,6 +276,8 @@ static int reg_one(u_cmd *cmd)
 	}
 	mowgli_patricia_add(all_commands, cmd->name, cmd);
 
+	dispatch_stale = true;
+
 	return 0;
 }
 
@@ -162,6 +308,8 @@ void u_cmd_unreg(u_cmd *cmd)
 		if (cmd->next != NULL)
 			mowgli_patricia_add(all_commands, cmd->name, cmd->next);
 	}
+
+	dispatch_stale = true;
 }
 
 static void *on_module_unload(void *unused, void *m)
@@ -206,6 +354,10 @@ static void fill_source_user(u_sourceinfo *si, u_user *u)
 	}
 }
 
+/* bumped whenever a user or server goes away, which invalidates the
+   last-source caches on server links */
+uint u_src_epoch = 0;
+
 static bool fill_source_by_id(u_sourceinfo *si, u_link *link, char *src)
 {
 	int n;
@@ -213,7 +365,17 @@ static bool fill_source_by_id(u_sourceinfo *si, u_link *link, char *src)
 	if (!isdigit(*src))
 		return false;
 
-	n = strlen(src);
+	/* servers tend to send runs of lines from the same source */
+	if (link->src_ptr && link->src_epoch == u_src_epoch
+	    && streq(link->src_id, src)) {
+		if (src[3])
+			fill_source_user(si, link->src_ptr);
+		else
+			fill_source_server(si, link->src_ptr);
+		return true;
+	}
+
+	n = strnlen(src, 10);
 
 	switch (n) {
 	case 3:
@@ -221,6 +383,7 @@ static bool fill_source_by_id(u_sourceinfo *si, u_link *link, char *src)
 		if (si->s == NULL)
 			return false;
 		fill_source_server(si, si->s);
+		link->src_ptr = si->s;
 		break;
 
 	case 9:
@@ -228,6 +391,7 @@ static bool fill_source_by_id(u_sourceinfo *si, u_link *link, char *src)
 		if (si->u == NULL)
 			return false;
 		fill_source_user(si, si->u);
+		link->src_ptr = si->u;
 		break;
 
 	default:
@@ -235,6 +399,9 @@ static bool fill_source_by_id(u_sourceinfo *si, u_link *link, char *src)
 		return false;
 	}
 
+	memcpy(link->src_id, src, n + 1);
+	link->src_epoch = u_src_epoch;
+
 	return true;
 }
 
@@ -373,20 +540,33 @@ static void fill_source(u_sourceinfo *si, u_link *link, u_msg *msg)
 	}
 }
 
-static u_cmd *find_command(const char *command, ulong mask, ulong *bits_tested)
+static u_cmd *find_command(int id, ulong mask, ulong *bits_tested)
 {
 	u_cmd *cmd;
+	int cls;
 
 	*bits_tested = 0;
 
-	/* map numerics to ### */
-	if (!strcmp(command, "###"))
+	if (id == CMD_ID_NONE)
 		return NULL;
-	if (isdigit(command[0]) && isdigit(command[1])
-	    && isdigit(command[2]) && !command[3])
-		command = "###";
 
-	cmd = mowgli_patricia_retrieve(all_commands, command);
+	if (dispatch_stale)
+		build_dispatch();
+
+	/* fill_source narrows the mask down to a single bit, except when
+	   it couldn't make sense of the source at all. those take the long
+	   way round */
+	if (mask != 0 && (mask & (mask - 1)) == 0) {
+		cls = __builtin_ctzl(mask);
+		if (cls < SRC_NUM_CLASSES) {
+			cmd = dispatch[id * SRC_NUM_CLASSES + cls];
+			if (cmd == NULL)
+				*bits_tested = cmd_ids[id].mask;
+			return cmd;
+		}
+	}
+
+	cmd = mowgli_patricia_retrieve(all_commands, cmd_ids[id].name);
 
 	for (; cmd; cmd = cmd->next) {
 		*bits_tested |= cmd->mask;
@@ -519,7 +699,8 @@ static bool invoke_encap(u_sourceinfo *si, u_msg *msg, char *line)
 
 	bits = si->u ? SRC_ENCAP_USER : SRC_ENCAP_SERVER;
 
-	if ((cmd = find_command(subcmd, bits, &bits_tested))) {
+	cmd = find_command(cmd_id_find(subcmd), bits, &bits_tested);
+	if (cmd != NULL) {
 		u_log(LG_FINE, "%I INVOKE ENCAP %s [%p]", si, subcmd);
 		run_command(cmd, si, msg);
 	} else {
@@ -543,19 +724,21 @@ void u_cmd_invoke(u_link *link, u_msg *msg, char *line)
 	u_cmd *cmd, *last_cmd;
 	u_sourceinfo si;
 	ulong bits_tested;
+	int id;
 
 	last_cmd = NULL;
+	id = command_id(msg->command);
 
 again:
 	fill_source(&si, link, msg);
 	u_log(LG_FINE, "source mask = 0x%x", si.mask);
 
-	if (link->type == LINK_SERVER && streq(msg->command, "ENCAP")) {
+	if (link->type == LINK_SERVER && id == id_encap) {
 		invoke_encap(&si, msg, line);
 		return;
 	}
 
-	if (!(cmd = find_command(msg->command, si.mask, &bits_tested))) {
+	if (!(cmd = find_command(id, si.mask, &bits_tested))) {
 		report_failure(&si, msg, bits_tested);
 		return;
 	}
@@ -612,5 +795,8 @@ int init_cmd(void)
 	if ((all_commands = mowgli_patricia_create(NULL)) == NULL)
 		return -1;
 
+	id_numeric = cmd_id_intern("###");
+	id_encap = cmd_id_intern("ENCAP");
+
 	return 0;
 }
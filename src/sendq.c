@@ -9,57 +9,219 @@
 /* chunks */
 /* ------ */
 
-#define SENDQ_CHUNK_SIZE 4000
+#define SENDQ_CHUNK_SIZE 4000 /* decode block when restoring from json */
 #define SENDQ_B64_CHUNK_SIZE 5328 /* corresponds to just under 4000 bytes */
 
 #define CHUNK_IN_USE 0x0001
+#define CHUNK_SHARED 0x0002
 
+/* A chunk either owns its buffer, in which case data points at buf, or
+   refers to a shared line, in which case data points into line->data
+   and buf is not allocated at all. */
 struct u_sendq_chunk {
-	uchar data[SENDQ_CHUNK_SIZE];
+	uchar *data;
 	ulong flags;
+	int cls, size;
 	int start, end;
+	u_sendq_line *line;
 	u_sendq_chunk *next;
+	uchar buf[];
 };
 
-#define SENDQ_CHUNK_BACKLOG_MAX 400
+/* Owned chunks come in a few sizes. A new chunk is sized to the queue's
+   current backlog, so an idle client's PING reply sits in a small chunk
+   while a client that's falling behind moves on to bigger ones. Shared
+   chunks are just the header, and get their own class. Each class keeps
+   a free list of up to backlog_max chunks. Formatted lines reserve 512
+   bytes before they know their length, so nothing smaller than 1k would
+   ever get filled. */
+struct chunk_class {
+	int size;
+	int backlog_max;
+
+	u_sendq_chunk *free;
+	int nfree;
+
+	ulong live, hits, misses;
+};
+
+static struct chunk_class classes[SENDQ_NUM_CLASSES] = {
+	{ 1 << 10,    2000 },
+	{ 4 << 10,     400 },
+	{ 16 << 10,     64 },
+	{ 64 << 10,     16 },
+	{ 0,          4000 }, /* shared */
+};
+
+#define CLASS_SHARED   (SENDQ_NUM_CLASSES - 1)
+#define CLASS_LARGEST  (SENDQ_NUM_CLASSES - 2)
+
+static size_t queued = 0;
+static size_t mem = 0;
+static size_t budget = 0;
+static ulong denied = 0;
+
+/* shared lines are counted once, by u_sendq_line_new, however many
+   queues they're in. a shared chunk only costs its header */
+static size_t chunk_mem(u_sendq_chunk *chunk)
+{
+	return sizeof(*chunk) + chunk->size;
+}
+
+static int pick_class(u_sendq *q, size_t sz)
+{
+	size_t want = sz > q->size ? sz : q->size;
+	int i;
 
-static u_sendq_chunk *free_chunks = NULL;
-static int num_free_chunks = 0;
+	for (i=0; i<CLASS_LARGEST; i++) {
+		if (classes[i].size >= want)
+			break;
+	}
+
+	return i;
+}
 
-static u_sendq_chunk *chunk_new(void)
+static u_sendq_chunk *chunk_alloc(u_sendq *q, int cls)
 {
+	struct chunk_class *cc = classes + cls;
 	u_sendq_chunk *chunk;
+	size_t sz = sizeof(*chunk) + cc->size;
 
-	if (num_free_chunks) {
-		num_free_chunks--;
-		chunk = free_chunks;
-		free_chunks = chunk->next;
+	if (budget > 0 && !q->exempt && mem + sz > budget) {
+		denied++;
+		return NULL;
+	}
+
+	if (cc->nfree) {
+		cc->hits++;
+		cc->nfree--;
+		chunk = cc->free;
+		cc->free = chunk->next;
 	} else {
+		cc->misses++;
 		u_log(LG_DEBUG, "sendq chunk: malloc()");
-		chunk = malloc(sizeof(*chunk));
+		chunk = malloc(sz);
 	}
 
-	chunk->flags = CHUNK_IN_USE;
+	cc->live++;
+	mem += sz;
+
+	chunk->cls = cls;
+	chunk->size = cc->size;
+	chunk->line = NULL;
 	chunk->next = NULL;
 	chunk->start = chunk->end = 0;
 	return chunk;
 }
 
+static u_sendq_chunk *chunk_new(u_sendq *q, int cls)
+{
+	u_sendq_chunk *chunk;
+
+	if (!(chunk = chunk_alloc(q, cls)))
+		return NULL;
+
+	chunk->data = chunk->buf;
+	chunk->flags = CHUNK_IN_USE;
+	return chunk;
+}
+
+static u_sendq_chunk *chunk_new_shared(u_sendq *q, u_sendq_line *line)
+{
+	u_sendq_chunk *chunk;
+
+	if (!(chunk = chunk_alloc(q, CLASS_SHARED)))
+		return NULL;
+
+	chunk->data = line->data;
+	chunk->flags = CHUNK_IN_USE | CHUNK_SHARED;
+	chunk->line = u_sendq_line_ref(line);
+	chunk->end = line->len;
+	return chunk;
+}
+
 static void chunk_free(u_sendq_chunk *chunk)
 {
+	struct chunk_class *cc = classes + chunk->cls;
+
 	if (!(chunk->flags & CHUNK_IN_USE)) /* prevent multiple free */
 		return;
 
-	if (num_free_chunks >= SENDQ_CHUNK_BACKLOG_MAX) {
+	cc->live--;
+	mem -= chunk_mem(chunk);
+
+	if (chunk->flags & CHUNK_SHARED) {
+		u_sendq_line_unref(chunk->line);
+		chunk->line = NULL;
+	}
+
+	if (cc->nfree >= cc->backlog_max) {
 		u_log(LG_DEBUG, "sendq chunk: free()");
 		free(chunk);
 		return;
 	}
 
 	chunk->flags &= ~CHUNK_IN_USE;
-	chunk->next = free_chunks;
-	free_chunks = chunk;
-	num_free_chunks ++;
+	chunk->next = cc->free;
+	cc->free = chunk;
+	cc->nfree++;
+}
+
+void u_sendq_set_budget(size_t sz)
+{
+	budget = sz;
+}
+
+void u_sendq_get_stats(u_sendq_stats *st)
+{
+	int i;
+
+	st->queued = queued;
+	st->mem = mem;
+	st->budget = budget;
+	st->denied = denied;
+
+	for (i=0; i<SENDQ_NUM_CLASSES; i++) {
+		st->cls[i].size = classes[i].size;
+		st->cls[i].live = classes[i].live;
+		st->cls[i].free = classes[i].nfree;
+		st->cls[i].hits = classes[i].hits;
+		st->cls[i].misses = classes[i].misses;
+	}
+}
+
+/* shared lines */
+/* ------------ */
+
+u_sendq_line *u_sendq_line_new(size_t sz)
+{
+	u_sendq_line *line;
+
+	line = malloc(sizeof(*line) + sz);
+	line->refs = 1;
+	line->len = 0;
+	line->size = sz;
+
+	mem += sizeof(*line) + sz;
+
+	return line;
+}
+
+u_sendq_line *u_sendq_line_ref(u_sendq_line *line)
+{
+	line->refs++;
+	return line;
+}
+
+void u_sendq_line_unref(u_sendq_line *line)
+{
+	if (line == NULL)
+		return;
+
+	if (--line->refs == 0) {
+		mem -= sizeof(*line) + line->size;
+		free(line);
+	}
 }
 
 /* create, destroy */
@@ -73,24 +235,24 @@ void u_sendq_init(u_sendq *q)
 void u_sendq_clear(u_sendq *q)
 {
 	u_sendq_chunk *ch, *nch;
+	bool exempt = q->exempt;
 
 	for (ch = q->head; ch; ch = nch) {
 		nch = ch->next;
 		chunk_free(ch);
 	}
 
+	queued -= q->size;
+
 	memset(q, 0, sizeof(*q));
+	q->exempt = exempt;
 }
 
 /* buffer interaction */
 /* ------------------ */
 
-static u_sendq_chunk *sendq_append_chunk(u_sendq *q)
+static void sendq_link_chunk(u_sendq *q, u_sendq_chunk *chunk)
 {
-	u_sendq_chunk *chunk;
-
-	chunk = chunk_new();
-
 	if (q->tail != NULL)
 		q->tail->next = chunk;
 
@@ -98,6 +260,16 @@ static u_sendq_chunk *sendq_append_chunk(u_sendq *q)
 		q->head = chunk;
 
 	q->tail = chunk;
+}
+
+static u_sendq_chunk *sendq_append_chunk(u_sendq *q, size_t sz)
+{
+	u_sendq_chunk *chunk;
+
+	if (!(chunk = chunk_new(q, pick_class(q, sz))))
+		return NULL;
+
+	sendq_link_chunk(q, chunk);
 
 	return chunk;
 }
@@ -119,15 +291,19 @@ uchar *u_sendq_get_buffer(u_sendq *q, size_t sz)
 {
 	u_sendq_chunk *chunk;
 
-	if (sz > SENDQ_CHUNK_SIZE) {
+	if (sz > classes[CLASS_LARGEST].size) {
 		/* TODO: this is not exactly robust */
 		return NULL;
 	}
 
 	chunk = q->tail;
 
-	if (!chunk || sz > (SENDQ_CHUNK_SIZE - chunk->end))
-		chunk = sendq_append_chunk(q);
+	if (!chunk || (chunk->flags & CHUNK_SHARED) ||
+	    sz > (chunk->size - chunk->end)) {
+		/* NULL here means we're over budget */
+		if (!(chunk = sendq_append_chunk(q, sz)))
+			return NULL;
+	}
 
 	return chunk->data + chunk->end;
 }
@@ -136,23 +312,95 @@ size_t u_sendq_end_buffer(u_sendq *q, size_t sz)
 {
 	u_sendq_chunk *chunk = q->tail;
 
-	if (!chunk) {
+	if (!chunk || (chunk->flags & CHUNK_SHARED)) {
 		u_log(LG_WARN, "sendq: potential heap corruption!");
 		return 0;
 	}
 
-	if (chunk->end + sz > SENDQ_CHUNK_SIZE) {
+	if (chunk->end + sz > chunk->size) {
 		u_log(LG_WARN, "sendq: potential heap corruption!");
-		sz = SENDQ_CHUNK_SIZE - chunk->end;
+		sz = chunk->size - chunk->end;
 	}
 
 	chunk->end += sz;
 	q->size += sz;
+	queued += sz;
 
 	return sz;
 }
 
-#define NUM_IOVECS 32
+size_t u_sendq_put(u_sendq *q, const uchar *data, size_t sz)
+{
+	u_sendq_chunk *chunk = q->tail;
+	size_t n, done = 0;
+
+	while (done < sz) {
+		if (!chunk || (chunk->flags & CHUNK_SHARED) ||
+		    chunk->end == chunk->size) {
+			if (!(chunk = sendq_append_chunk(q, sz - done)))
+				break;
+		}
+
+		n = chunk->size - chunk->end;
+		if (n > sz - done)
+			n = sz - done;
+
+		memcpy(chunk->data + chunk->end, data + done, n);
+		chunk->end += n;
+		done += n;
+	}
+
+	q->size += done;
+	queued += done;
+
+	return done;
+}
+
+size_t u_sendq_putv(u_sendq *q, const struct iovec *iov, int iovcnt)
+{
+	size_t n, done = 0;
+	int i;
+
+	for (i=0; i<iovcnt; i++) {
+		n = u_sendq_put(q, iov[i].iov_base, iov[i].iov_len);
+		done += n;
+		if (n < iov[i].iov_len)
+			break;
+	}
+
+	return done;
+}
+
+size_t u_sendq_put_line(u_sendq *q, u_sendq_line *line)
+{
+	u_sendq_chunk *chunk;
+
+	if (line->len == 0 || !(chunk = chunk_new_shared(q, line)))
+		return 0;
+
+	sendq_link_chunk(q, chunk);
+	q->size += line->len;
+	queued += line->len;
+
+	return line->len;
+}
+
+void u_sendq_move(u_sendq *q, u_sendq *from)
+{
+	if (from->head == NULL)
+		return;
+
+	sendq_link_chunk(q, from->head);
+	q->tail = from->tail;
+	q->size += from->size;
+
+	from->head = from->tail = NULL;
+	from->size = 0;
+}
+
+/* shared chunks usually hold a single line, so allow for a lot more of
+   them in a single writev() than we used to */
+#define NUM_IOVECS 128
 
 int u_sendq_write(u_sendq *q, int fd)
 {
@@ -169,12 +417,26 @@ int u_sendq_write(u_sendq *q, int fd)
 		      iov[iovcnt].iov_base, iov[iovcnt].iov_len);
 	}
 
+#ifdef MSG_MORE
+	if (ch != NULL) {
+		/* more is queued than fits in one call. tell the kernel so
+		   it holds the tail of this batch for the next one instead
+		   of sending a short packet */
+		struct msghdr msg;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+		sz = sendmsg(fd, &msg, MSG_MORE);
+	} else
+#endif
 	sz = writev(fd, iov, iovcnt);
 
 	if (sz < 0)
 		return sz;
 
 	q->size -= sz;
+	queued -= sz;
 
 	while ((ch = q->head) != NULL) {
 		int chsz = ch->end - ch->start;
@@ -232,7 +494,7 @@ int u_sendq_from_json(mowgli_json_t *jsq, u_sendq *sq)
 	mowgli_string_t *jsbuf;
 	size_t len;
 	char *cur, *end, *echunk;
-	void *sqbuf;
+	uchar sqbuf[SENDQ_CHUNK_SIZE];
 
 	jsbuf = json_ogets(jsq, "buf");
 	if (!jsbuf || jsbuf->pos % 4)
@@ -253,9 +515,9 @@ int u_sendq_from_json(mowgli_json_t *jsq, u_sendq *sq)
 		if (echunk > end)
 			echunk = end;
 
-		sqbuf = u_sendq_get_buffer(sq, SENDQ_CHUNK_SIZE);
 		len = base64_decode(cur, echunk-cur, sqbuf);
-		u_sendq_end_buffer(sq, len);
+		if (u_sendq_put(sq, sqbuf, len) < len)
+			return -1;
 
 		cur = echunk;
 	}
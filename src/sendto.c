@@ -8,14 +8,24 @@
 
 static u_cookie ck_sendto;
 
-static char *ln_user, buf_user[1024];
-static char *ln_serv, buf_serv[1024];
+/* Each message is rendered at most once per format type. The rendered
+   line is then shared between the send queues of every recipient, so
+   a fanout costs one vsnf and one reference per link. */
+static char buf_user[512];
+static char buf_serv[512];
+static u_sendq_line *ln_user, *ln_serv;
+
+static void ln_release(void)
+{
+	u_sendq_line_unref(ln_user);
+	u_sendq_line_unref(ln_serv);
+	ln_user = ln_serv = NULL;
+}
 
 void u_sendto_start(void)
 {
 	u_cookie_inc(&ck_sendto);
-	ln_user = NULL;
-	ln_serv = NULL;
+	ln_release();
 }
 
 void u_sendto_skip(u_link *link)
@@ -27,54 +37,102 @@ void u_sendto_skip(u_link *link)
 		u_cookie_cpy(&link->ck_sendto, &ck_sendto);
 }
 
-static int want_send(uint type, u_link *link)
+/* channels keep their local and remote links in separate maps, so the
+   type filter picks which of the two get walked. step 0 has not started
+   on the channel yet, steps 1 and 2 are walking one of the maps, and
+   step 3 means the channel is exhausted */
+static u_map *chan_links(u_sendto_state *state)
 {
-	switch (type) {
-	case ST_ALL:
-		return 1;
-
-	case ST_USERS:
-	case ST_SERVERS:
-		switch (link->type) {
-		case LINK_NONE:
-		case LINK_USER:
-			return type == ST_USERS;
-
-		case LINK_SERVER:
-			return type == ST_SERVERS;
-		}
-		return 0;
+	switch (state->step) {
+	case 0:
+		state->step = 1;
+		if (state->type != ST_SERVERS)
+			return state->c->local_links;
+		/* fallthrough */
+	case 1:
+		state->step = 2;
+		if (state->type != ST_USERS)
+			return state->c->remote_links;
+		/* fallthrough */
+	default:
+		state->step = 3;
+		return NULL;
 	}
+}
 
-	return 0;
+static bool chan_links_next(u_sendto_state *state, u_link **link_ret)
+{
+	u_link *link;
+	u_map *map;
+
+	if (state->step == 0)
+		goto next_map;
+
+	for (;;) {
+		while (u_map_each_next(&state->links, (void**)&link, NULL)) {
+			if (!u_cookie_cmp(&link->ck_sendto, &ck_sendto))
+				continue;
+			*link_ret = link;
+			return true;
+		}
+
+	next_map:
+		if ((map = chan_links(state)) == NULL)
+			return false;
+		u_map_each_start(&state->links, map);
+	}
 }
 
-static char *ln(u_link *link, char *fmt, va_list va_orig)
+static u_sendq_line *render(char *buf, int type, char *fmt, va_list va_orig)
 {
+	u_sendq_line *line;
 	va_list va;
+	size_t sz;
+
+	va_copy(va, va_orig);
+	sz = vsnf(type, buf, 511, fmt, va);
+	va_end(va);
+
+	line = u_sendq_line_new(sz + 2);
+	memcpy(line->data, buf, sz);
+	line->data[sz++] = '\r';
+	line->data[sz++] = '\n';
+	line->len = sz;
+
+	return line;
+}
+
+static void ln(u_link *link, char *fmt, va_list va)
+{
+	u_sendq_line *line;
+	char *text;
+
+	if (!u_cookie_cmp(&link->ck_sendto, &ck_sendto))
+		return;
+	u_cookie_cpy(&link->ck_sendto, &ck_sendto);
 
 	switch (link->type) {
 	case LINK_NONE:
 	case LINK_USER:
-		if (ln_user != NULL)
-			return ln_user;
-		ln_user = buf_user;
-		va_copy(va, va_orig);
-		vsnf(FMT_USER, buf_user, 1024, fmt, va);
-		va_end(va);
-		return ln_user;
+		if (ln_user == NULL)
+			ln_user = render(buf_user, FMT_USER, fmt, va);
+		line = ln_user;
+		text = buf_user;
+		break;
 
 	case LINK_SERVER:
-		if (ln_serv != NULL)
-			return ln_serv;
-		ln_serv = buf_serv;
-		va_copy(va, va_orig);
-		vsnf(FMT_SERVER, buf_serv, 1024, fmt, va);
-		va_end(va);
-		return ln_serv;
+		if (ln_serv == NULL)
+			ln_serv = render(buf_serv, FMT_SERVER, fmt, va);
+		line = ln_serv;
+		text = buf_serv;
+		break;
+
+	default:
+		return;
 	}
 
-	return NULL;
+	u_log(LG_DEBUG, "[%G] <- %s", link, text);
+	u_link_put_line(link, line);
 }
 
 void u_sendto(u_link *link, char *fmt, ...)
@@ -96,8 +154,9 @@ void u_sendto_chan(u_chan *c, u_link *exclude, uint type, char *fmt, ...)
 
 	va_start(va, fmt);
 	U_SENDTO_CHAN(&st, c, exclude, type, &link)
-		u_sendto(link, "%s", ln(link, fmt, va));
+		ln(link, fmt, va);
 	va_end(va);
+	ln_release();
 }
 
 void u_sendto_visible(u_user *u, uint type, char *fmt, ...)
@@ -108,8 +167,9 @@ void u_sendto_visible(u_user *u, uint type, char *fmt, ...)
 
 	va_start(va, fmt);
 	U_SENDTO_VISIBLE(&st, u, u->link, type, &link)
-		u_sendto(link, "%s", ln(link, fmt, va));
+		ln(link, fmt, va);
 	va_end(va);
+	ln_release();
 }
 
 void u_sendto_servers(u_link *exclude, char *fmt, ...)
@@ -120,8 +180,9 @@ void u_sendto_servers(u_link *exclude, char *fmt, ...)
 
 	va_start(va, fmt);
 	U_SENDTO_SERVERS(&st, exclude, &link)
-		u_sendto(link, "%s", ln(link, fmt, va));
+		ln(link, fmt, va);
 	va_end(va);
+	ln_release();
 }
 
 void u_sendto_list(mowgli_list_t *list, u_link *exclude, char *fmt, ...)
@@ -136,9 +197,10 @@ void u_sendto_list(mowgli_list_t *list, u_link *exclude, char *fmt, ...)
 	va_start(va, fmt);
 	MOWGLI_LIST_FOREACH(n, list->head) {
 		u_link *link = n->data;
-		u_sendto(link, "%s", ln(link, fmt, va));
+		ln(link, fmt, va);
 	}
 	va_end(va);
+	ln_release();
 }
 
 void u_sendto_map(u_map *map, u_link *exclude, char *fmt, ...)
@@ -153,8 +215,9 @@ void u_sendto_map(u_map *map, u_link *exclude, char *fmt, ...)
 
 	va_start(va, fmt);
 	U_MAP_EACH(&state, map, NULL, &link)
-		u_sendto(link, "%s", ln(link, fmt, va));
+		ln(link, fmt, va);
 	va_end(va);
+	ln_release();
 }
 
 void u_sendto_chan_start(u_sendto_state *state, u_chan *c,
@@ -171,29 +234,16 @@ void u_sendto_chan_start(u_sendto_state *state, u_chan *c,
 		u_sendto_skip(exclude);
 
 	state->type = type;
-
-	u_map_each_start(&state->members, c->members);
+	state->c = c;
+	state->step = 0;
 }
 
 bool u_sendto_chan_next(u_sendto_state *state, u_link **link_ret)
 {
-	u_user *u;
-	u_chanuser *cu;
-
 	if (state->type == ST_STOP)
 		return false;
 
-next_link:
-	if (!u_map_each_next(&state->members, (void**)&u, (void**)&cu))
-		return false;
-
-	if (!want_send(state->type, u->link))
-		goto next_link;
-	if (!u_cookie_cmp(&u->link->ck_sendto, &ck_sendto))
-		goto next_link;
-
-	*link_ret = u->link;
-	return true;
+	return chan_links_next(state, link_ret);
 }
 
 void u_sendto_visible_start(u_sendto_state *state, u_user *u,
@@ -211,39 +261,29 @@ void u_sendto_visible_start(u_sendto_state *state, u_user *u,
 
 	state->type = type;
 
-	u_map_each_start(&state->chans, u->channels);
+	state->u = u;
+	state->ci = 0;
 	state->c = NULL;
 }
 
 bool u_sendto_visible_next(u_sendto_state *state, u_link **link_ret)
 {
-	u_user *u;
-	u_chanuser *cu;
-
 	if (state->type == ST_STOP)
 		return false;
 
-next_link:
-	if (!state->c) {
-		if (!u_map_each_next(&state->chans, (void**)&state->c, NULL))
-			return false;
-		if (!state->c)
-			return false;
-		u_map_each_start(&state->members, state->c->members);
-	}
+	for (;;) {
+		if (!state->c) {
+			if (state->ci >= state->u->nchannels)
+				return false;
+			state->c = state->u->channels[state->ci++]->c;
+			state->step = 0;
+		}
+
+		if (chan_links_next(state, link_ret))
+			return true;
 
-	if (!u_map_each_next(&state->members, (void**)&u, (void**)&cu)) {
 		state->c = NULL;
-		goto next_link;
 	}
-
-	if (!u_cookie_cmp(&u->link->ck_sendto, &ck_sendto))
-		goto next_link;
-	if (!want_send(state->type, u->link))
-		goto next_link;
-
-	*link_ret = u->link;
-	return true;
 }
 
 void u_sendto_servers_start(u_sendto_state *state, u_link *exclude)
@@ -7,11 +7,37 @@
 #include "ircd.h"
 
 mowgli_patricia_t *servers_by_sid;
+
+/* servers_by_sid is kept for iterating. lookups go through here */
+static u_server *sid_table[U_SID_TABLE_SIZE];
+
+static void sid_add(u_server *sv)
+{
+	int i;
+
+	mowgli_patricia_add(servers_by_sid, sv->sid, sv);
+	if ((i = u_sid_index(sv->sid)) >= 0 && !sv->sid[3])
+		sid_table[i] = sv;
+}
+
+static void sid_del(u_server *sv)
+{
+	int i;
+
+	mowgli_patricia_delete(servers_by_sid, sv->sid);
+	if ((i = u_sid_index(sv->sid)) >= 0 && sid_table[i] == sv)
+		sid_table[i] = NULL;
+}
 mowgli_patricia_t *servers_by_name;
 
 u_server me;
 mowgli_list_t my_motd;
 mowgli_list_t my_admininfo;
+
+/* bursts still in progress */
+static mowgli_list_t bursts;
+
+static void burst_free(u_server_burst*);
 char my_net_name[MAXNETNAME+1];
 
 static void load_motd(char *val)
@@ -47,22 +73,24 @@ static void server_conf(mowgli_config_file_t *cf, mowgli_config_file_entry_t *ce
 	MOWGLI_ITER_FOREACH(cce, ce->entries) {
 		if (streq(cce->varname, "name")) {
 			mowgli_patricia_delete(servers_by_name, me.name);
-			u_strlcpy(me.name, cce->vardata, MAXSERVNAME+1);
+			u_server_set_name(&me, cce->vardata);
 			mowgli_patricia_add(servers_by_name, me.name, &me);
 			u_log(LG_DEBUG, "server_conf: me.name=%s", me.name);
 		} else if (streq(cce->varname, "net")) {
 			u_strlcpy(my_net_name, cce->vardata, MAXNETNAME+1);
 			u_log(LG_DEBUG, "server_conf: me.net=%s", my_net_name);
 		} else if (streq(cce->varname, "sid")) {
-			mowgli_patricia_delete(servers_by_sid, me.sid);
+			sid_del(&me);
 			u_strlcpy(me.sid, cce->vardata, 4);
-			mowgli_patricia_add(servers_by_sid, me.sid, &me);
+			sid_add(&me);
 			u_log(LG_DEBUG, "server_conf: me.sid=%s", me.sid);
 		} else if (streq(cce->varname, "desc")) {
 			u_strlcpy(me.desc, cce->vardata, MAXSERVDESC+1);
 			u_log(LG_DEBUG, "server_conf: me.desc=%s", me.desc);
 		} else if (streq(cce->varname, "motd")) {
 			load_motd(cce->vardata);
+		} else if (streq(cce->varname, "sendq_budget")) {
+			u_sendq_set_budget(parse_size(cce->vardata));
 		} else {
 			u_log(LG_WARN, "server_conf: Can't use %s", cce->varname);
 		}
@@ -80,7 +108,16 @@ static void admin_conf(mowgli_config_file_t *cf, mowgli_config_file_entry_t *ce)
 
 u_server *u_server_by_sid(const char *sid)
 {
-	return mowgli_patricia_retrieve(servers_by_sid, sid);
+	int i = u_sid_index(sid);
+
+	if (i < 0 || sid[3])
+		return NULL;
+	return sid_table[i];
+}
+
+u_server *u_server_by_sid_index(int i)
+{
+	return sid_table[i];
 }
 
 u_server *u_server_by_name(const char *name)
@@ -159,6 +196,7 @@ void u_server_make_sreg(u_link *link, char *sid)
 		return;
 
 	link->type = LINK_SERVER;
+	u_link_exempt_budget(link);
 
 	if (link->priv != NULL)
 		return;
@@ -168,15 +206,23 @@ void u_server_make_sreg(u_link *link, char *sid)
 	sv->flags = SERVER_IS_BURSTING;
 
 	u_strlcpy(sv->sid, sid, 4);
-	mowgli_patricia_add(servers_by_sid, sv->sid, sv);
+	sid_add(sv);
 
-	sv->name[0] = '\0';
+	u_server_set_name(sv, "");
 	sv->desc[0] = '\0';
 	sv->link = link;
 	sv->capab = 0;
 
 	sv->hops = 1;
 	sv->parent = &me;
+	sv->burst = NULL;
+
+	sv->uids = NULL;
+	sv->uids_size = sv->uids_n = 0;
+
+	mowgli_list_init(&sv->users);
+	mowgli_list_init(&sv->children);
+	mowgli_node_add(sv, &sv->child_n, &sv->parent->children);
 
 	sv->nusers = 0;
 	sv->nlinks = 0;
@@ -198,17 +244,25 @@ u_server *u_server_new_remote(u_server *parent, char *sid,
 		u_strlcpy(sv->sid, sid, 4);
 	else
 		sv->sid[0] = '\0'; /* TS5 */
-	u_strlcpy(sv->name, name, MAXSERVNAME+1);
+	u_server_set_name(sv, name);
 	u_strlcpy(sv->desc, desc, MAXSERVDESC+1);
 	sv->capab = 0;
 	sv->hops = parent->hops + 1;
 	sv->parent = parent;
+	sv->burst = NULL;
+
+	sv->uids = NULL;
+	sv->uids_size = sv->uids_n = 0;
+
+	mowgli_list_init(&sv->users);
+	mowgli_list_init(&sv->children);
+	mowgli_node_add(sv, &sv->child_n, &parent->children);
 
 	sv->nusers = 0;
 	sv->nlinks = 0;
 
 	if (sv->sid[0])
-		mowgli_patricia_add(servers_by_sid, sv->sid, sv);
+		sid_add(sv);
 	mowgli_patricia_add(servers_by_name, sv->name, sv);
 
 	u_log(LG_INFO, "New remote server name=%s, sid=%s", sv->name, sv->sid);
@@ -218,46 +272,238 @@ u_server *u_server_new_remote(u_server *parent, char *sid,
 	return sv;
 }
 
-void u_server_destroy(u_server *sv)
-{
-	mowgli_patricia_iteration_state_t state;
+/* netsplits */
+/* --------- */
+
+/* Local users are told about a split in one pass. The departing users
+   are collected up front and grouped by channel. Then each local link
+   with a user in any of those channels gets all of its QUITs at once,
+   wrapped in a netsplit BATCH if it asked for one. The users themselves
+   are only destroyed after that, with nothing left to send. */
+
+struct split_user {
 	u_user *u;
-	u_server *tsv;
+	u_sendq_line *line;
+	u_sendq_line *tagged;
+	u_link *last;
+};
 
-	if (sv == &me) {
-		u_log(LG_ERROR, "Can't unlink self!");
-		return;
+struct netsplit {
+	u_server *sv;
+	struct split_user *users;
+	size_t nusers;
+	u_map *chans; /* u_chan* -> mowgli_list_t* of struct split_user* */
+	char ref[16];
+};
+
+static size_t split_count(u_server *sv)
+{
+	mowgli_node_t *n;
+	size_t count = sv->users.count;
+
+	MOWGLI_LIST_FOREACH(n, sv->children.head)
+		count += split_count(n->data);
+
+	return count;
+}
+
+static void split_collect(struct netsplit *ns, u_server *sv)
+{
+	mowgli_node_t *n;
+
+	MOWGLI_LIST_FOREACH(n, sv->users.head)
+		ns->users[ns->nusers++].u = n->data;
+
+	MOWGLI_LIST_FOREACH(n, sv->children.head)
+		split_collect(ns, n->data);
+}
+
+static u_sendq_line *split_line(char *ref, u_user *u)
+{
+	u_sendq_line *line;
+	char buf[512];
+	int sz;
+
+	if (ref != NULL) {
+		sz = snf(FMT_USER, buf, 511, "@batch=%s :%H QUIT :*.net *.split",
+		         ref, u);
+	} else {
+		sz = snf(FMT_USER, buf, 511, ":%H QUIT :*.net *.split", u);
 	}
 
-	u_log(LG_INFO, "Unlinking server sid=%s (%S)", sv->sid, sv);
+	line = u_sendq_line_new(sz + 2);
+	memcpy(line->data, buf, sz);
+	line->data[sz++] = '\r';
+	line->data[sz++] = '\n';
+	line->len = sz;
 
-	sv->parent->nlinks--;
+	return line;
+}
+
+static void split_send(struct netsplit *ns, u_link *link)
+{
+	u_user *u = link->priv;
+	u_chanuser *cu;
+	uint ci;
+	mowgli_list_t *list;
+	mowgli_node_t *n;
+	struct split_user *su;
+	bool batch = u->flags & CAP_BATCH;
+
+	if (batch) {
+		u_link_f(link, ":%S BATCH +%s netsplit %s %s", &me, ns->ref,
+		         ns->sv->parent->name, ns->sv->name);
+	}
+
+	U_USER_EACH_CHAN(u, ci, cu) {
+		if ((list = u_map_get(ns->chans, cu->c)) == NULL)
+			continue;
 
-	/* delete all users */
-	if (sv->sid[0]) {
-		MOWGLI_PATRICIA_FOREACH(u, &state, users_by_uid) {
-			if (strncmp(sv->sid, u->uid, 3))
+		MOWGLI_LIST_FOREACH(n, list->head) {
+			su = n->data;
+			if (su->last == link)
 				continue;
+			su->last = link;
+
+			if (!batch) {
+				u_link_put_line(link, su->line);
+			} else {
+				if (su->tagged == NULL)
+					su->tagged = split_line(ns->ref, su->u);
+				u_link_put_line(link, su->tagged);
+			}
+
+			/* a full sendq takes the user and its channel
+			   map with it */
+			if (link->flags & U_LINK_SENT_QUIT)
+				return;
+		}
+	}
+
+	if (batch)
+		u_link_f(link, ":%S BATCH -%s", &me, ns->ref);
+}
 
-			u_sendto_visible(u, ST_USERS, ":%H QUIT :*.net *.split", u);
-			u_user_destroy(u);
+static void split_free_list(u_map *map, void *chan, void *list,
+                            void *unused)
+{
+	mowgli_node_t *n, *tn;
+
+	MOWGLI_LIST_FOREACH_SAFE(n, tn, ((mowgli_list_t*) list)->head) {
+		mowgli_node_delete(n, list);
+		mowgli_node_free(n);
+	}
+
+	mowgli_list_free(list);
+}
+
+static void split_quits(u_server *sv)
+{
+	static uint ref_next = 0;
+	struct netsplit ns;
+	u_map_each_state st, lst;
+	u_map *links;
+	mowgli_list_t *list;
+	u_chanuser *cu;
+	u_chan *c;
+	u_link *link;
+	size_t i;
+	uint ci;
+
+	ns.sv = sv;
+	ns.nusers = 0;
+	if ((i = split_count(sv)) == 0)
+		return;
+	ns.users = calloc(i, sizeof(*ns.users));
+	split_collect(&ns, sv);
+	snprintf(ns.ref, sizeof(ns.ref), "ns%u", ref_next++);
+
+	/* group departing users by channel */
+	ns.chans = u_map_new(0);
+	for (i=0; i<ns.nusers; i++) {
+		struct split_user *su = ns.users + i;
+
+		su->line = split_line(NULL, su->u);
+
+		U_USER_EACH_CHAN(su->u, ci, cu) {
+			if ((list = u_map_get(ns.chans, cu->c)) == NULL) {
+				list = mowgli_list_create();
+				u_map_set(ns.chans, cu->c, list);
+			}
+			mowgli_node_add(su, mowgli_node_create(), list);
+		}
+	}
+
+	/* one batch per local link that can see any of them */
+	links = u_map_new(0);
+	U_MAP_EACH(&st, ns.chans, &c, NULL) {
+		U_MAP_EACH(&lst, c->local_links, &link, NULL) {
+			if (u_map_get(links, link))
+				continue;
+			u_map_set(links, link, link);
+			split_send(&ns, link);
 		}
 	}
+	u_map_free(links);
+
+	u_map_each(ns.chans, split_free_list, NULL);
+	u_map_free(ns.chans);
+
+	for (i=0; i<ns.nusers; i++) {
+		u_sendq_line_unref(ns.users[i].line);
+		u_sendq_line_unref(ns.users[i].tagged);
+	}
+	free(ns.users);
+}
+
+static void server_destroy(u_server *sv)
+{
+	mowgli_node_t *n, *tn;
+
+	u_log(LG_INFO, "Unlinking server sid=%s (%S)", sv->sid, sv);
+
+	sv->parent->nlinks--;
+	mowgli_node_delete(&sv->child_n, &sv->parent->children);
+
+	if (sv->burst != NULL)
+		burst_free(sv->burst);
+
+	/* delete all users. local users have already been told */
+	MOWGLI_LIST_FOREACH_SAFE(n, tn, sv->users.head)
+		u_user_destroy(n->data);
 
 	if (sv->name[0])
 		mowgli_patricia_delete(servers_by_name, sv->name);
 	if (sv->sid[0])
-		mowgli_patricia_delete(servers_by_sid, sv->sid);
+		sid_del(sv);
 
 	/* delete any servers linked to this one */
-	MOWGLI_PATRICIA_FOREACH(tsv, &state, servers_by_sid) {
-		if (tsv->parent == sv)
-			u_server_destroy(tsv);
-	}
+	MOWGLI_LIST_FOREACH_SAFE(n, tn, sv->children.head)
+		server_destroy(n->data);
 
+	u_src_epoch++;
+
+	free(sv->uids);
 	free(sv);
 }
 
+void u_server_destroy(u_server *sv)
+{
+	if (sv == &me) {
+		u_log(LG_ERROR, "Can't unlink self!");
+		return;
+	}
+
+	split_quits(sv);
+	server_destroy(sv);
+}
+
+void u_server_set_name(u_server *sv, const char *name)
+{
+	u_strlcpy(sv->name, name, MAXSERVNAME+1);
+	sv->namelen = strlen(sv->name);
+}
+
 static int burst_euid(const char *key, void *value, void *priv)
 {
 	u_user *u = value;
@@ -300,35 +546,51 @@ static int burst_uid(const char *key, void *value, void *priv)
 	return 0;
 }
 
-static int burst_chan(const char *key, void *_c, void *_link)
+struct u_server_burst {
+	mowgli_node_t n;
+	u_server *sv;
+	int step;
+	ulong serial; /* u_user_serial when the burst started */
+	ulong sent; /* users up to this serial have been visited */
+
+	char *keys;
+	size_t keysz, nkeys, pos;
+	ulong *serials; /* in the user phase, matching keys */
+};
+
+/* members introduced after the burst started are left out. the peer
+   hasn't heard of them yet, and their JOINs are held with the rest */
+static void burst_chan(u_server_burst *b, u_chan *c, u_link *link)
 {
-	u_chan *c = _c;
-	u_link *link = _link;
-	u_user *u;
 	u_chanuser *cu;
-	u_map_each_state st;
 	u_strop_wrap wrap;
 	mowgli_node_t *n;
 	char *s, buf[512];
+	bool any = false;
 	int sz;
+	uint i;
 
 	if (c->flags & CHAN_LOCAL)
-		return 0;
+		return;
 
 	sz = snf(FMT_SERVER, buf, 512, ":%S SJOIN %u %s %s :",
 	         &me, c->ts, c->name, u_chan_modes(c, 1));
 
 	u_strop_wrap_start(&wrap, 510 - sz);
-	U_MAP_EACH(&st, c->members, &u, &cu) {
+	U_CHAN_EACH_MEMBER(c, i, cu) {
 		char *p, nbuf[12];
 
+		if (cu->u->serial > b->serial)
+			continue;
+		any = true;
+
 		p = nbuf;
 		MOWGLI_LIST_FOREACH(n, cu_pfx_list.head) {
 			u_cu_pfx *cs = n->data;
 			if (cu->flags & cs->mask)
 				*p++ = cs->prefix;
 		}
-		strcpy(p, u->uid);
+		strcpy(p, cu->u->uid);
 
 		while ((s = u_strop_wrap_word(&wrap, nbuf)) != NULL)
 			u_link_f(link, "%s%s", buf, s);
@@ -336,12 +598,14 @@ static int burst_chan(const char *key, void *_c, void *_link)
 	if ((s = u_strop_wrap_word(&wrap, NULL)) != NULL)
 		u_link_f(link, "%s%s", buf, s);
 
+	/* nobody the peer knows is in it. the held JOINs will create it */
+	if (!any)
+		return;
+
 	if (c->topic[0]) {
 		u_link_f(link, ":%S TB %C %u %s :%s", &me, c,
 		         c->topic_time, c->topic_setter, c->topic);
 	}
-
-	return 0;
 }
 
 void u_server_burst_1(u_link *link, u_link_block *block)
@@ -362,9 +626,222 @@ void u_server_burst_1(u_link *link, u_link_block *block)
 	u_link_f(link, "SERVER %s 1 :%s", me.name, me.desc);
 }
 
+/* Bursts are produced a piece at a time, as the link's send queue
+   drains, so linking a big network doesn't queue the whole thing at
+   once. Users and channels are visited from a snapshot of their keys;
+   anything that's gone by the time we get to it is skipped. Whatever
+   else gets sent to the link in the meantime is held back and released
+   after the burst, so the server never hears about changes to users and
+   channels it doesn't know about yet. */
+
+#define BURST_HIGH_WATER (64 << 10)
+
+enum {
+	BURST_USERS,
+	BURST_CHANS,
+	BURST_DONE,
+};
+
+
+static void burst_free(u_server_burst *b)
+{
+	mowgli_node_delete(&b->n, &bursts);
+	b->sv->burst = NULL;
+	free(b->keys);
+	free(b->serials);
+	free(b);
+}
+
+static void burst_snapshot(u_server_burst *b, size_t keysz, size_t count)
+{
+	free(b->keys);
+	b->keys = malloc(keysz * (count + 1));
+	b->keysz = keysz;
+	b->nkeys = 0;
+	b->pos = 0;
+}
+
+static void burst_step(u_server_burst *b)
+{
+	u_chan *c;
+	uint pos;
+
+	switch (++b->step) {
+	case BURST_CHANS:
+		burst_snapshot(b, MAXCHANNAME+1, all_chans->size);
+		U_HASH_EACH(all_chans, pos, &c) {
+			if (c->flags & CHAN_LOCAL)
+				continue;
+			u_strlcpy(b->keys + b->nkeys++ * b->keysz,
+			          c->name, b->keysz);
+		}
+		break;
+
+	default:
+		b->step = BURST_DONE;
+		break;
+	}
+}
+
+static void burst_one(u_server_burst *b, u_link *link, size_t i)
+{
+	char *key = b->keys + i * b->keysz;
+	u_user *u;
+	u_chan *c;
+
+	switch (b->step) {
+	case BURST_USERS:
+		b->sent = b->serials[i];
+
+		/* gone, or a new user with the same UID, or one that
+		   registered since. those are held with everything else */
+		if ((u = u_user_by_uid(key)) == NULL)
+			break;
+		if (u->serial > b->serial || !IS_REGISTERED(u))
+			break;
+		if (b->sv->capab & CAPAB_EUID)
+			burst_euid(NULL, u, link);
+		else
+			burst_uid(NULL, u, link);
+		break;
+
+	case BURST_CHANS:
+		if ((c = u_chan_get(key)) != NULL)
+			burst_chan(b, c, link);
+		break;
+	}
+}
+
+static void burst_run(u_server *sv, size_t high)
+{
+	u_server_burst *b = sv->burst;
+	u_link *link = sv->link;
+
+	/* the burst itself skips the hold */
+	link->flags &= ~U_LINK_HOLD_OUTPUT;
+
+	while (link->conn->sendq.size < high) {
+		if (b->pos == b->nkeys) {
+			burst_step(b);
+			if (b->step == BURST_DONE)
+				break;
+			continue;
+		}
+
+		burst_one(b, link, b->pos++);
+
+		/* the link may have died of a full sendq, taking the
+		   server and the burst with it */
+		if (link->flags & U_LINK_SENT_QUIT)
+			return;
+	}
+
+	if (b->step != BURST_DONE) {
+		link->flags |= U_LINK_HOLD_OUTPUT;
+		return;
+	}
+
+	burst_free(b);
+
+	u_log(LG_DEBUG, "Finished sending burst to %S", sv);
+
+	u_link_release_output(link);
+	u_link_f(link, ":%S PING %s %s", &me, me.name, sv->name);
+}
+
+static size_t burst_high_water(u_link *link)
+{
+	if (link->sendq > 0 && link->sendq / 2 < BURST_HIGH_WATER)
+		return link->sendq / 2;
+	return BURST_HIGH_WATER;
+}
+
+void u_server_burst_continue(u_server *sv)
+{
+	size_t high;
+
+	if (sv == NULL || sv->burst == NULL)
+		return;
+
+	high = burst_high_water(sv->link);
+
+	/* wait until we're under the low water mark */
+	if (sv->link->conn->sendq.size > high / 2)
+		return;
+
+	burst_run(sv, high);
+}
+
+void u_server_burst_finish_all(void)
+{
+	u_server_burst *b;
+
+	while (bursts.head != NULL) {
+		b = bursts.head->data;
+		burst_run(b->sv, (size_t) -1);
+	}
+}
+
+static int by_serial(const void *a, const void *b)
+{
+	ulong sa = (*(u_user**) a)->serial;
+	ulong sb = (*(u_user**) b)->serial;
+
+	return sa < sb ? -1 : sa > sb;
+}
+
+/* users are visited in the order they were introduced, so whether one
+   has been sent yet is a matter of comparing serials */
+static void burst_snapshot_users(u_server_burst *b)
+{
+	mowgli_patricia_iteration_state_t state;
+	u_user **users, *u;
+	size_t i, n = 0;
+
+	users = malloc(mowgli_patricia_size(users_by_uid) * sizeof(*users));
+	MOWGLI_PATRICIA_FOREACH(u, &state, users_by_uid)
+		users[n++] = u;
+	qsort(users, n, sizeof(*users), by_serial);
+
+	burst_snapshot(b, 10, n);
+	b->serials = malloc((n + 1) * sizeof(*b->serials));
+	for (i=0; i<n; i++) {
+		memcpy(b->keys + b->nkeys++ * b->keysz, users[i]->uid, 10);
+		b->serials[i] = users[i]->serial;
+	}
+
+	free(users);
+}
+
+bool u_server_burst_hides(u_server *sv, const uchar *line, size_t len)
+{
+	u_server_burst *b = sv->burst;
+	char uid[10];
+	size_t i;
+	u_user *u;
+
+	if (b == NULL || b->step != BURST_USERS)
+		return false;
+
+	if (len < 11 || line[0] != ':' || line[10] != ' ')
+		return false;
+
+	for (i=0; i<9; i++)
+		uid[i] = line[i + 1];
+	uid[9] = '\0';
+
+	if ((u = u_user_by_uid(uid)) == NULL)
+		return false;
+
+	/* introduced before the burst started, and not sent yet. the
+	   burst will send them as they are by the time it gets there */
+	return u->serial > b->sent && u->serial <= b->serial;
+}
+
 void u_server_burst_2(u_server *sv, u_link_block *block)
 {
 	mowgli_patricia_iteration_state_t state;
+	u_server_burst *b;
 	u_server *tsv;
 	u_link *link = sv->link;
 
@@ -395,21 +872,23 @@ void u_server_burst_2(u_server *sv, u_link_block *block)
 
 	/* TODO: "BAN messages for all propagated bans" */
 
+	u_log(LG_DEBUG, "Adding %s to servers_by_name", sv->name);
+	mowgli_patricia_add(servers_by_name, sv->name, sv);
+
 	/* TODO: "EUID for all known users (possibly followed by ENCAP
 	   REALHOST, ENCAP LOGIN, and/or AWAY)" */
-	if (sv->capab & CAPAB_EUID)
-		mowgli_patricia_foreach(users_by_uid, burst_euid, link);
-	else
-		mowgli_patricia_foreach(users_by_uid, burst_uid, link);
-
 	/* TODO: "and SJOIN messages for all known channels (possibly followed
 	   by BMASK and/or TB)" */
-	mowgli_patricia_foreach(all_chans, burst_chan, link);
+	sv->burst = b = calloc(1, sizeof(*b));
+	b->sv = sv;
+	b->step = BURST_USERS;
+	b->serial = u_user_serial;
+	mowgli_node_add(b, &b->n, &bursts);
 
-	u_link_f(link, ":%S PING %s %s", &me, me.name, sv->name);
+	burst_snapshot_users(b);
 
-	u_log(LG_DEBUG, "Adding %s to servers_by_name", sv->name);
-	mowgli_patricia_add(servers_by_name, sv->name, sv);
+	u_link_hold_output(link);
+	burst_run(sv, burst_high_water(link));
 }
 
 void u_server_eob(u_server *sv)
@@ -551,17 +1030,23 @@ static int restore_specific_server(const char *sid, mowgli_json_t *js)
 		s->link->priv = s;
 		s->parent = sparent;
 
+		mowgli_list_init(&s->users);
+		mowgli_list_init(&s->children);
+		if (sparent)
+			mowgli_node_add(s, &s->child_n, &sparent->children);
+
 		jsname = json_ogets(js, "name");
 		if (!jsname || jsname->pos > MAXSERVNAME)
 			return -1;
 		memcpy(s->name, jsname->str, jsname->pos);
+		s->namelen = jsname->pos;
 
 		jsdesc = json_ogets(js, "desc");
 		if (!jsdesc || jsname->pos > MAXSERVDESC)
 			return -1;
 		memcpy(s->desc, jsdesc->str, jsdesc->pos);
 
-		mowgli_patricia_add(servers_by_sid,  s->sid,  s);
+		sid_add(s);
 		mowgli_patricia_add(servers_by_name, s->name, s);
 	}
 
@@ -608,6 +1093,7 @@ int init_server(void)
 	servers_by_name = mowgli_patricia_create(ascii_canonize);
 
 	mowgli_list_init(&my_motd);
+	mowgli_list_init(&bursts);
 
 	u_strlcpy(my_net_name, "TethysIRC", MAXNETNAME+1);
 
@@ -617,7 +1103,7 @@ int init_server(void)
 	/* default settings! */
 	me.link = NULL;
 	strcpy(me.sid, "22U");
-	u_strlcpy(me.name, "tethys.irc", MAXSERVNAME+1);
+	u_server_set_name(&me, "tethys.irc");
 	u_strlcpy(me.desc, "The Tiny IRC Server", MAXSERVDESC+1);
 	me.capab = CAPAB_QS | CAPAB_EX | CAPAB_CHW | CAPAB_IE
 	         | CAPAB_EOB | CAPAB_KLN | CAPAB_UNKLN | CAPAB_KNOCK
@@ -625,12 +1111,14 @@ int init_server(void)
 	         | CAPAB_SAVE | CAPAB_EUID;
 	me.hops = 0;
 	me.parent = NULL;
+	mowgli_list_init(&me.users);
+	mowgli_list_init(&me.children);
 
 	me.nusers = 0;
 	me.nlinks = 0;
 
 	mowgli_patricia_add(servers_by_name, me.name, &me);
-	mowgli_patricia_add(servers_by_sid, me.sid, &me);
+	sid_add(&me);
 
 	return 1;
 }
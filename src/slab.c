@@ -0,0 +1,189 @@
+/* Tethys, slab.c -- typed object pools
+   Copyright (C) 2014 Alex Iadicicco
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+#include "ircd.h"
+#include <sys/mman.h>
+
+/* Each page starts with its header, and pages are aligned to their size
+   so an object's page is found by masking its address. Objects that have
+   never been handed out are taken in order after the header, which
+   saves touching the whole page when it's first allocated. Freed
+   objects are kept in a list threaded through the objects themselves.
+
+   Pages come straight from mmap, since posix_memalign leaves gaps of up
+   to a page around each one and free doesn't give them back. */
+
+struct u_slab_page {
+	u_slab *slab;
+	u_slab_page *prev, *next;
+
+	void *free;
+	uint nfree; /* including fresh ones */
+	uint fresh; /* index of the first object never handed out */
+	uint nobjs;
+};
+
+#define ROUND(N, A) (((N) + (A) - 1) & ~((A) - 1))
+
+#define PAGE_OF(P) ((u_slab_page*) ((uintptr_t) (P) & ~(U_SLAB_PAGE - 1)))
+
+u_slab *u_slabs = NULL;
+
+static void page_link(u_slab_page **list, u_slab_page *pg)
+{
+	pg->prev = NULL;
+	pg->next = *list;
+	if (pg->next)
+		pg->next->prev = pg;
+	*list = pg;
+}
+
+static void page_unlink(u_slab_page **list, u_slab_page *pg)
+{
+	if (pg->prev)
+		pg->prev->next = pg->next;
+	else
+		*list = pg->next;
+	if (pg->next)
+		pg->next->prev = pg->prev;
+}
+
+static void slab_list(u_slab *slab)
+{
+	u_slab **p;
+
+	if (slab->align == 0)
+		slab->align = sizeof(void*);
+	slab->size = ROUND(slab->size, slab->align);
+	slab->first = ROUND(sizeof(u_slab_page), slab->align);
+
+	if (slab->size > U_SLAB_PAGE - slab->first) {
+		u_log(LG_SEVERE, "slab %s: %u byte objects don't fit in a page",
+		      slab->name, (uint) slab->size);
+		abort();
+	}
+
+	/* keep the list in order of name, for STATS */
+	for (p = &u_slabs; *p && strcmp((*p)->name, slab->name) < 0;
+	     p = &(*p)->next);
+	slab->next = *p;
+	*p = slab;
+
+	slab->listed = true;
+}
+
+/* maps twice what's needed and trims it down to an aligned page */
+static u_slab_page *page_map(void)
+{
+	uchar *p, *pg;
+	size_t head;
+
+	p = mmap(NULL, 2 * U_SLAB_PAGE, PROT_READ | PROT_WRITE,
+	         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	pg = (uchar*) PAGE_OF(p + U_SLAB_PAGE - 1);
+	head = pg - p;
+
+	if (head > 0)
+		munmap(p, head);
+	munmap(pg + U_SLAB_PAGE, U_SLAB_PAGE - head);
+
+	return (u_slab_page*) pg;
+}
+
+static u_slab_page *page_new(u_slab *slab)
+{
+	u_slab_page *pg;
+
+	if (slab->spare != NULL) {
+		pg = slab->spare;
+		slab->spare = NULL;
+		return pg;
+	}
+
+	if ((pg = page_map()) == NULL) {
+		u_log(LG_SEVERE, "slab %s: mmap() failed", slab->name);
+		abort();
+	}
+
+	pg->slab = slab;
+	pg->free = NULL;
+	pg->fresh = 0;
+	pg->nobjs = pg->nfree = (U_SLAB_PAGE - slab->first) / slab->size;
+
+	slab->free += pg->nobjs;
+	slab->pages++;
+
+	return pg;
+}
+
+void *u_slab_alloc(u_slab *slab)
+{
+	u_slab_page *pg;
+	void *p;
+
+	if (!slab->listed)
+		slab_list(slab);
+
+	if ((pg = slab->partial) == NULL) {
+		pg = page_new(slab);
+		page_link(&slab->partial, pg);
+	}
+
+	if (pg->free != NULL) {
+		p = pg->free;
+		pg->free = *(void**) p;
+	} else {
+		p = (uchar*) pg + slab->first + pg->fresh++ * slab->size;
+	}
+
+	if (--pg->nfree == 0)
+		page_unlink(&slab->partial, pg);
+
+	slab->free--;
+	if (++slab->live > slab->peak)
+		slab->peak = slab->live;
+
+	memset(p, 0, slab->size);
+	return p;
+}
+
+void u_slab_free(u_slab *slab, void *p)
+{
+	u_slab_page *pg;
+
+	if (p == NULL)
+		return;
+
+	pg = PAGE_OF(p);
+
+	*(void**) p = pg->free;
+	pg->free = p;
+
+	slab->live--;
+	slab->free++;
+
+	if (++pg->nfree == 1)
+		page_link(&slab->partial, pg);
+
+	if (pg->nfree < pg->nobjs)
+		return;
+
+	page_unlink(&slab->partial, pg);
+
+	if (slab->spare == NULL) {
+		slab->spare = pg;
+		return;
+	}
+
+	slab->free -= pg->nobjs;
+	slab->pages--;
+	munmap(pg, U_SLAB_PAGE);
+}
+
+/* vim: set noet: */
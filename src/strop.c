@@ -6,6 +6,10 @@
 
 #include "ircd.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 void u_strop_split_start(u_strop_state *st, char *s, char *delim)
 {
 	st->s = s;
@@ -71,3 +75,28 @@ char *u_strop_wrap_word(u_strop_wrap *w, char *word)
 
 	return NULL;
 }
+
+char *u_strop_eol(char *s, size_t n)
+{
+#ifdef __SSE2__
+	const __m128i cr = _mm_set1_epi8('\r');
+	const __m128i lf = _mm_set1_epi8('\n');
+	__m128i v;
+	int mask;
+
+	for (; n >= 16; s += 16, n -= 16) {
+		v = _mm_loadu_si128((__m128i*) s);
+		mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, cr),
+		                                      _mm_cmpeq_epi8(v, lf)));
+		if (mask != 0)
+			return s + __builtin_ctz(mask);
+	}
+#endif
+
+	for (; n > 0; s++, n--) {
+		if (*s == '\r' || *s == '\n')
+			return s;
+	}
+
+	return NULL;
+}
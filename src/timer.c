@@ -0,0 +1,142 @@
+/* Tethys, timer.c -- timer wheel
+   Copyright (C) 2014 Alex Iadicicco
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+#include "ircd.h"
+
+/* Four wheels of 64 slots. The first has a slot per second, the next a
+   slot per 64 seconds, and so on, which covers about 194 days. A timer
+   goes in the finest wheel it fits in. Each time a wheel comes back
+   around to slot 0, the next wheel's current slot is emptied into the
+   finer ones, so a timer is only ever moved once per wheel, and a tick
+   only touches the timers that are due then. Timers further out than
+   the wheels go are put at the very end and cascade down from there. */
+
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEELS 4
+
+#define WHEEL_SPAN(W) (1UL << (WHEEL_BITS * (W)))
+#define WHEEL_SLOT(W, T) (((T) >> (WHEEL_BITS * (W))) & WHEEL_MASK)
+
+static u_timer *wheel[WHEELS][WHEEL_SIZE];
+
+/* the last tick that's been run */
+static ulong now_tick = 0;
+
+static void start(void)
+{
+	now_tick = NOW.tv_sec;
+}
+
+static void unlink_timer(u_timer *t)
+{
+	if (t->next)
+		t->next->prev = t->prev;
+	*t->prev = t->next;
+	t->prev = NULL;
+}
+
+static void place(u_timer *t)
+{
+	u_timer **slot;
+	ulong delta;
+	int w;
+
+	if (t->expires < now_tick)
+		t->expires = now_tick;
+	delta = t->expires - now_tick;
+
+	for (w=0; w<WHEELS-1; w++) {
+		if (delta < WHEEL_SPAN(w + 1))
+			break;
+	}
+
+	if (delta >= WHEEL_SPAN(WHEELS)) {
+		/* past the end. it'll be placed properly on the way down */
+		slot = &wheel[WHEELS-1][WHEEL_SLOT(WHEELS-1, now_tick - 1)];
+	} else {
+		slot = &wheel[w][WHEEL_SLOT(w, t->expires)];
+	}
+
+	t->prev = slot;
+	t->next = *slot;
+	if (t->next)
+		t->next->prev = &t->next;
+	*slot = t;
+}
+
+/* empties a slot into the finer wheels */
+static void cascade(int w)
+{
+	u_timer **slot = &wheel[w][WHEEL_SLOT(w, now_tick)];
+	u_timer *t;
+
+	while ((t = *slot) != NULL) {
+		unlink_timer(t);
+		place(t);
+	}
+}
+
+void u_timer_init(u_timer *t, u_timer_cb_t *cb)
+{
+	t->next = NULL;
+	t->prev = NULL;
+	t->cb = cb;
+}
+
+void u_timer_set(u_timer *t, uint secs)
+{
+	if (now_tick == 0)
+		start();
+
+	if (t->prev != NULL)
+		unlink_timer(t);
+
+	/* the current tick has already been run. if NOW has moved on
+	   since, the timer is still placed against now_tick, so it's
+	   secs from NOW either way */
+	t->expires = NOW.tv_sec + secs;
+	if (t->expires <= now_tick)
+		t->expires = now_tick + 1;
+
+	place(t);
+}
+
+void u_timer_del(u_timer *t)
+{
+	if (t->prev != NULL)
+		unlink_timer(t);
+}
+
+void u_timer_run(void)
+{
+	u_timer **slot, *t;
+	int w;
+
+	if (now_tick == 0)
+		start();
+
+	while (now_tick < (ulong) NOW.tv_sec) {
+		now_tick++;
+
+		for (w=1; w<WHEELS; w++) {
+			if (WHEEL_SLOT(w - 1, now_tick) != 0)
+				break;
+			cascade(w);
+		}
+
+		/* a timer set again from its callback always goes
+		   somewhere else, so this ends */
+		slot = &wheel[0][WHEEL_SLOT(0, now_tick)];
+		while ((t = *slot) != NULL) {
+			unlink_timer(t);
+			t->cb(t);
+		}
+	}
+}
+
+/* vim: set noet: */
@@ -87,6 +87,13 @@ begin_upgrade(void)
 	/* Open database */
 	upgrade_json = mowgli_json_create_object();
 
+	/* Send queues are dumped as-is, so get any bursts out of the way */
+	u_server_burst_finish_all();
+
+	/* and any checks still out with the verify threads, so nobody is
+	   left parked with U_LINK_WAIT_VERIFY */
+	u_verify_finish_all();
+
 	/* Call each unit and give it an opportunity to dump information */
 #define DUMP(fn) if ((err = (fn)()) < 0) goto error
 	DUMP(dump_user);
@@ -6,7 +6,7 @@
 
 #include "ircd.h"
 
-mowgli_patricia_t *users_by_nick;
+u_hash *users_by_nick;
 mowgli_patricia_t *users_by_uid;
 
 char *id_map = "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
@@ -46,6 +46,121 @@ static int set_id_next_from_str(const char *id)
 	return 0;
 }
 
+/* uid index */
+/* --------- */
+
+/* Users are found by UID through the server named by the first three
+   characters, and then a hash table on that server keyed by the other
+   six, decoded as a base 36 number. Users are always indexed under
+   u->sv, so the few whose UID doesn't start with their server's SID
+   (which we only warn about) are also counted here and make lookups
+   fall back to users_by_uid while there are any. */
+static uint uids_foreign = 0;
+
+static bool uid_suffix(const char *s, uint *v)
+{
+	int i, d;
+
+	*v = 0;
+	for (i=0; i<6; i++) {
+		if ((d = u_id_digit(s[i])) < 0)
+			return false;
+		*v = *v * 36 + d;
+	}
+
+	return s[6] == '\0';
+}
+
+static uint uid_slot(u_server *sv, uint v)
+{
+	/* suffixes are handed out sequentially, so the low bits are
+	   already well spread */
+	return v & (sv->uids_size - 1);
+}
+
+static void uid_grow(u_server *sv)
+{
+	u_user **old = sv->uids, *u, *next;
+	uint i, v, old_size = sv->uids_size;
+
+	sv->uids_size = old_size ? old_size * 2 : 16;
+	sv->uids = calloc(sv->uids_size, sizeof(*sv->uids));
+
+	for (i=0; i<old_size; i++) {
+		for (u=old[i]; u; u=next) {
+			next = u->uid_next;
+			uid_suffix(u->uid + 3, &v);
+			u->uid_next = sv->uids[uid_slot(sv, v)];
+			sv->uids[uid_slot(sv, v)] = u;
+		}
+	}
+
+	free(old);
+}
+
+static void uid_add(u_user *u)
+{
+	u_server *sv = u->sv;
+	uint v;
+
+	mowgli_patricia_add(users_by_uid, u->uid, u);
+
+	if (strncmp(u->uid, sv->sid, 3) != 0 || !uid_suffix(u->uid + 3, &v)) {
+		uids_foreign++;
+		return;
+	}
+
+	if (sv->uids_n >= sv->uids_size)
+		uid_grow(sv);
+
+	u->uid_next = sv->uids[uid_slot(sv, v)];
+	sv->uids[uid_slot(sv, v)] = u;
+	sv->uids_n++;
+}
+
+static void uid_del(u_user *u)
+{
+	u_server *sv = u->sv;
+	u_user **p;
+	uint v;
+
+	mowgli_patricia_delete(users_by_uid, u->uid);
+
+	if (strncmp(u->uid, sv->sid, 3) != 0 || !uid_suffix(u->uid + 3, &v)) {
+		uids_foreign--;
+		return;
+	}
+
+	for (p = &sv->uids[uid_slot(sv, v)]; *p; p = &(*p)->uid_next) {
+		if (*p == u) {
+			*p = u->uid_next;
+			sv->uids_n--;
+			break;
+		}
+	}
+}
+
+static u_user *uid_find(const char *uid)
+{
+	u_server *sv;
+	u_user *u;
+	uint v;
+	int i;
+
+	if ((i = u_sid_index(uid)) >= 0 && uid_suffix(uid + 3, &v)
+	    && (sv = u_server_by_sid_index(i)) && sv->uids_size) {
+		for (u = sv->uids[uid_slot(sv, v)]; u; u = u->uid_next) {
+			if (!strcasecmp(u->uid + 3, uid + 3))
+				return u;
+		}
+	}
+
+	if (uids_foreign > 0)
+		return mowgli_patricia_retrieve(users_by_uid, uid);
+
+	return NULL;
+}
+
 static ulong umode_get_flag_bits(u_modes *m)
 {
 	return ((u_user*) m->target)->mode;
@@ -79,19 +194,22 @@ u_mode_ctx umodes = {
 
 uint umode_default = 0;
 
+static u_slab user_slab = U_SLAB_INIT_ALIGNED("users", u_user, 64);
+
+ulong u_user_serial = 0;
+
 static u_user *create_user(const char *uid, u_link *link, u_server *sv)
 {
 	u_user *u;
 
-	if (!(u = calloc(1, sizeof(*u)))) {
-		u_log(LG_SEVERE, "calloc() failed");
-		abort();
-	}
+	u = u_slab_alloc(&user_slab);
 
 	u_strlcpy(u->uid, uid, 10);
-	mowgli_patricia_add(users_by_uid, u->uid, u);
 
-	u->channels = u_map_new(0);
+	u->acct = u->ident = u->ip = u_istr_empty;
+	u->realhost = u->host = u->gecos = u_istr_empty;
+	u_user_update_prefix(u);
+
 	u->invites = u_map_new(0);
 
 	u_ratelimit_init(u);
@@ -99,8 +217,11 @@ static u_user *create_user(const char *uid, u_link *link, u_server *sv)
 	u->link = link;
 	u->oper = NULL;
 	u->sv = sv;
+	u->serial = ++u_user_serial;
 
 	u->sv->nusers++;
+	mowgli_node_add(u, &u->sv_n, &u->sv->users);
+	uid_add(u);
 
 	return u;
 }
@@ -142,11 +263,6 @@ u_user *u_user_create_remote(u_server *sv, char *uid)
 	return u;
 }
 
-void user_destroy_cb(u_map *map, u_chan *c, u_chanuser *cu, void *priv)
-{
-	u_chan_user_del(cu);
-}
-
 void u_user_destroy(u_user *u)
 {
 	u_log(LG_VERBOSE, "Destroying user uid=%s (%U)", u->uid, u);
@@ -154,16 +270,41 @@ void u_user_destroy(u_user *u)
 	u_clr_invites_user(u);
 
 	/* part from all channels */
-	u_map_each(u->channels, (u_map_cb_t*)user_destroy_cb, NULL);
-	u_map_free(u->channels);
+	while (u->nchannels > 0)
+		u_chan_user_del(u->channels[u->nchannels - 1]);
+	free(u->channels);
+	free(u->chanhash);
 
 	if (u->nick[0])
-		mowgli_patricia_delete(users_by_nick, u->nick);
-	mowgli_patricia_delete(users_by_uid, u->uid);
+		u_hash_del(users_by_nick, u->nickhash, u);
+	uid_del(u);
 
 	u->sv->nusers--;
+	mowgli_node_delete(&u->sv_n, &u->sv->users);
+
+	u_istr_put(u->acct);
+	u_istr_put(u->ident);
+	u_istr_put(u->ip);
+	u_istr_put(u->realhost);
+	u_istr_put(u->host);
+	u_istr_put(u->gecos);
+	free(u->away);
+	free(u->prefix);
 
-	free(u);
+	u_src_epoch++;
+
+	u_slab_free(&user_slab, u);
+}
+
+static void auth_found(u_link *link, u_auth_block *auth)
+{
+	if (auth == NULL) {
+		u_link_fatal(link, "No auth blocks for your host");
+		return;
+	}
+
+	link->conf.auth = auth;
+	u_user_try_register(link->priv);
 }
 
 void u_user_try_register(u_user *u)
@@ -183,22 +324,28 @@ void u_user_try_register(u_user *u)
 	if (u->flags & USER_MASK_WAIT)
 		return;
 
-	if (!(u->link->conf.auth = u_find_auth(u->link))) {
-		u_link_fatal(u->link, "No auth blocks for your host");
+	/* comes back here once the password's been checked */
+	if (u->link->conf.auth == NULL) {
+		u_find_auth_async(u->link, auth_found);
 		return;
 	}
+
 	u->link->sendq = u->link->conf.auth->cls->sendq;
+	u_link_set_recvq(u->link, u->link->conf.auth->cls->recvq);
+	u->link->weight = u->link->conf.auth->cls->weight;
 
 	u->link->flags |= U_LINK_REGISTERED;
-	u_strlcpy(u->ip, u->link->conn->ip, INET6_ADDRSTRLEN);
-	u_strlcpy(u->realhost, u->link->conn->host, MAXHOST+1);
-	u_strlcpy(u->host, u->link->conn->host, MAXHOST+1);
+	u->serial = ++u_user_serial;
+	u_istr_set(&u->ip, u->link->conn->ip, INET6_ADDRSTRLEN - 1);
+	u_istr_set(&u->realhost, u->link->conn->host, MAXHOST);
+	u_istr_set(&u->host, u->link->conn->host, MAXHOST);
+	u_user_update_prefix(u);
 	u_user_welcome(u);
 }
 
 u_user *u_user_by_nick_raw(const char *nick)
 {
-	return mowgli_patricia_retrieve(users_by_nick, nick);
+	return u_hash_get(users_by_nick, nick);
 }
 
 u_user *u_user_by_nick(const char *nick)
@@ -209,7 +356,7 @@ u_user *u_user_by_nick(const char *nick)
 
 u_user *u_user_by_uid_raw(const char *uid)
 {
-	return mowgli_patricia_retrieve(users_by_uid, uid);
+	return uid_find(uid);
 }
 
 u_user *u_user_by_uid(const char *nick)
@@ -245,12 +392,59 @@ char *u_user_modes(u_user *u)
 
 void u_user_set_nick(u_user *u, char *nick, uint ts)
 {
+	uint oldhash = u->nickhash;
+	bool had_nick = u->nick[0] != '\0';
+
 	/* TODO: check collision? */
-	if (u->nick[0])
-		mowgli_patricia_delete(users_by_nick, u->nick);
 	u_strlcpy(u->nick, nick, MAXNICKLEN+1);
-	mowgli_patricia_add(users_by_nick, u->nick, u);
+	u->nickhash = u_hash_key(users_by_nick, u->nick);
+	if (had_nick)
+		u_hash_rekey(users_by_nick, u, oldhash, u->nick, u->nickhash);
+	else
+		u_hash_add(users_by_nick, u->nick, u->nickhash, u);
 	u->nickts = ts;
+	u_user_update_prefix(u);
+}
+
+void u_user_set_away(u_user *u, char *away)
+{
+	size_t len = away ? strnlen(away, MAXAWAY) : 0;
+
+	free(u->away);
+	u->away = NULL;
+
+	if (len == 0)
+		return;
+
+	u->away = malloc(len + 1);
+	memcpy(u->away, away, len);
+	u->away[len] = '\0';
+}
+
+void u_user_update_prefix(u_user *u)
+{
+	size_t nick = strlen(u->nick);
+	size_t ident = u_istr_len(u->ident);
+	size_t host = u_istr_len(u->host);
+	u_chanuser *cu;
+	uint i;
+	char *p;
+
+	u->prefixlen = nick + ident + host + 2;
+	p = u->prefix = realloc(u->prefix, u->prefixlen + 1);
+
+	memcpy(p, u->nick, nick);
+	p += nick;
+	*p++ = '!';
+	memcpy(p, u->ident, ident);
+	p += ident;
+	*p++ = '@';
+	memcpy(p, u->host, host + 1);
+
+	/* cached ban and quiet results went by the old prefix */
+	u->ban_chan = NULL;
+	U_USER_EACH_CHAN(u, i, cu)
+		u_cookie_reset(&cu->ck_flags);
 }
 
 bool u_user_try_override(u_user *u)
@@ -262,8 +456,9 @@ bool u_user_try_override(u_user *u)
 		return false;
 
 	u_user_num(u, ERR_NICKNAMEINUSE, u->nick);
-	mowgli_patricia_delete(users_by_nick, u->nick);
+	u_hash_del(users_by_nick, u->nickhash, u);
 	u->nick[0] = '\0';
+	u_user_update_prefix(u);
 
 	return true;
 }
@@ -409,9 +604,7 @@ static int is_in_list(char *host, mowgli_list_t *list)
 
 int u_user_in_list(u_user *u, mowgli_list_t *list)
 {
-	char buf[512];
-	snf(FMT_USER, buf, 512, "%H", u);
-	return is_in_list(buf, list);
+	return is_in_list(u->prefix, list);
 }
 
 void u_user_make_euid(u_user *u, char *buf)
@@ -462,7 +655,7 @@ static int dump_specific_user(u_user *u, mowgli_json_t *j_users)
 	json_osets  (ju, "realhost", u->realhost);
 	json_osets  (ju, "host",     u->host);
 	json_osets  (ju, "gecos",    u->gecos);
-	json_osets  (ju, "away",     u->away);
+	json_osets  (ju, "away",     u->away ? u->away : "");
 	json_oseto  (ju, "limit",    u_ratelimit_to_json(&u->limit));
 	if (u->sv == &me) {
 		/* Local user. */
@@ -544,39 +737,45 @@ static int restore_specific_user(const char *uid, mowgli_json_t *ju)
 	memcpy(u->nick,     jsnick->str,     jsnick->pos);
 
 	jsacct = json_ogets(ju, "acct");
-	if (!jsacct || jsnick->pos > MAXACCOUNT)
+	if (!jsacct || jsacct->pos > MAXACCOUNT)
 		return -1;
-	memcpy(u->acct,     jsacct->str,     jsacct->pos);
+	u_istr_set(&u->acct,     jsacct->str,     jsacct->pos);
 
 	jsident = json_ogets(ju, "ident");
-	if (!jsident || jsnick->pos > MAXIDENT)
+	if (!jsident || jsident->pos > MAXIDENT)
 		return -1;
-	memcpy(u->ident,    jsident->str,    jsident->pos);
+	u_istr_set(&u->ident,    jsident->str,    jsident->pos);
 
 	jsip = json_ogets(ju, "ip");
 	if (!jsip || jsip->pos > INET6_ADDRSTRLEN)
 		return -1;
-	memcpy(u->ip,       jsip->str,       jsip->pos);
+	u_istr_set(&u->ip,       jsip->str,       jsip->pos);
 
 	jsrealhost = json_ogets(ju, "realhost");
 	if (!jsrealhost || jsrealhost->pos > MAXHOST)
 		return -1;
-	memcpy(u->realhost, jsrealhost->str, jsrealhost->pos);
+	u_istr_set(&u->realhost, jsrealhost->str, jsrealhost->pos);
 
 	jshost = json_ogets(ju, "host");
 	if (!jshost || jshost->pos > MAXHOST)
 		return -1;
-	memcpy(u->host,     jshost->str,     jshost->pos);
+	u_istr_set(&u->host,     jshost->str,     jshost->pos);
 
 	jsgecos = json_ogets(ju, "gecos");
 	if (!jsgecos || jsgecos->pos > MAXGECOS)
 		return -1;
-	memcpy(u->gecos,    jsgecos->str,    jsgecos->pos);
+	u_istr_set(&u->gecos,    jsgecos->str,    jsgecos->pos);
 
 	jsaway = json_ogets(ju, "away");
 	if (!jsaway || jsaway->pos > MAXAWAY)
 		return -1;
-	memcpy(u->away,     jsaway->str,     jsaway->pos);
+	if (jsaway->pos > 0) {
+		u->away = malloc(jsaway->pos + 1);
+		memcpy(u->away, jsaway->str, jsaway->pos);
+		u->away[jsaway->pos] = '\0';
+	}
+
+	u_user_update_prefix(u);
 
 	jlimit = json_ogeto(ju, "limit");
 	if (!jlimit)
@@ -610,7 +809,8 @@ static int restore_specific_user(const char *uid, mowgli_json_t *ju)
 		u->link = sv_via->link;
 	}
 
-	mowgli_patricia_add(users_by_nick, u->nick, u);
+	u->nickhash = u_hash_key(users_by_nick, u->nick);
+	u_hash_add(users_by_nick, u->nick, u->nickhash, u);
 
 	return 0;
 }
@@ -656,7 +856,7 @@ int restore_user(void)
  */
 int init_user(void)
 {
-	users_by_nick = mowgli_patricia_create(rfc1459_canonize);
+	users_by_nick = u_hash_new(rfc1459_casemap);
 	users_by_uid = mowgli_patricia_create(ascii_canonize);
 
 	if (!users_by_nick || !users_by_uid)
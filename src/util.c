@@ -164,9 +164,9 @@ unsigned long parse_size(char *s)
 #define CT_SID    004
 
 static uint ctype_map[256];
-static char null_casemap[256];
-static char rfc1459_casemap[256];
-static char ascii_casemap[256];
+char null_casemap[256];
+char rfc1459_casemap[256];
+char ascii_casemap[256];
 
 int matchmap(char *mask, char *string, char *casemap)
 {
@@ -0,0 +1,400 @@
+/* Tethys, verify.c -- password and challenge checks off the event loop
+   Copyright (C) 2014 Alex Iadicicco
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+#include "ircd.h"
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#ifdef HAVE_LIBCRYPTO
+#include <openssl/crypto.h>
+#endif
+
+#define VERIFY_THREADS 2
+
+struct job {
+	u_link *link; /* NULL once the link is gone */
+	u_verify_fn_t *fn;
+	u_verify_done_t *done;
+	void *priv;
+	int result;
+
+	struct job *next; /* in the pending or finished queue */
+	mowgli_node_t n; /* in the in-flight list */
+};
+
+/* main thread only */
+static mowgli_list_t inflight;
+
+static void complete(struct job *job)
+{
+	u_link *link = job->link;
+
+	mowgli_node_delete(&job->n, &inflight);
+
+	if (link != NULL) {
+		link->flags &= ~U_LINK_WAIT_VERIFY;
+
+		/* never dispatch from in here. the link's turn comes
+		   around with everyone else's */
+		if (link->flags & U_LINK_SENT_QUIT)
+			link = NULL;
+		else
+			u_conn_schedule(link->conn);
+	}
+
+	job->done(link, job->result, job->priv);
+	free(job);
+}
+
+#ifdef HAVE_PTHREAD
+
+/* the pool */
+/* -------- */
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t idle = PTHREAD_COND_INITIALIZER;
+
+/* all under lock */
+static struct job *pending, **pending_tail = &pending;
+static struct job *finished;
+static uint outstanding;
+
+static bool pool_started = false;
+static int wake[2] = { -1, -1 };
+static mowgli_eventloop_pollable_t *wake_poll;
+
+static void *worker(void *unused)
+{
+	struct job *job;
+	char c = 0;
+
+	for (;;) {
+		pthread_mutex_lock(&lock);
+		while (pending == NULL)
+			pthread_cond_wait(&work, &lock);
+		job = pending;
+		if ((pending = job->next) == NULL)
+			pending_tail = &pending;
+		pthread_mutex_unlock(&lock);
+
+		job->result = job->fn(job->priv);
+
+		pthread_mutex_lock(&lock);
+		job->next = finished;
+		finished = job;
+		if (--outstanding == 0)
+			pthread_cond_broadcast(&idle);
+		pthread_mutex_unlock(&lock);
+
+		/* if the pipe is full, there's a wakeup coming anyway */
+		if (write(wake[1], &c, 1) < 0 && errno != EAGAIN)
+			u_perror("verify: write");
+	}
+
+	return NULL;
+}
+
+/* takes the finished queue under lock, and completes it oldest first */
+static void complete_finished(void)
+{
+	struct job *job, *next, *list = NULL;
+
+	pthread_mutex_lock(&lock);
+	for (job = finished; job; job = next) {
+		next = job->next;
+		job->next = list;
+		list = job;
+	}
+	finished = NULL;
+	pthread_mutex_unlock(&lock);
+
+	for (job = list; job; job = next) {
+		next = job->next;
+		complete(job);
+	}
+}
+
+static void wake_ready(mowgli_eventloop_t *ev, mowgli_eventloop_io_t *io,
+                       mowgli_eventloop_io_dir_t dir, void *priv)
+{
+	char buf[64];
+
+	while (read(wake[0], buf, sizeof(buf)) > 0)
+		continue;
+
+	complete_finished();
+}
+
+#if defined(HAVE_LIBCRYPTO) && OPENSSL_VERSION_NUMBER < 0x10100000L
+
+/* challenge signatures are checked in here, and OpenSSL before 1.1
+   isn't safe to use from more than one thread unless it's given locks
+   and a way to tell threads apart. this has to happen before the
+   threads start, and is left alone if something else already did it */
+
+static pthread_mutex_t *ssl_locks;
+
+static void ssl_lock(int mode, int n, const char *file, int line)
+{
+	if (mode & CRYPTO_LOCK)
+		pthread_mutex_lock(ssl_locks + n);
+	else
+		pthread_mutex_unlock(ssl_locks + n);
+}
+
+static void ssl_thread_id(CRYPTO_THREADID *id)
+{
+	CRYPTO_THREADID_set_numeric(id, (ulong) pthread_self());
+}
+
+static void ssl_threads(void)
+{
+	int i, n;
+
+	if (CRYPTO_get_locking_callback() != NULL)
+		return;
+
+	n = CRYPTO_num_locks();
+	ssl_locks = malloc(n * sizeof(*ssl_locks));
+	for (i=0; i<n; i++)
+		pthread_mutex_init(ssl_locks + i, NULL);
+
+	CRYPTO_THREADID_set_callback(ssl_thread_id);
+	CRYPTO_set_locking_callback(ssl_lock);
+}
+
+#else
+
+/* 1.1 and later lock for themselves */
+static void ssl_threads(void)
+{
+}
+
+#endif
+
+static int set_nonblock(int fd)
+{
+	int flags;
+
+	if ((flags = fcntl(fd, F_GETFL)) < 0)
+		return -1;
+
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static bool start_pool(void)
+{
+	pthread_t thread;
+	sigset_t all, old;
+	int i, err = 0;
+
+	if (pipe(wake) < 0) {
+		u_perror("verify: pipe");
+		return false;
+	}
+
+	if (set_nonblock(wake[0]) < 0 || set_nonblock(wake[1]) < 0
+	    || set_cloexec(wake[0]) < 0 || set_cloexec(wake[1]) < 0) {
+		u_perror("verify: fcntl");
+		goto error;
+	}
+
+	if (!(wake_poll = mowgli_pollable_create(base_ev, wake[0], NULL))) {
+		u_log(LG_ERROR, "verify: could not create pollable");
+		goto error;
+	}
+
+	mowgli_pollable_setselect(base_ev, wake_poll,
+	                          MOWGLI_EVENTLOOP_IO_READ, wake_ready);
+
+	ssl_threads();
+
+	/* signals are for the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	for (i=0; i<VERIFY_THREADS; i++) {
+		if ((err = pthread_create(&thread, NULL, worker, NULL)) != 0)
+			break;
+		pthread_detach(thread);
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (i == 0) {
+		u_log(LG_ERROR, "verify: could not start threads: %s",
+		      strerror(err));
+		mowgli_pollable_destroy(base_ev, wake_poll);
+		goto error;
+	}
+
+	u_log(LG_VERBOSE, "verify: started %d threads", i);
+	return true;
+
+error:
+	close(wake[0]);
+	close(wake[1]);
+	wake[0] = wake[1] = -1;
+	return false;
+}
+
+static void submit(struct job *job)
+{
+	/* only try once. if there are no threads, everything runs in
+	   the event loop like it used to */
+	if (!pool_started) {
+		pool_started = true;
+		start_pool();
+	}
+
+	if (wake[0] < 0) {
+		job->result = job->fn(job->priv);
+		complete(job);
+		return;
+	}
+
+	if (job->link)
+		job->link->flags |= U_LINK_WAIT_VERIFY;
+
+	pthread_mutex_lock(&lock);
+	job->next = NULL;
+	*pending_tail = job;
+	pending_tail = &job->next;
+	outstanding++;
+	pthread_cond_signal(&work);
+	pthread_mutex_unlock(&lock);
+}
+
+void u_verify_finish_all(void)
+{
+	/* a callback could start another job, so keep going until
+	   there's nothing left at all */
+	while (inflight.count > 0) {
+		pthread_mutex_lock(&lock);
+		while (outstanding > 0)
+			pthread_cond_wait(&idle, &lock);
+		pthread_mutex_unlock(&lock);
+
+		complete_finished();
+	}
+}
+
+#else
+
+static void submit(struct job *job)
+{
+	job->result = job->fn(job->priv);
+	complete(job);
+}
+
+void u_verify_finish_all(void)
+{
+}
+
+#endif /* HAVE_PTHREAD */
+
+/* jobs */
+/* ---- */
+
+void u_verify_run(u_link *link, u_verify_fn_t *fn, u_verify_done_t *done,
+                  void *priv)
+{
+	struct job *job = malloc(sizeof(*job));
+
+	job->link = link;
+	job->fn = fn;
+	job->done = done;
+	job->priv = priv;
+	job->result = -1;
+
+	mowgli_node_add(job, &job->n, &inflight);
+
+	submit(job);
+}
+
+void u_verify_cancel(u_link *link)
+{
+	mowgli_node_t *n;
+	struct job *job;
+
+	if (!(link->flags & U_LINK_WAIT_VERIFY))
+		return;
+
+	MOWGLI_LIST_FOREACH(n, inflight.head) {
+		job = n->data;
+		if (job->link == link)
+			job->link = NULL;
+	}
+}
+
+struct pass_job {
+	char **hashes;
+	uint nhashes;
+	char *pass;
+
+	u_verify_done_t *done;
+	void *priv;
+};
+
+static int check_pass(void *priv)
+{
+	struct pass_job *pj = priv;
+	uint i;
+
+	for (i=0; i<pj->nhashes; i++) {
+		if (!pj->hashes[i] || u_crypto_check(pj->hashes[i], pj->pass))
+			return i;
+	}
+
+	return -1;
+}
+
+static void check_pass_done(u_link *link, int result, void *priv)
+{
+	struct pass_job *pj = priv;
+
+	pj->done(link, result, pj->priv);
+
+	memset(pj->pass, 0, strlen(pj->pass));
+	free(pj->pass);
+	free(pj->hashes);
+	free(pj);
+}
+
+void u_verify_pass(u_link *link, char **hashes, uint nhashes,
+                   const char *pass, u_verify_done_t *done, void *priv)
+{
+	struct pass_job *pj = malloc(sizeof(*pj));
+
+	pj->hashes = malloc(nhashes * sizeof(*hashes));
+	memcpy(pj->hashes, hashes, nhashes * sizeof(*hashes));
+	pj->nhashes = nhashes;
+	pj->pass = strdup(pass);
+	pj->done = done;
+	pj->priv = priv;
+
+	u_verify_run(link, check_pass, check_pass_done, pj);
+}
+
+/* callbacks can live in modules, so don't let one be unloaded while
+   there's a job that's going to call into it */
+static void *on_module_unload(void *unused, void *m)
+{
+	u_verify_finish_all();
+	return NULL;
+}
+
+int init_verify(void)
+{
+	u_hook_add(HOOK_MODULE_UNLOAD, on_module_unload, NULL);
+
+	return 0;
+}
+
+/* vim: set noet: */
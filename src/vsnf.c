@@ -178,11 +178,7 @@ top:
 		if (type == FMT_SERVER) {
 			string(&buf, user->uid, 9, NULL);
 		} else {
-			string(&buf, user->nick, -1, NULL);
-			character(&buf, '!');
-			string(&buf, user->ident, -1, NULL);
-			character(&buf, '@');
-			string(&buf, user->host, -1, NULL);
+			string(&buf, user->prefix, user->prefixlen, NULL);
 			if (debug) {
 				character(&buf, '[');
 				integer(&buf, (size_t)user, 0, 16, NULL);
@@ -206,7 +202,7 @@ top:
 		if (type == FMT_SERVER) {
 			string(&buf, server->sid, 3, NULL);
 		} else {
-			string(&buf, server->name, -1, &spec);
+			string(&buf, server->name, server->namelen, &spec);
 			if (debug) {
 				character(&buf, '[');
 				integer(&buf, (size_t)server, 0, 16, NULL);
@@ -242,13 +238,9 @@ top:
 			string(&buf, (char*)si->id, si->u ? 9 : 3, NULL);
 		} else {
 			if (si->u) {
-				string(&buf, si->u->nick, -1, NULL);
-				character(&buf, '!');
-				string(&buf, si->u->ident, -1, NULL);
-				character(&buf, '@');
-				string(&buf, si->u->host, -1, NULL);
+				string(&buf, si->u->prefix, si->u->prefixlen, NULL);
 			} else if (si->s) {
-				string(&buf, si->s->name, -1, &spec);
+				string(&buf, si->s->name, si->s->namelen, &spec);
 			} else {
 				string(&buf, "?", 1, NULL);
 			}
@@ -0,0 +1,202 @@
+/* Tethys, bench.c -- ban list benchmark
+   Copyright (C) 2014 Alex Iadicicco
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+#include "ircd.h"
+#include "../bench.h"
+
+/* Checks a join flood against a ban list the way a busy channel's might
+   look: mostly *!*@host and *!*@*.domain bans, some networks, and a few
+   nick and ident globs. Reports checks/sec for matching each mask in
+   turn, the way channels used to, and for the compiled list, and exits
+   non-zero if the two disagree about anyone. Pass the number of bans
+   as the argument, or nothing for 300. Extbans aren't generated, since they
+   need real channels and users behind them. */
+
+#define USERS 20000
+#define ROUNDS 20
+
+/* ban.c and util.c want these, but nothing here gets that far */
+u_chan *u_chan_get(char *s) { return NULL; }
+u_chanuser *u_chan_user_find(u_chan *c, u_user *u) { return NULL; }
+u_user *u_user_by_nick(const char *s) { return NULL; }
+u_user *u_user_by_uid(const char *s) { return NULL; }
+u_server *u_server_by_sid(const char *s) { return NULL; }
+u_server *u_server_by_name(const char *s) { return NULL; }
+void u_crypto_hash(char *buf, char *key, char *salt) { }
+
+static mowgli_list_t bans;
+static u_user *users;
+static uint nbans;
+
+static void add_ban(const char *fmt, uint i)
+{
+	u_listent *ban = calloc(1, sizeof(*ban));
+
+	snprintf(ban->mask, 256, fmt, i);
+	mowgli_node_add(ban, &ban->n, &bans);
+}
+
+static void generate(void)
+{
+	static const char *kinds[] = {
+		"*!*@host-%u.example.net",
+		"*!*@*.isp%u.example.org",
+		"*!*@10.%u.0.0/16",
+		"*!*@host-%u.example.net",
+		"spammer%u!*@*",
+		"*!*bot%u@*",
+		"*!*@*.dsl%u.*.example.com",
+		"*!*@host-%u.example.net",
+		"*!*@*.isp%u.example.org",
+		"*!*@2001:db8:%x::/48",
+	};
+	char buf[64];
+	u_user *u;
+	uint i;
+
+	for (i=0; i<nbans; i++)
+		add_ban(kinds[i % 10], i % 10 == 2 ? i % 256 : i);
+
+	users = calloc(USERS, sizeof(*users));
+	for (i=0; i<USERS; i++) {
+		u = users + i;
+
+		snprintf(u->nick, MAXNICKLEN+1, "%s%u",
+		         i % 7 ? "guest" : "spammer", i % 1000);
+
+		snprintf(buf, 64, "%s%u", i % 11 ? "user" : "bot", i % 1000);
+		u->ident = u_istr_get(buf, MAXIDENT);
+
+		switch (i % 4) {
+		case 0:
+			snprintf(buf, 64, "host-%u.example.net", i % 2000);
+			break;
+		case 1:
+			snprintf(buf, 64, "cpe-%u.isp%u.example.org", i, i % 500);
+			break;
+		case 2:
+			snprintf(buf, 64, "10.%u.%u.%u", i % 300 % 256, i % 251,
+			         i % 256);
+			break;
+		case 3:
+			snprintf(buf, 64, "2001:db8:%x::%x", i % 300, i);
+			break;
+		}
+		u->host = u_istr_get(buf, MAXHOST);
+		u->ip = u_istr_get(i % 4 >= 2 ? buf : "192.0.2.1",
+		                   INET6_ADDRSTRLEN - 1);
+
+		u->prefixlen = snprintf(buf, 64, "%s!%s@%s",
+		                        u->nick, u->ident, u->host);
+		u->prefix = strdup(buf);
+	}
+}
+
+static void report(const char *name, ulong ops, ulong hits, double secs)
+{
+	printf("%-10s %10lu checks  %8lu hits  %8.3fs  %12.0f checks/sec\n",
+	       name, ops, hits, secs, ops / secs);
+}
+
+static bool in_list(u_user *u)
+{
+	mowgli_node_t *n;
+	u_listent *ban;
+
+	MOWGLI_LIST_FOREACH(n, bans.head) {
+		ban = n->data;
+		if (match(ban->mask, u->prefix))
+			return true;
+	}
+
+	return false;
+}
+
+/* the networks a user's IP is in, which masks in turn never looked at */
+static bool in_networks(u_user *u)
+{
+	mowgli_node_t *n;
+	u_listent *ban;
+	u_cidr cidr;
+	char buf[256];
+	bool v6 = strchr(u->ip, ':') != NULL;
+
+	MOWGLI_LIST_FOREACH(n, bans.head) {
+		ban = n->data;
+		if (strncmp(ban->mask, "*!*@", 4) || !strchr(ban->mask, '/'))
+			continue;
+		u_strlcpy(buf, ban->mask + 4, 256);
+		if (!u_str_to_cidr(buf, &cidr))
+			continue;
+		if ((cidr.addr.ss_family == AF_INET6) != v6)
+			continue;
+		if (u_cidr_match(&cidr, u->ip))
+			return true;
+	}
+
+	return false;
+}
+
+int main(int argc, char *argv[])
+{
+	struct timeval start;
+	u_banlist *bl;
+	ulong hits;
+	uint i, r, cidr_only = 0, wrong = 0;
+
+	init_util();
+
+	nbans = argc > 1 ? strtoul(argv[1], NULL, 0) : 300;
+	generate();
+
+	printf("%u bans, %u users\n", nbans, USERS);
+
+	gettimeofday(&start, NULL);
+	for (hits=0, r=0; r<ROUNDS; r++) {
+		for (i=0; i<USERS; i++)
+			hits += in_list(users + i);
+	}
+	report("linear", (ulong) USERS * ROUNDS, hits, since(&start));
+
+	gettimeofday(&start, NULL);
+	for (r=0; r<ROUNDS; r++) {
+		bl = u_banlist_compile(&bans, r);
+		u_banlist_free(bl);
+	}
+	printf("%-10s %8.3fms per compile\n", "compile",
+	       since(&start) * 1000 / ROUNDS);
+
+	bl = u_banlist_compile(&bans, 0);
+
+	gettimeofday(&start, NULL);
+	for (hits=0, r=0; r<ROUNDS; r++) {
+		for (i=0; i<USERS; i++)
+			hits += u_banlist_match(bl, NULL, users + i);
+	}
+	report("compiled", (ulong) USERS * ROUNDS, hits, since(&start));
+
+	/* the compiled list matches networks against IPs as well, so it
+	   has to match exactly what masks in turn did plus those */
+	for (i=0; i<USERS; i++) {
+		bool old = in_list(users + i);
+		bool want = old || in_networks(users + i);
+		bool new = u_banlist_match(bl, NULL, users + i);
+
+		if (new != want) {
+			printf("!!! %s %s\n", users[i].prefix,
+			       new ? "matched wrongly" : "not matched");
+			wrong++;
+		}
+		if (new && !old)
+			cidr_only++;
+	}
+	printf("%u users only matched by network, %u wrong\n",
+	       cidr_only, wrong);
+
+	u_banlist_free(bl);
+
+	return wrong ? 1 : 0;
+}
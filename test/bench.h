@@ -0,0 +1,22 @@
+/* Tethys, bench.h -- timing for the benchmarks
+   Copyright (C) 2014 Alex Iadicicco
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+#ifndef __INC_TEST_BENCH_H__
+#define __INC_TEST_BENCH_H__
+
+#include <sys/time.h>
+
+/* seconds since start */
+static inline double since(struct timeval *start)
+{
+	struct timeval end;
+
+	gettimeofday(&end, NULL);
+	return (end.tv_sec - start->tv_sec)
+	     + (end.tv_usec - start->tv_usec) / 1e6;
+}
+
+#endif
@@ -0,0 +1,252 @@
+/* Tethys, cache.c -- reverse DNS cache against a stub resolver
+   Copyright (C) 2014 Alex Iadicicco
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+#include "ircd.h"
+
+/* Stands in for mowgli's resolver with a table of records. Queries are
+   held until answer_all() is called, like a real resolver that takes a
+   while, so coalescing can be seen. Prints a line per check and exits
+   non-zero if any fail. */
+
+struct timeval NOW;
+mowgli_dns_t *base_dns;
+
+void sync_time(void) { }
+
+/* util.c wants these, but nothing here gets that far */
+u_user *u_user_by_nick(const char *s) { return NULL; }
+u_user *u_user_by_uid(const char *s) { return NULL; }
+u_server *u_server_by_sid(const char *s) { return NULL; }
+u_server *u_server_by_name(const char *s) { return NULL; }
+void u_crypto_hash(char *buf, char *key, char *salt) { }
+
+/* the stub resolver */
+/* ----------------- */
+
+struct record {
+	const char *addr;
+	const char *name; /* NULL for NXDOMAIN */
+};
+
+static struct record ptrs[] = {
+	{ "192.0.2.1",    "nat.example.net" },
+	{ "192.0.2.2",    "liar.example.net" },
+	{ "192.0.2.3",    NULL },
+	{ "192.0.2.4",    ":evil.example.net" },
+	{ "2001:db8::1",  "six.example.net" },
+	{ "192.0.2.6",    "rr.example.net" },
+	{ NULL }
+};
+
+/* names with more than one address are answered with each in turn, the
+   way resolvers rotate them, and only the first is given back */
+static struct record fwds[] = {
+	{ "192.0.2.1",    "nat.example.net" },
+	{ "198.51.100.9", "liar.example.net" },
+	{ "2001:db8::1",  "six.example.net" },
+	{ "203.0.113.7",  "rr.example.net" },
+	{ "192.0.2.6",    "rr.example.net" },
+	{ NULL }
+};
+
+static uint rotate = 0;
+
+struct stub_query {
+	mowgli_dns_query_t *q;
+	char name[256];
+	struct sockaddr_storage addr;
+	int type; /* 0 for PTR */
+};
+
+static struct stub_query queries[64];
+static int nqueries, sent;
+
+void mowgli_dns_gethost_byaddr(mowgli_dns_t *dns,
+                               const struct sockaddr_storage *addr,
+                               mowgli_dns_query_t *q)
+{
+	struct stub_query *sq = queries + nqueries++;
+
+	sq->q = q;
+	sq->type = 0;
+	memcpy(&sq->addr, addr, sizeof(*addr));
+	sent++;
+}
+
+void mowgli_dns_gethost_byname(mowgli_dns_t *dns, const char *name,
+                               mowgli_dns_query_t *q, int type)
+{
+	struct stub_query *sq = queries + nqueries++;
+
+	sq->q = q;
+	sq->type = type;
+	u_strlcpy(sq->name, name, sizeof(sq->name));
+	sent++;
+}
+
+static void answer(struct stub_query *sq)
+{
+	mowgli_dns_reply_t reply;
+	struct record *r;
+	char ip[INET6_ADDRSTRLEN+1];
+	socklen_t len = sizeof(reply.addr.addr);
+
+	memset(&reply, 0, sizeof(reply));
+
+	if (sq->type == 0) {
+		u_ntop((struct sockaddr*) &sq->addr, ip);
+		for (r=ptrs; r->addr && strcmp(r->addr, ip); r++);
+		if (!r->addr || !r->name) {
+			sq->q->callback(NULL, MOWGLI_DNS_RES_NXDOMAIN,
+			                sq->q->ptr);
+			return;
+		}
+		reply.h_name = (char*) r->name;
+		memcpy(&reply.addr.addr, &sq->addr, sizeof(sq->addr));
+	} else {
+		struct record *match[4];
+		int n = 0;
+
+		for (r=fwds; r->addr; r++) {
+			if (!strcmp(r->name, sq->name)
+			    && !!strchr(r->addr, ':')
+			       == (sq->type == MOWGLI_DNS_T_AAAA))
+				match[n++] = r;
+		}
+		if (n == 0) {
+			sq->q->callback(NULL, MOWGLI_DNS_RES_NXDOMAIN,
+			                sq->q->ptr);
+			return;
+		}
+		r = match[rotate++ % n];
+		reply.h_name = sq->name;
+		u_pton(r->addr, (struct sockaddr*) &reply.addr.addr, &len);
+	}
+
+	sq->q->callback(&reply, MOWGLI_DNS_RES_SUCCESS, sq->q->ptr);
+}
+
+/* answering a PTR query sends a forward one, so keep going until
+   everything's been answered */
+static void answer_all(void)
+{
+	struct stub_query sq;
+
+	while (nqueries > 0) {
+		sq = queries[0];
+		memmove(queries, queries + 1, --nqueries * sizeof(*queries));
+		answer(&sq);
+	}
+}
+
+/* the tests */
+/* --------- */
+
+struct result {
+	int calls;
+	char host[256];
+	const char *err;
+};
+
+static int failures = 0;
+
+static void check(bool ok, const char *what)
+{
+	printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+	if (!ok)
+		failures++;
+}
+
+static void got(const char *host, const char *err, void *priv)
+{
+	struct result *res = priv;
+
+	res->calls++;
+	u_strlcpy(res->host, host ? host : "", sizeof(res->host));
+	res->err = err;
+}
+
+static u_dns_req *lookup(const char *ip, struct result *res)
+{
+	struct sockaddr_storage ss;
+	socklen_t len = sizeof(ss);
+
+	memset(res, 0, sizeof(*res));
+	u_pton(ip, (struct sockaddr*) &ss, &len);
+	return u_dns_rdns((struct sockaddr*) &ss, got, res);
+}
+
+int main(int argc, char *argv[])
+{
+	struct result a, b, c;
+	u_dns_req *req;
+	u_dns_stats st;
+
+	init_util();
+	gettimeofday(&NOW, NULL);
+
+	lookup("192.0.2.1", &a);
+	lookup("192.0.2.1", &b);
+	lookup("::ffff:192.0.2.1", &c);
+	check(sent == 1, "lookups for one address share a query");
+	check(a.calls == 0, "nothing answered before the resolver is");
+	answer_all();
+	check(sent == 2, "the name is looked up forwards");
+	check(a.calls == 1 && b.calls == 1 && c.calls == 1,
+	      "everyone waiting is answered");
+	check(!strcmp(a.host, "nat.example.net") && !strcmp(c.host, a.host),
+	      "confirmed name is used");
+
+	sent = 0;
+	req = lookup("192.0.2.1", &a);
+	check(req == NULL && a.calls == 1 && sent == 0,
+	      "cached name is answered straight away");
+
+	lookup("192.0.2.2", &a);
+	answer_all();
+	check(a.host[0] == '\0' && a.err != NULL,
+	      "name that doesn't resolve back is refused");
+
+	lookup("192.0.2.3", &a);
+	answer_all();
+	sent = 0;
+	lookup("192.0.2.3", &b);
+	check(sent == 0 && b.calls == 1 && b.err != NULL,
+	      "failures are cached too");
+
+	lookup("192.0.2.4", &a);
+	answer_all();
+	check(a.host[0] == '\0', "names that could break lines are refused");
+
+	lookup("2001:db8::1", &a);
+	answer_all();
+	check(!strcmp(a.host, "six.example.net"), "IPv6 is looked up");
+
+	rotate = 0;
+	lookup("192.0.2.6", &a);
+	answer_all();
+	check(!strcmp(a.host, "rr.example.net"),
+	      "names with several addresses are confirmed");
+
+	req = lookup("192.0.2.5", &a);
+	u_dns_cancel(req);
+	answer_all();
+	check(a.calls == 0, "cancelled lookups aren't answered");
+
+	NOW.tv_sec += 7200;
+	sent = 0;
+	lookup("192.0.2.1", &a);
+	check(sent == 1 && a.calls == 0, "stale answers are looked up again");
+	answer_all();
+
+	u_dns_get_stats(&st);
+	printf("%lu hits, %lu coalesced, %lu misses, %lu cached, "
+	       "%lu in progress\n", st.hits, st.coalesced, st.misses,
+	       st.entries, st.pending);
+	check(st.pending == 0, "nothing left in progress");
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,171 @@
+/* Tethys, bench.c -- nick lookup benchmark
+   Copyright (C) 2014 Alex Iadicicco
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+#include "ircd.h"
+#include "../bench.h"
+
+/* Fills a u_hash and a patricia tree with the same nicks, the way
+   users_by_nick used to be set up, and reports lookups/sec for each
+   with the keys given back in a different case. Pass the number of
+   nicks as the argument, or nothing for 1M. Exits non-zero if either
+   misses a nick. */
+
+#define ROUNDS 4
+
+char rfc1459_casemap[256];
+
+static char (*nicks)[MAXNICKLEN+1];
+static char (*probes)[MAXNICKLEN+1];
+static uint n;
+static int failures = 0;
+
+static void casemap_init(void)
+{
+	int i;
+
+	for (i=0; i<256; i++)
+		rfc1459_casemap[i] = islower(i) ? toupper(i) : i;
+
+	rfc1459_casemap['['] = '{';
+	rfc1459_casemap[']'] = '}';
+	rfc1459_casemap['\\'] = '|';
+	rfc1459_casemap['~'] = '^';
+}
+
+static void canonize(char *s)
+{
+	for (; *s; s++)
+		*s = rfc1459_casemap[(uchar)*s];
+}
+
+static void generate(void)
+{
+	static const char *pre[] = { "nick", "Guest", "[away]", "bot|", "x" };
+	uint i, j, k;
+	char *p;
+
+	nicks = malloc(n * sizeof(*nicks));
+	probes = malloc(n * sizeof(*probes));
+
+	for (i=0; i<n; i++) {
+		snprintf(nicks[i], MAXNICKLEN+1, "%s%u", pre[i % 5], i);
+
+		/* swap the case of every letter, and []\~ for {}|^ */
+		for (p=nicks[i], j=0; *p; p++, j++) {
+			if (isalpha(*p))
+				probes[i][j] = islower(*p) ? toupper(*p) : tolower(*p);
+			else if (strchr("[]\\~", *p))
+				probes[i][j] = rfc1459_casemap[(uchar)*p];
+			else
+				probes[i][j] = *p;
+		}
+		probes[i][j] = '\0';
+	}
+
+	/* look them up in a different order than they went in */
+	srand(1);
+	for (i=n; i-->1;) {
+		char tmp[MAXNICKLEN+1];
+
+		k = rand() % (i + 1);
+		memcpy(tmp, probes[i], sizeof(tmp));
+		memcpy(probes[i], probes[k], sizeof(tmp));
+		memcpy(probes[k], tmp, sizeof(tmp));
+	}
+}
+
+static void report(const char *name, const char *what, ulong ops, double secs)
+{
+	printf("%-10s %-8s %10lu ops  %8.3fs  %12.0f ops/sec\n", name, what,
+	       ops, secs, ops / secs);
+}
+
+static void bench_hash(void)
+{
+	struct timeval start;
+	u_hash *h;
+	uint i, r, *hashes;
+	ulong found = 0;
+
+	h = u_hash_new(rfc1459_casemap);
+	hashes = malloc(n * sizeof(*hashes));
+
+	gettimeofday(&start, NULL);
+	for (i=0; i<n; i++) {
+		hashes[i] = u_hash_key(h, nicks[i]);
+		u_hash_add(h, nicks[i], hashes[i], nicks[i]);
+	}
+	report("u_hash", "insert", n, since(&start));
+
+	gettimeofday(&start, NULL);
+	for (r=0; r<ROUNDS; r++) {
+		for (i=0; i<n; i++)
+			found += u_hash_get(h, probes[i]) != NULL;
+	}
+	report("u_hash", "lookup", (ulong) n * ROUNDS, since(&start));
+
+	if (found != (ulong) n * ROUNDS) {
+		printf("!!! u_hash found %lu of %lu\n", found, (ulong) n * ROUNDS);
+		failures++;
+	}
+
+	gettimeofday(&start, NULL);
+	for (i=0; i<n; i++)
+		u_hash_del(h, hashes[i], nicks[i]);
+	report("u_hash", "delete", n, since(&start));
+
+	u_hash_free(h);
+	free(hashes);
+}
+
+static void bench_patricia(void)
+{
+	struct timeval start;
+	mowgli_patricia_t *p;
+	uint i, r;
+	ulong found = 0;
+
+	p = mowgli_patricia_create(canonize);
+
+	gettimeofday(&start, NULL);
+	for (i=0; i<n; i++)
+		mowgli_patricia_add(p, nicks[i], nicks[i]);
+	report("patricia", "insert", n, since(&start));
+
+	gettimeofday(&start, NULL);
+	for (r=0; r<ROUNDS; r++) {
+		for (i=0; i<n; i++)
+			found += mowgli_patricia_retrieve(p, probes[i]) != NULL;
+	}
+	report("patricia", "lookup", (ulong) n * ROUNDS, since(&start));
+
+	if (found != (ulong) n * ROUNDS) {
+		printf("!!! patricia found %lu of %lu\n", found, (ulong) n * ROUNDS);
+		failures++;
+	}
+
+	gettimeofday(&start, NULL);
+	for (i=0; i<n; i++)
+		mowgli_patricia_delete(p, nicks[i]);
+	report("patricia", "delete", n, since(&start));
+
+	mowgli_patricia_destroy(p, NULL, NULL);
+}
+
+int main(int argc, char *argv[])
+{
+	n = argc > 1 ? strtoul(argv[1], NULL, 0) : 1000000;
+
+	casemap_init();
+	generate();
+
+	printf("%u nicks\n", n);
+
+	bench_hash();
+	bench_patricia();
+
+	return failures ? 1 : 0;
+}
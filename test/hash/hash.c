@@ -0,0 +1,171 @@
+/* Tethys, hash.c -- u_hash tests
+   Copyright (C) 2014 Alex Iadicicco
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+#include "ircd.h"
+
+/* Checks adding, deleting and renaming against a plain array of what
+   should be in the table, including the order iteration gives things
+   back in, and that adding and deleting for a long time doesn't make
+   the table grow. Prints a line per check and exits non-zero if any
+   fail. */
+
+char rfc1459_casemap[256];
+
+struct obj {
+	char name[32];
+	uint hash;
+	bool in;
+};
+
+#define OBJS 2000
+
+static struct obj objs[OBJS];
+static int failures = 0;
+
+static void check(bool ok, const char *what)
+{
+	printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+	if (!ok)
+		failures++;
+}
+
+static void casemap_init(void)
+{
+	int i;
+
+	for (i=0; i<256; i++)
+		rfc1459_casemap[i] = islower(i) ? toupper(i) : i;
+
+	rfc1459_casemap['['] = '{';
+	rfc1459_casemap[']'] = '}';
+	rfc1459_casemap['\\'] = '|';
+	rfc1459_casemap['~'] = '^';
+}
+
+static void add(u_hash *h, struct obj *o, const char *fmt, uint i)
+{
+	snprintf(o->name, sizeof(o->name), fmt, i);
+	o->hash = u_hash_key(h, o->name);
+	o->in = true;
+	u_hash_add(h, o->name, o->hash, o);
+}
+
+static void del(u_hash *h, struct obj *o)
+{
+	u_hash_del(h, o->hash, o);
+	o->in = false;
+}
+
+/* everything that's in is found, by a key in another case, and nothing
+   else is */
+static bool all_found(u_hash *h)
+{
+	char key[32], *p;
+	uint i;
+
+	for (i=0; i<OBJS; i++) {
+		if (!objs[i].name[0])
+			continue;
+
+		strcpy(key, objs[i].name);
+		for (p=key; *p; p++)
+			*p = islower(*p) ? toupper(*p) : tolower(*p);
+
+		if ((u_hash_get(h, key) == objs + i) != objs[i].in)
+			return false;
+	}
+
+	return true;
+}
+
+/* iteration gives back what's in, in the order given */
+static bool order_is(u_hash *h, struct obj **want, uint n)
+{
+	struct obj *o;
+	uint pos, i = 0;
+
+	U_HASH_EACH(h, pos, &o) {
+		if (i >= n || o != want[i++])
+			return false;
+	}
+
+	return i == n && h->size == n;
+}
+
+int main(int argc, char *argv[])
+{
+	struct obj *want[OBJS], *o;
+	uint i, n, pos, maxents;
+	u_hash *h;
+
+	casemap_init();
+	h = u_hash_new(rfc1459_casemap);
+
+	for (i=0; i<1000; i++)
+		add(h, objs + i, "nick[%u]", i);
+	check(h->size == 1000 && all_found(h), "added objects are found");
+
+	for (i=0; i<1000; i++)
+		want[i] = objs + i;
+	check(order_is(h, want, 1000), "iteration is in insertion order");
+
+	check(u_hash_get(h, "NICK{5}") == objs + 5, "keys are case-folded");
+	check(u_hash_get(h, "nick[1000]") == NULL, "missing keys aren't found");
+
+	for (i=0; i<1000; i+=3)
+		del(h, objs + i);
+	for (i=0, n=0; i<1000; i++) {
+		if (objs[i].in)
+			want[n++] = objs + i;
+	}
+	check(all_found(h), "deleted objects aren't found");
+	check(order_is(h, want, n), "deleting keeps the order");
+
+	/* deleting during iteration is allowed */
+	U_HASH_EACH(h, pos, &o) {
+		if (o - objs < 500)
+			del(h, o);
+	}
+	for (i=0, n=0; i<1000; i++) {
+		if (objs[i].in)
+			want[n++] = objs + i;
+	}
+	check(all_found(h) && order_is(h, want, n),
+	      "deleting while iterating");
+
+	for (i=500; i<1000; i+=2) {
+		uint old = objs[i].hash;
+
+		if (!objs[i].in)
+			continue;
+		snprintf(objs[i].name, sizeof(objs[i].name), "renamed%u", i);
+		objs[i].hash = u_hash_key(h, objs[i].name);
+		u_hash_rekey(h, objs + i, old, objs[i].name, objs[i].hash);
+	}
+	check(all_found(h), "renamed objects are found by their new keys");
+	check(u_hash_get(h, "nick[502]") == NULL,
+	      "renamed objects aren't found by their old keys");
+	check(order_is(h, want, n), "renaming keeps the order");
+
+	/* connect and quit for a long time with about the same number of
+	   objects in the table */
+	maxents = 0;
+	for (i=0; i<200000; i++) {
+		o = objs + 1000 + i % 1000;
+		if (o->in)
+			del(h, o);
+		add(h, o, "churn%u", i);
+		if (h->maxents > maxents)
+			maxents = h->maxents;
+	}
+	check(h->nents <= 2 * h->size + 17, "holes are squeezed out");
+	check(maxents <= 4 * h->size, "churn doesn't grow the table");
+	check(all_found(h), "everything is found after churn");
+
+	u_hash_free(h);
+
+	return failures ? 1 : 0;
+}
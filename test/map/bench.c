@@ -0,0 +1,110 @@
+/* Tethys, bench.c -- u_map benchmark
+   Copyright (C) 2014 Alex Iadicicco
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+#include "ircd.h"
+#include "../bench.h"
+
+/* Builds pointer-keyed maps of a few sizes, the way invites and
+   per-channel link counts use them, and reports ops/sec for insertion,
+   lookup, iteration and deletion. Each size works through about the
+   same number of operations, so small maps are built many times over.
+   Pass the total number of keys per size as the argument, or nothing
+   for 1M. Exits non-zero if anything goes missing. */
+
+static void **keys;
+static ulong n;
+static int failures = 0;
+
+static void report(uint size, const char *what, ulong ops, double secs)
+{
+	printf("%7u keys  %-8s %10lu ops  %8.3fs  %12.0f ops/sec\n", size,
+	       what, ops, secs, ops / secs);
+}
+
+/* maps are worked on in batches, so small ones aren't all timer calls */
+#define BATCH 4096
+
+static void bench(uint size)
+{
+	static u_map *maps[BATCH];
+	struct timeval start;
+	double t_set = 0, t_get = 0, t_each = 0, t_del = 0;
+	u_map_each_state st;
+	ulong i, j, m, nmaps, base, found = 0, seen = 0;
+	void **kp, *k;
+
+	nmaps = n / size;
+
+	for (base=0; base<nmaps; base+=m) {
+		m = nmaps - base < BATCH ? nmaps - base : BATCH;
+		kp = keys + base * size;
+
+		for (j=0; j<m; j++)
+			maps[j] = u_map_new(0);
+
+		gettimeofday(&start, NULL);
+		for (j=0; j<m; j++) {
+			for (i=0; i<size; i++)
+				u_map_set(maps[j], kp[j*size+i], kp[j*size+i]);
+		}
+		t_set += since(&start);
+
+		gettimeofday(&start, NULL);
+		for (j=0; j<m; j++) {
+			for (i=size; i-->0;)
+				found += u_map_get(maps[j], kp[j*size+i]) != NULL;
+		}
+		t_get += since(&start);
+
+		gettimeofday(&start, NULL);
+		for (j=0; j<m; j++) {
+			U_MAP_EACH(&st, maps[j], &k, NULL)
+				seen++;
+		}
+		t_each += since(&start);
+
+		gettimeofday(&start, NULL);
+		for (j=0; j<m; j++) {
+			for (i=0; i<size; i++)
+				u_map_del(maps[j], kp[j*size+i]);
+		}
+		t_del += since(&start);
+
+		for (j=0; j<m; j++)
+			u_map_free(maps[j]);
+	}
+
+	report(size, "insert", nmaps * size, t_set);
+	report(size, "lookup", nmaps * size, t_get);
+	report(size, "iterate", nmaps * size, t_each);
+	report(size, "delete", nmaps * size, t_del);
+
+	if (found != nmaps * size || seen != nmaps * size) {
+		printf("!!! found %lu, saw %lu of %lu\n", found, seen, nmaps * size);
+		failures++;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	static uint sizes[] = { 2, 8, 9, 64, 1000, 100000 };
+	ulong i;
+
+	n = argc > 1 ? strtoul(argv[1], NULL, 0) : 1000000;
+
+	/* keys are what u_map usually holds: pointers to separately
+	   allocated objects */
+	keys = malloc(n * sizeof(*keys));
+	for (i=0; i<n; i++)
+		keys[i] = malloc(64);
+
+	for (i=0; i<sizeof(sizes)/sizeof(*sizes); i++) {
+		if (sizes[i] <= n)
+			bench(sizes[i]);
+	}
+
+	return failures ? 1 : 0;
+}
@@ -4,9 +4,38 @@
 
 u_map *map;
 
+/* maps don't keep their keys in order, so dumps are sorted here to
+   match the expected output */
+static char *lines[65536];
+static int nlines;
+
+static int line_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char**)a, *(char**)b);
+}
+
+static void add_line(void *k, void *v)
+{
+	char buf[LINESIZE];
+	snprintf(buf, LINESIZE, "%s=%s", (char*)k, (char*)v);
+	lines[nlines++] = strdup(buf);
+}
+
+static void put_lines(void)
+{
+	int i;
+
+	qsort(lines, nlines, sizeof(*lines), line_cmp);
+	for (i=0; i<nlines; i++) {
+		puts(lines[i]);
+		free(lines[i]);
+	}
+	nlines = 0;
+}
+
 static void do_dump(u_map *map, void *k, void *v, void *priv)
 {
-	printf("%s=%s\n", k, v);
+	add_line(k, v);
 }
 
 int main(int argc, char *argv[])
@@ -36,6 +65,7 @@ int main(int argc, char *argv[])
 
 		case 'd': /* dump */
 			u_map_each(map, do_dump, NULL);
+			put_lines();
 			break;
 
 		case 'D': { /* dump 2 */
@@ -43,8 +73,35 @@ int main(int argc, char *argv[])
 			char *k;
 			void *v;
 
-			U_MAP_EACH(&state, map, k, v)
-				printf("%s=%s\n", k, v);
+			U_MAP_EACH(&state, map, &k, &v)
+				add_line(k, v);
+			put_lines();
+			break;
+		}
+
+		case 'X': { /* delete everything while iterating */
+			u_map_each_state state;
+			char *k;
+			void *v;
+
+			U_MAP_EACH(&state, map, &k, &v) {
+				add_line(k, v);
+				free(u_map_del(map, k));
+			}
+			put_lines();
+			break;
+		}
+
+		case 'N': { /* nested iteration */
+			u_map_each_state outer, inner;
+			char *k1, *k2;
+			int n = 0;
+
+			U_MAP_EACH(&outer, map, &k1, NULL) {
+				U_MAP_EACH(&inner, map, &k2, NULL)
+					n++;
+			}
+			printf("%d\n", n);
 			break;
 		}
 
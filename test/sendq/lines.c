@@ -0,0 +1,137 @@
+/* Tethys, lines.c -- shared sendq lines and the sendq budget
+   Copyright (C) 2014 Alex Iadicicco
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+#include "ircd.h"
+#include <fcntl.h>
+
+/* Queues one shared line on a number of send queues and drains them
+   into /dev/null one at a time, checking the line is only counted once
+   and only goes away with the last queue. Then fills queues up to the
+   budget, with and without exemption. Prints a line per check and exits
+   non-zero if any fail. */
+
+struct timeval NOW;
+
+/* the json dump isn't tested here */
+size_t base64_encode(const void *in, size_t len, char *out, char *cur)
+{
+	return 0;
+}
+
+size_t base64_decode(const char *in, size_t len, void *out)
+{
+	return 0;
+}
+
+#define QUEUES 100
+
+static int failures = 0;
+
+static void check(bool ok, const char *what)
+{
+	printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+	if (!ok)
+		failures++;
+}
+
+static size_t mem(void)
+{
+	u_sendq_stats st;
+
+	u_sendq_get_stats(&st);
+	return st.mem;
+}
+
+static ulong denied(void)
+{
+	u_sendq_stats st;
+
+	u_sendq_get_stats(&st);
+	return st.denied;
+}
+
+static void test_shared(int devnull)
+{
+	u_sendq q[QUEUES];
+	u_sendq_line *line;
+	size_t one, all;
+	bool ok = true;
+	int i;
+
+	/* long enough that counting it per queue would stand out over
+	   the chunk headers */
+	line = u_sendq_line_new(512);
+	memset(line->data, 'x', 400);
+	memcpy(line->data, ":0AAAAAAAA PRIVMSG #busy :", 26);
+	memcpy(line->data + 398, "\r\n", 2);
+	line->len = 400;
+	one = mem();
+
+	for (i=0; i<QUEUES; i++) {
+		u_sendq_init(&q[i]);
+		if (u_sendq_put_line(&q[i], line) != line->len)
+			ok = false;
+	}
+	check(ok, "line is queued everywhere");
+	check(line->refs == QUEUES + 1, "each queue holds a reference");
+
+	all = mem();
+	check(all - one < QUEUES * line->len / 2, "line is counted once");
+
+	u_sendq_line_unref(line);
+
+	for (i=0; i<QUEUES-1; i++)
+		u_sendq_write(&q[i], devnull);
+	check(line->refs == 1 && mem() >= 512,
+	      "line outlives all but the last queue");
+
+	u_sendq_write(&q[QUEUES-1], devnull);
+	check(mem() == 0, "memory is all given back");
+}
+
+static void test_budget(void)
+{
+	static uchar data[64 << 10];
+	u_sendq q, srv;
+	size_t sz;
+
+	u_sendq_set_budget(100 << 10);
+
+	u_sendq_init(&q);
+	sz = u_sendq_put(&q, data, sizeof(data));
+	sz += u_sendq_put(&q, data, sizeof(data));
+	check(sz < 2 * sizeof(data) && denied() > 0,
+	      "queue is refused at the budget");
+	check(u_sendq_get_buffer(&q, 512) == NULL,
+	      "no more buffers past the budget");
+
+	u_sendq_init(&srv);
+	srv.exempt = true;
+	sz = u_sendq_put(&srv, data, sizeof(data));
+	check(sz == sizeof(data), "exempt queue goes past the budget");
+	check(mem() > 100 << 10, "exempt queue still counts");
+
+	u_sendq_clear(&srv);
+	check(srv.exempt, "exemption survives a clear");
+
+	u_sendq_clear(&q);
+	check(mem() == 0, "memory is all given back");
+	check(u_sendq_put(&q, data, 512) == 512,
+	      "queue can be used again under the budget");
+	u_sendq_clear(&q);
+
+	u_sendq_set_budget(0);
+}
+
+int main(int argc, char *argv[])
+{
+	int devnull = open("/dev/null", O_WRONLY);
+
+	test_shared(devnull);
+	test_budget();
+
+	return failures ? 1 : 0;
+}
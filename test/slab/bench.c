@@ -0,0 +1,151 @@
+/* Tethys, bench.c -- netsplit churn benchmark
+   Copyright (C) 2014 Alex Iadicicco
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+#include "ircd.h"
+#include "../bench.h"
+
+/* Replays netsplits and rejoins with objects the size of the real
+   ones: each user gets a map and a few chanusers, and a short string
+   from malloc that outlives the split, the way a hostname or away
+   message would. Every round, the users behind one of four servers
+   split off and burst back in. Reports the time per round and RSS for
+   plain malloc and for slabs. Pass the number of users as the
+   argument, or nothing for 200k. Exits non-zero if the slab counters
+   are off afterwards, or pages weren't given back. */
+
+#define ROUNDS 8
+#define SERVERS 4
+#define CHANS 5
+
+static u_slab user_slab = U_SLAB_INIT("users", u_user);
+static u_slab map_slab = U_SLAB_INIT("maps", u_map);
+static u_slab cu_slab = U_SLAB_INIT("chanusers", u_chanuser);
+
+struct fake_user {
+	void *u, *map, *cu[CHANS];
+	char *str;
+};
+
+static struct fake_user *users;
+static uint n;
+static int failures = 0;
+
+static void *get(bool slab, u_slab *s)
+{
+	return slab ? u_slab_alloc(s) : calloc(1, s->size);
+}
+
+static void put(bool slab, u_slab *s, void *p)
+{
+	if (slab)
+		u_slab_free(s, p);
+	else
+		free(p);
+}
+
+static void make(bool slab, struct fake_user *fu)
+{
+	int i;
+
+	fu->u = get(slab, &user_slab);
+	fu->map = get(slab, &map_slab);
+	for (i=0; i<CHANS; i++)
+		fu->cu[i] = get(slab, &cu_slab);
+	fu->str = malloc(24);
+}
+
+static void drop(bool slab, struct fake_user *fu)
+{
+	int i;
+
+	for (i=0; i<CHANS; i++)
+		put(slab, &cu_slab, fu->cu[i]);
+	put(slab, &map_slab, fu->map);
+	put(slab, &user_slab, fu->u);
+	free(fu->str);
+}
+
+static ulong rss_kb(void)
+{
+	FILE *f = fopen("/proc/self/statm", "r");
+	ulong size, rss = 0;
+
+	if (f == NULL)
+		return 0;
+	if (fscanf(f, "%lu %lu", &size, &rss) != 2)
+		rss = 0;
+	fclose(f);
+
+	return rss * (sysconf(_SC_PAGESIZE) >> 10);
+}
+
+/* everything's been freed, so only the spare page should be left */
+static void check_gone(u_slab *s, uint each)
+{
+	if (s->live == 0 && s->peak == (ulong) n * each && s->pages == 1)
+		return;
+
+	printf("!!! %s: %lu live, %lu peak, %lu pages\n", s->name, s->live,
+	       s->peak, s->pages);
+	failures++;
+}
+
+static void run(bool slab)
+{
+	const char *name = slab ? "slab" : "malloc";
+	struct timeval start;
+	ulong base = rss_kb();
+	uint i, r, sv;
+
+	gettimeofday(&start, NULL);
+	for (i=0; i<n; i++)
+		make(slab, users + i);
+	printf("%-6s burst   %8.3fs  rss +%luk\n", name, since(&start),
+	       rss_kb() - base);
+
+	for (r=0; r<ROUNDS; r++) {
+		sv = r % SERVERS;
+
+		gettimeofday(&start, NULL);
+		for (i=sv; i<n; i+=SERVERS)
+			drop(slab, users + i);
+		for (i=sv; i<n; i+=SERVERS)
+			make(slab, users + i);
+		printf("%-6s round %u %8.3fs  rss +%luk\n", name, r,
+		       since(&start), rss_kb() - base);
+	}
+
+	for (i=0; i<n; i++)
+		drop(slab, users + i);
+	printf("%-6s gone            rss +%luk\n", name, rss_kb() - base);
+
+	if (slab) {
+		check_gone(&user_slab, 1);
+		check_gone(&map_slab, 1);
+		check_gone(&cu_slab, CHANS);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	n = argc > 1 ? strtoul(argv[1], NULL, 0) : 200000;
+	users = calloc(n, sizeof(*users));
+
+	printf("%u users, %u/%u/%u byte user/map/chanuser\n", n,
+	       (uint) sizeof(u_user), (uint) sizeof(u_map),
+	       (uint) sizeof(u_chanuser));
+
+	if (argc > 2 && !strcmp(argv[2], "slab")) {
+		run(true);
+	} else if (argc > 2 && !strcmp(argv[2], "malloc")) {
+		run(false);
+	} else {
+		run(false);
+		run(true);
+	}
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,126 @@
+/* Tethys, slab.c -- slab tests
+   Copyright (C) 2014 Alex Iadicicco
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+#include "ircd.h"
+
+/* Checks the counters STATS z shows as objects come and go, and that
+   pages are given back to the system once they're empty, apart from a
+   single spare. Prints a line per check and exits non-zero if any
+   fail. */
+
+struct obj {
+	char name[40];
+	ulong n;
+};
+
+struct line_obj {
+	char c;
+};
+
+static u_slab obj_slab = U_SLAB_INIT("objs", struct obj);
+static u_slab line_slab = U_SLAB_INIT_ALIGNED("lines", struct line_obj, 64);
+
+#define OBJS 10000
+
+#define PAGE_OF(P) ((void*) ((uintptr_t) (P) & ~(uintptr_t) (U_SLAB_PAGE - 1)))
+
+static struct obj *objs[OBJS];
+static int failures = 0;
+
+static void check(bool ok, const char *what)
+{
+	printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+	if (!ok)
+		failures++;
+}
+
+/* msync fails with ENOMEM for addresses that aren't mapped */
+static bool mapped(void *p)
+{
+	uintptr_t pg = (uintptr_t) p & ~(uintptr_t) (sysconf(_SC_PAGESIZE) - 1);
+
+	return msync((void*) pg, 1, MS_ASYNC) == 0 || errno != ENOMEM;
+}
+
+static bool zeroed(void *p, size_t sz)
+{
+	uchar *s = p;
+
+	while (sz-- > 0) {
+		if (*s++ != 0)
+			return false;
+	}
+
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	ulong per_page, pages;
+	void *first, *spare, *p;
+	bool ok;
+	int i;
+
+	objs[0] = u_slab_alloc(&obj_slab);
+	check(obj_slab.live == 1 && obj_slab.peak == 1 && obj_slab.pages == 1,
+	      "first object takes a page");
+	per_page = obj_slab.free + 1;
+	check(per_page == (U_SLAB_PAGE - obj_slab.first) / obj_slab.size,
+	      "rest of the page is free");
+
+	for (i=1; i<OBJS; i++) {
+		objs[i] = u_slab_alloc(&obj_slab);
+		objs[i]->n = i;
+	}
+	pages = (OBJS + per_page - 1) / per_page;
+	check(obj_slab.live == OBJS && obj_slab.peak == OBJS,
+	      "live and peak count objects");
+	check(obj_slab.pages == pages &&
+	      obj_slab.free == pages * per_page - OBJS,
+	      "pages and free count what's been mapped");
+
+	first = objs[0];
+	u_slab_free(&obj_slab, objs[0]);
+	check(obj_slab.live == OBJS - 1 && obj_slab.peak == OBJS,
+	      "peak stays put when objects are freed");
+	objs[0] = u_slab_alloc(&obj_slab);
+	check(objs[0] == first, "freed objects are used again first");
+	strcpy(objs[0]->name, "dirty");
+	u_slab_free(&obj_slab, objs[0]);
+	objs[0] = u_slab_alloc(&obj_slab);
+	check(zeroed(objs[0], sizeof(struct obj)), "objects come back zeroed");
+
+	for (i=0; i<OBJS; i++)
+		u_slab_free(&obj_slab, objs[i]);
+	check(obj_slab.live == 0 && obj_slab.peak == OBJS,
+	      "everything freed");
+	check(obj_slab.pages == 1 && obj_slab.free == per_page,
+	      "only the spare page is kept");
+
+	spare = obj_slab.spare;
+	for (i=0, ok=true; i<OBJS; i++) {
+		if (mapped(objs[i]) != (PAGE_OF(objs[i]) == spare))
+			ok = false;
+	}
+	check(ok, "empty pages are unmapped");
+
+	p = u_slab_alloc(&obj_slab);
+	check(obj_slab.pages == 1 && PAGE_OF(p) == spare,
+	      "the spare is used before mapping a page");
+	u_slab_free(&obj_slab, p);
+
+	for (i=0, ok=true; i<100; i++) {
+		p = u_slab_alloc(&line_slab);
+		if ((uintptr_t) p % 64 != 0)
+			ok = false;
+	}
+	check(ok, "aligned slabs hand out aligned objects");
+
+	check(u_slabs == &line_slab && u_slabs->next == &obj_slab,
+	      "slabs are listed by name once used");
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,137 @@
+/* Tethys, eol.c -- line splitting benchmark
+   Copyright (C) 2014 Alex Iadicicco
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+#include <stdio.h>
+
+#include "ircd.h"
+
+/* Splits a TS6 burst the way dispatch_lines does, reading it in
+   IBUFSIZE pieces, and reports lines/sec for the old pair of memchr
+   calls and for u_strop_eol. Pass a captured burst as the argument, or
+   nothing to use a generated one. */
+
+#define IBUFSIZE 2048
+#define ROUNDS 20
+
+static char *burst;
+static size_t burstlen;
+
+static void generate(void)
+{
+	size_t i, n = 50000, sz = n * 160;
+	char *p;
+
+	p = burst = malloc(sz);
+
+	for (i=0; i<n; i++) {
+		if (i % 5 == 4) {
+			p += sprintf(p, ":22U SJOIN 1400000000 #chan%lu +nt :"
+			             "@22UAAA%03lu 22UAAB%03lu\r\n",
+			             i, i % 1000, (i + 1) % 1000);
+			continue;
+		}
+
+		p += sprintf(p, ":22U EUID user%lu 1 1400000000 +i ~user "
+		             "host%lu.example.net 10.0.%lu.%lu 22UA%05lu * * "
+		             ":Some User\r\n", i, i, (i >> 8) & 255, i & 255,
+		             i % 100000);
+	}
+
+	burstlen = p - burst;
+}
+
+static char *eol_memchr(char *s, size_t n)
+{
+	char *r = memchr(s, '\r', n);
+	char *l = memchr(s, '\n', n);
+
+	if (!r || (l && l < r))
+		r = l;
+	return r;
+}
+
+static ulong split(char *(*eol)(char*, size_t), bool resume)
+{
+	char ibuf[IBUFSIZE+1];
+	size_t ibuflen = 0, scan = 0, pos = 0, n;
+	char *buf, *s, *p;
+	ulong lines = 0;
+
+	while (pos < burstlen) {
+		n = IBUFSIZE - ibuflen;
+		if (n > burstlen - pos)
+			n = burstlen - pos;
+		memcpy(ibuf + ibuflen, burst + pos, n);
+		ibuflen += n;
+		pos += n;
+
+		buf = ibuf;
+		buf[ibuflen] = '\0';
+
+		while (ibuflen > 0) {
+			if (!(s = eol(buf + scan, ibuflen - scan))) {
+				scan = resume ? ibuflen : 0;
+				break;
+			}
+			scan = 0;
+
+			for (p = s; *p == '\r' || *p == '\n'; p++)
+				*p = '\0';
+			ibuflen -= p - buf;
+			buf = p;
+			lines++;
+		}
+
+		memmove(ibuf, buf, ibuflen);
+	}
+
+	return lines;
+}
+
+static void run(const char *name, char *(*eol)(char*, size_t), bool resume)
+{
+	struct timeval start, end;
+	double secs;
+	ulong lines = 0;
+	int i;
+
+	gettimeofday(&start, NULL);
+	for (i=0; i<ROUNDS; i++)
+		lines += split(eol, resume);
+	gettimeofday(&end, NULL);
+
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+	printf("%-12s %8lu lines  %8.3fs  %12.0f lines/sec\n", name,
+	       lines / ROUNDS, secs, lines / secs);
+}
+
+int main(int argc, char *argv[])
+{
+	FILE *f;
+	long sz;
+
+	if (argc > 1) {
+		if (!(f = fopen(argv[1], "rb"))) {
+			perror(argv[1]);
+			return 1;
+		}
+		fseek(f, 0, SEEK_END);
+		sz = ftell(f);
+		fseek(f, 0, SEEK_SET);
+		burst = malloc(sz);
+		burstlen = fread(burst, 1, sz, f);
+		fclose(f);
+	} else {
+		generate();
+	}
+
+	printf("%lu bytes\n", (ulong) burstlen);
+
+	run("memchr", eol_memchr, false);
+	run("u_strop_eol", u_strop_eol, true);
+
+	return 0;
+}
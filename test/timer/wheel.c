@@ -0,0 +1,158 @@
+/* Tethys, wheel.c -- timer wheel test and benchmark
+   Copyright (C) 2014 Alex Iadicicco
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+#include "ircd.h"
+#include "../bench.h"
+
+/* Sets a lot of timers the way connections would, some close and some
+   days away, and runs the clock forward a second at a time, checking
+   that each fires on the second it was due and no other. Some are set
+   again when they fire and some are deleted along the way. Then times
+   setting and running with 100k timers, the way a busy server would
+   have them. */
+
+struct timeval NOW;
+
+#define TIMERS 100000
+
+struct test_timer {
+	u_timer t;
+	ulong due;
+	uint fired;
+	bool again;
+};
+
+static struct test_timer *timers;
+static ulong early, late, fired;
+
+static void on_fire(u_timer *t)
+{
+	struct test_timer *tt = (struct test_timer*) t;
+
+	if ((ulong) NOW.tv_sec < tt->due)
+		early++;
+	if ((ulong) NOW.tv_sec > tt->due)
+		late++;
+
+	tt->fired++;
+	fired++;
+
+	/* the way a ping timer is set again when it goes off */
+	if (tt->again) {
+		tt->again = false;
+		tt->due = NOW.tv_sec + 300;
+		u_timer_set(t, 300);
+	}
+}
+
+static void set(struct test_timer *tt, uint secs)
+{
+	tt->due = NOW.tv_sec + (secs ? secs : 1);
+	u_timer_set(&tt->t, secs);
+}
+
+static int check(void)
+{
+	ulong i, n = 20000, deleted = 0, end;
+	int failures = 0;
+
+	NOW.tv_sec = 1000000;
+
+	for (i=0; i<n; i++) {
+		u_timer_init(&timers[i].t, on_fire);
+		timers[i].again = (i % 5 == 0);
+
+		switch (i % 4) {
+		case 0: set(timers + i, i % 70); break;
+		case 1: set(timers + i, 60 + i % 5000); break;
+		case 2: set(timers + i, 4000 + i * 13 % 300000); break;
+		case 3: set(timers + i, 300000 + i * 977 % 20000000); break;
+		}
+	}
+
+	end = NOW.tv_sec + 20400000;
+
+	while ((ulong) NOW.tv_sec < end) {
+		NOW.tv_sec++;
+
+		/* reset a few along the way, like activity on a link */
+		if (NOW.tv_sec % 1000 == 0) {
+			i = NOW.tv_sec / 1000 % n;
+			if (U_TIMER_IS_SET(&timers[i].t))
+				set(timers + i, 90);
+		}
+		if (NOW.tv_sec % 3001 == 0) {
+			i = NOW.tv_sec * 7 % n;
+			if (U_TIMER_IS_SET(&timers[i].t)) {
+				u_timer_del(&timers[i].t);
+				timers[i].due = 0;
+				deleted++;
+			}
+		}
+
+		u_timer_run();
+	}
+
+	for (i=0; i<n; i++) {
+		if (timers[i].due != 0 && timers[i].fired == 0)
+			failures++;
+		if (U_TIMER_IS_SET(&timers[i].t))
+			failures++;
+	}
+
+	printf("%lu fired, %lu deleted, %lu early, %lu late, %d lost\n",
+	       fired, deleted, early, late, failures);
+
+	return failures + early + late;
+}
+
+static void bench(void)
+{
+	struct timeval start;
+	ulong i, r;
+
+	NOW.tv_sec = 50000000;
+	u_timer_run();
+
+	gettimeofday(&start, NULL);
+	for (i=0; i<TIMERS; i++) {
+		u_timer_init(&timers[i].t, on_fire);
+		timers[i].again = false;
+		set(timers + i, 30 + i % 600);
+	}
+	printf("%-8s %8.1fns per timer\n", "set",
+	       since(&start) * 1e9 / TIMERS);
+
+	/* activity on every link rearms its timer */
+	gettimeofday(&start, NULL);
+	for (r=0; r<10; r++) {
+		for (i=0; i<TIMERS; i++)
+			set(timers + i, 30 + (i + r) % 600);
+	}
+	printf("%-8s %8.1fns per timer\n", "reset",
+	       since(&start) * 1e9 / TIMERS / 10);
+
+	fired = 0;
+	gettimeofday(&start, NULL);
+	for (r=0; r<700; r++) {
+		NOW.tv_sec++;
+		u_timer_run();
+	}
+	printf("%-8s %8.1fus per tick, %lu fired\n", "run",
+	       since(&start) * 1e6 / 700, fired);
+}
+
+int main(int argc, char *argv[])
+{
+	int failures;
+
+	timers = calloc(TIMERS, sizeof(*timers));
+
+	failures = check();
+	bench();
+
+	return failures ? 1 : 0;
+}